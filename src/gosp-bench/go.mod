@@ -0,0 +1,3 @@
+module go_server_pages
+
+go 1.15
@@ -0,0 +1,574 @@
+// gosp-bench replays recorded page requests against a gosp-server process and
+// reports the server's throughput, latency, allocation rate, and response
+// sizes.  It can also compare two plugin builds of the same page.
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"math"
+	"net"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"sort"
+	"strings"
+	"sync"
+	"text/tabwriter"
+	"time"
+)
+
+// Version defines the Go Server Pages version number.  It should be overridden
+// by the Makefile.
+var Version = "?.?.?"
+
+// notify is used to output error messages.
+var notify *log.Logger
+
+// defaultWorkDir is the Apache module's default work directory.
+const defaultWorkDir = "/var/cache/apache2/mod_gosp"
+
+// Parameters represents various parameters that control program operation.
+type Parameters struct {
+	RequestFile string        // File of recorded requests ("-" = standard input)
+	SocketName  string        // Unix socket (filename) on which gosp-server is listening
+	Plugins     []string      // Plugins for which to launch gosp-server (one, or two to compare)
+	GospServer  string        // gosp-server executable
+	Page        string        // If non-empty, replay only requests for this Gosp page
+	Rate        float64       // Requests per second to issue (open loop) or 0 for closed loop
+	Concurrency int           // Number of requests to keep outstanding (closed loop)
+	Duration    time.Duration // Time for which to issue requests
+	Count       int           // Number of requests to issue (overrides Duration if positive)
+	Warmup      int           // Number of unmeasured requests to issue first
+}
+
+// A Request is a recorded page request in the format gosp-server accepts.
+// We retain it in encoded form so it is replayed exactly as recorded.
+type Request []byte
+
+// stripKeys lists the top-level request fields we remove before replay.
+// BodyFDThreshold would cause the server to reply with a file descriptor,
+// which we cannot measure, and the rest do not request pages.
+var stripKeys = []string{"BodyFDThreshold", "GetPID", "ExitNow", "Profile", "Stats"}
+
+// ReadRequests reads a stream of JSON-encoded requests, such as one written by
+// the Apache module's GospCaptureRequests directive or one accepted by
+// gosp-server --file.  If page is non-empty, only requests for that page are
+// returned.
+func ReadRequests(r io.Reader, page string) ([]Request, error) {
+	var reqs []Request
+	dec := json.NewDecoder(bufio.NewReader(r))
+	for {
+		// Decode the next request.
+		var fields map[string]json.RawMessage
+		err := dec.Decode(&fields)
+		if err == io.EOF {
+			break
+		}
+		if err != nil {
+			return nil, err
+		}
+		if _, ok := fields["UserData"]; !ok {
+			continue // Not a page request
+		}
+
+		// Filter by page if so directed.
+		if page != "" {
+			var ud struct{ Filename string }
+			err = json.Unmarshal(fields["UserData"], &ud)
+			if err != nil {
+				return nil, err
+			}
+			if ud.Filename != page {
+				continue
+			}
+		}
+
+		// Re-encode the request.
+		for _, k := range stripKeys {
+			delete(fields, k)
+		}
+		enc, err := json.Marshal(fields)
+		if err != nil {
+			return nil, err
+		}
+		reqs = append(reqs, append(enc, '\n'))
+	}
+	if len(reqs) == 0 {
+		return nil, errors.New("no page requests were found")
+	}
+	return reqs, nil
+}
+
+// A Sample records the outcome of a single request.
+type Sample struct {
+	Latency time.Duration // Time from when the request should have been sent until the response was complete
+	Size    int64         // Number of bytes in the response
+	Err     error         // Error that occurred, if any
+}
+
+// Issue sends a request to gosp-server and reads the entire response.
+func Issue(sock string, req Request) (int64, error) {
+	conn, err := net.Dial("unix", sock)
+	if err != nil {
+		return 0, err
+	}
+	defer conn.Close()
+	_, err = conn.Write(req)
+	if err != nil {
+		return 0, err
+	}
+	n, err := io.Copy(ioutil.Discard, conn)
+	if err != nil {
+		return n, err
+	}
+	if n == 0 {
+		return 0, errors.New("empty response")
+	}
+	return n, nil
+}
+
+// QueryStats retrieves gosp-server's runtime statistics.
+func QueryStats(sock string) (map[string]interface{}, error) {
+	conn, err := net.Dial("unix", sock)
+	if err != nil {
+		return nil, err
+	}
+	defer conn.Close()
+	_, err = fmt.Fprintln(conn, `{"Stats": true}`)
+	if err != nil {
+		return nil, err
+	}
+	r := bufio.NewReader(conn)
+	hdr, err := r.ReadString('\n')
+	if err != nil {
+		return nil, err
+	}
+	if hdr != "gosp-stats\n" {
+		return nil, fmt.Errorf("unexpected response %q to a statistics request", strings.TrimSpace(hdr))
+	}
+	var st map[string]interface{}
+	err = json.NewDecoder(r).Decode(&st)
+	return st, err
+}
+
+// statDelta returns the change in a numeric runtime statistic.
+func statDelta(before, after map[string]interface{}, key string) float64 {
+	b, _ := before[key].(float64)
+	a, _ := after[key].(float64)
+	return a - b
+}
+
+// A Result summarizes a benchmark run.
+type Result struct {
+	Samples      []Sample      // Outcome of each measured request
+	Elapsed      time.Duration // Wall-clock time of the measured requests
+	BytesPerReq  float64       // Heap bytes allocated per request (NaN if unknown)
+	AllocsPerReq float64       // Heap objects allocated per request (NaN if unknown)
+	GCsPerReq    float64       // Garbage collections per request (NaN if unknown)
+}
+
+// Run replays requests against a socket as directed by the parameters.
+func Run(p *Parameters, sock string, reqs []Request) *Result {
+	// Warm up the server.
+	for i := 0; i < p.Warmup; i++ {
+		_, _ = Issue(sock, reqs[i%len(reqs)])
+	}
+
+	// Prepare to issue requests.
+	res := &Result{
+		BytesPerReq:  math.NaN(),
+		AllocsPerReq: math.NaN(),
+		GCsPerReq:    math.NaN(),
+	}
+	before, statErr := QueryStats(sock)
+	var mu sync.Mutex
+	var wg sync.WaitGroup
+	record := func(s Sample) {
+		mu.Lock()
+		res.Samples = append(res.Samples, s)
+		mu.Unlock()
+	}
+	start := time.Now()
+	more := func(i int) bool {
+		if p.Count > 0 {
+			return i < p.Count
+		}
+		return time.Since(start) < p.Duration
+	}
+
+	// Issue requests either at a fixed rate (open loop) or with a fixed
+	// number outstanding (closed loop).
+	if p.Rate > 0 {
+		// Measure latency from each request's scheduled start time so a
+		// slow server cannot hide its queueing delay.
+		interval := time.Duration(float64(time.Second) / p.Rate)
+		for i := 0; more(i); i++ {
+			sched := start.Add(time.Duration(i) * interval)
+			time.Sleep(time.Until(sched))
+			wg.Add(1)
+			go func(req Request) {
+				defer wg.Done()
+				n, err := Issue(sock, req)
+				record(Sample{Latency: time.Since(sched), Size: n, Err: err})
+			}(reqs[i%len(reqs)])
+		}
+	} else {
+		var next int
+		var nextMu sync.Mutex
+		for c := 0; c < p.Concurrency; c++ {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				for {
+					nextMu.Lock()
+					i := next
+					next++
+					nextMu.Unlock()
+					if !more(i) {
+						return
+					}
+					t0 := time.Now()
+					n, err := Issue(sock, reqs[i%len(reqs)])
+					record(Sample{Latency: time.Since(t0), Size: n, Err: err})
+				}
+			}()
+		}
+	}
+	wg.Wait()
+	res.Elapsed = time.Since(start)
+
+	// Compute allocation rates from the server's runtime statistics.
+	after, err := QueryStats(sock)
+	if statErr == nil && err == nil && len(res.Samples) > 0 {
+		n := float64(len(res.Samples))
+		res.BytesPerReq = statDelta(before, after, "TotalAlloc") / n
+		res.AllocsPerReq = statDelta(before, after, "Mallocs") / n
+		res.GCsPerReq = statDelta(before, after, "NumGC") / n
+	}
+	return res
+}
+
+// percentile returns the pth percentile of a sorted slice.
+func percentile(sorted []float64, p float64) float64 {
+	if len(sorted) == 0 {
+		return math.NaN()
+	}
+	i := int(math.Ceil(p/100*float64(len(sorted)))) - 1
+	if i < 0 {
+		i = 0
+	}
+	return sorted[i]
+}
+
+// A Metric is a named benchmark statistic.
+type Metric struct {
+	Name  string  // Description of the metric
+	Value float64 // Value of the metric
+	Unit  string  // Units in which Value is expressed
+}
+
+// Metrics summarizes a benchmark result as a list of metrics.
+func (res *Result) Metrics() []Metric {
+	// Separate successes from failures.
+	var lat, size []float64
+	nErr := 0
+	for _, s := range res.Samples {
+		if s.Err != nil {
+			nErr++
+			continue
+		}
+		lat = append(lat, float64(s.Latency)/float64(time.Millisecond))
+		size = append(size, float64(s.Size))
+	}
+	sort.Float64s(lat)
+	sort.Float64s(size)
+
+	// Summarize the samples.
+	ms := []Metric{
+		{"Requests", float64(len(res.Samples)), ""},
+		{"Errors", float64(nErr), ""},
+		{"Throughput", float64(len(lat)) / res.Elapsed.Seconds(), "req/s"},
+	}
+	for _, p := range []float64{50, 90, 99, 99.9, 100} {
+		name := fmt.Sprintf("Latency p%g", p)
+		if p == 100 {
+			name = "Latency max"
+		}
+		ms = append(ms, Metric{name, percentile(lat, p), "ms"})
+	}
+	for _, p := range []float64{0, 50, 90, 100} {
+		name := fmt.Sprintf("Response size p%g", p)
+		switch p {
+		case 0:
+			name = "Response size min"
+		case 100:
+			name = "Response size max"
+		}
+		ms = append(ms, Metric{name, percentile(size, p), "B"})
+	}
+	ms = append(ms,
+		Metric{"Allocated", res.BytesPerReq, "B/req"},
+		Metric{"Allocations", res.AllocsPerReq, "allocs/req"},
+		Metric{"Garbage collections", res.GCsPerReq, "GCs/req"})
+	return ms
+}
+
+// SizeHistogram returns the number of successful responses whose size lies in
+// each power-of-two range, keyed by the range's upper bound.
+func (res *Result) SizeHistogram() map[int64]int {
+	hist := make(map[int64]int)
+	for _, s := range res.Samples {
+		if s.Err != nil {
+			continue
+		}
+		var ub int64 = 1
+		for ub < s.Size {
+			ub *= 2
+		}
+		hist[ub]++
+	}
+	return hist
+}
+
+// formatValue formats a metric value for display.
+func formatValue(v float64, unit string) string {
+	switch {
+	case math.IsNaN(v):
+		return "n/a"
+	case v == math.Trunc(v) && math.Abs(v) < 1e15:
+		return strings.TrimSpace(fmt.Sprintf("%.0f %s", v, unit))
+	default:
+		return strings.TrimSpace(fmt.Sprintf("%.3f %s", v, unit))
+	}
+}
+
+// Report writes a human-readable summary of one or more benchmark results,
+// labeled by the given names.
+func Report(w io.Writer, names []string, results []*Result) {
+	// Write a table of metrics, one column per result.
+	tw := tabwriter.NewWriter(w, 0, 8, 2, ' ', tabwriter.AlignRight)
+	fmt.Fprint(tw, "\t")
+	for _, n := range names {
+		fmt.Fprintf(tw, "%s\t", n)
+	}
+	if len(results) == 2 {
+		fmt.Fprint(tw, "Change\t")
+	}
+	fmt.Fprintln(tw)
+	all := make([][]Metric, len(results))
+	for i, res := range results {
+		all[i] = res.Metrics()
+	}
+	for m := range all[0] {
+		fmt.Fprintf(tw, "%s\t", all[0][m].Name)
+		for i := range results {
+			fmt.Fprintf(tw, "%s\t", formatValue(all[i][m].Value, all[i][m].Unit))
+		}
+		if len(results) == 2 {
+			a, b := all[0][m].Value, all[1][m].Value
+			if a != 0 && !math.IsNaN(a) && !math.IsNaN(b) {
+				fmt.Fprintf(tw, "%+.1f%%\t", 100*(b-a)/a)
+			} else {
+				fmt.Fprint(tw, "\t")
+			}
+		}
+		fmt.Fprintln(tw)
+	}
+	tw.Flush()
+
+	// Write a histogram of response sizes for each result.
+	for i, res := range results {
+		hist := res.SizeHistogram()
+		ubs := make([]int64, 0, len(hist))
+		for ub := range hist {
+			ubs = append(ubs, ub)
+		}
+		sort.Slice(ubs, func(a, b int) bool { return ubs[a] < ubs[b] })
+		fmt.Fprintf(w, "\nResponse sizes (%s):\n", names[i])
+		tw = tabwriter.NewWriter(w, 0, 8, 2, ' ', tabwriter.AlignRight)
+		for _, ub := range ubs {
+			fmt.Fprintf(tw, "<= %d B\t%d\t\n", ub, hist[ub])
+		}
+		tw.Flush()
+	}
+}
+
+// A Server is a gosp-server process we launched.
+type Server struct {
+	Cmd    *exec.Cmd // The running process
+	Socket string    // Socket on which the process is listening
+	dir    string    // Temporary directory containing the socket
+}
+
+// LaunchServer launches gosp-server on a temporary socket to serve a plugin
+// and waits for it to start accepting connections.
+func LaunchServer(gospServer, plugin string) (*Server, error) {
+	dir, err := ioutil.TempDir("", "gosp-bench-")
+	if err != nil {
+		return nil, err
+	}
+	s := &Server{Socket: filepath.Join(dir, "page.sock"), dir: dir}
+	s.Cmd = exec.Command(gospServer, "-plugin", plugin, "-socket", s.Socket, "-max-idle", "0s")
+	s.Cmd.Stderr = os.Stderr
+	err = s.Cmd.Start()
+	if err != nil {
+		os.RemoveAll(dir)
+		return nil, err
+	}
+	for begin := time.Now(); time.Since(begin) < 10*time.Second; time.Sleep(10 * time.Millisecond) {
+		conn, err := net.Dial("unix", s.Socket)
+		if err == nil {
+			conn.Close()
+			return s, nil
+		}
+	}
+	s.Stop()
+	return nil, fmt.Errorf("gosp-server failed to start serving %s", plugin)
+}
+
+// Stop terminates a gosp-server process we launched.
+func (s *Server) Stop() {
+	conn, err := net.Dial("unix", s.Socket)
+	if err == nil {
+		fmt.Fprintln(conn, `{"ExitNow": true}`)
+		_, _ = io.Copy(ioutil.Discard, conn)
+		conn.Close()
+	} else {
+		_ = s.Cmd.Process.Kill()
+	}
+	_ = s.Cmd.Wait()
+	os.RemoveAll(s.dir)
+}
+
+// ParseCommandLine parses the command line into a Parameters struct.  It
+// aborts the program on error.
+func ParseCommandLine(p *Parameters) {
+	// Parse the command line.
+	wantVersion := flag.Bool("version", false, "Output the version number and exit")
+	flag.StringVar(&p.RequestFile, "requests", "",
+		`File of recorded requests ("-" for standard input)`)
+	flag.StringVar(&p.SocketName, "socket", "",
+		"Unix socket (filename) on which a running gosp-server is listening")
+	workDir := flag.String("work-dir", defaultWorkDir,
+		"Apache module's work directory, used to locate the socket for a named Gosp page")
+	plugin := flag.String("plugin", "",
+		"Plugin for which to launch a private gosp-server instead of using a running one")
+	compare := flag.String("compare", "",
+		"Second plugin to benchmark with the same requests and compare against --plugin")
+	flag.StringVar(&p.GospServer, "gosp-server", "gosp-server",
+		"gosp-server executable to launch for --plugin and --compare")
+	flag.Float64Var(&p.Rate, "rate", 0,
+		"Requests per second to issue (open loop) or 0 to keep --concurrency requests outstanding (closed loop)")
+	flag.IntVar(&p.Concurrency, "concurrency", 1,
+		"Number of requests to keep outstanding when --rate is 0")
+	flag.DurationVar(&p.Duration, "duration", 10*time.Second,
+		"Time for which to issue requests")
+	flag.IntVar(&p.Count, "count", 0,
+		"Number of requests to issue instead of running for --duration")
+	flag.IntVar(&p.Warmup, "warmup", 100,
+		"Number of unmeasured requests with which to warm up the server")
+	flag.Usage = func() {
+		fmt.Fprintf(flag.CommandLine.Output(), "Usage: %s --requests=file [options] [gosp-page]\n", os.Args[0])
+		flag.PrintDefaults()
+	}
+	flag.Parse()
+
+	// If requested, output the version number and exit.
+	if *wantVersion {
+		fmt.Fprintf(os.Stderr, "gosp-bench (Go Server Pages) %s\n", Version)
+		os.Exit(1)
+	}
+
+	// Validate the result.
+	if p.RequestFile == "" {
+		notify.Fatal("--requests is a required option")
+	}
+	if *compare != "" && *plugin == "" {
+		notify.Fatal("--compare requires --plugin")
+	}
+	if *plugin != "" {
+		p.Plugins = append(p.Plugins, *plugin)
+		if *compare != "" {
+			p.Plugins = append(p.Plugins, *compare)
+		}
+	}
+	switch {
+	case flag.NArg() > 1:
+		notify.Fatal("at most one Gosp page may be specified")
+	case flag.NArg() == 1:
+		abs, err := filepath.Abs(flag.Arg(0))
+		if err != nil {
+			notify.Fatal(err)
+		}
+		p.Page = abs
+	}
+	switch {
+	case p.SocketName != "" && len(p.Plugins) > 0:
+		notify.Fatal("--socket and --plugin are mutually exclusive")
+	case p.SocketName == "" && len(p.Plugins) == 0 && p.Page == "":
+		notify.Fatal("one of a Gosp page, --socket, or --plugin must be specified")
+	case p.SocketName == "" && len(p.Plugins) == 0:
+		p.SocketName = filepath.Join(*workDir, "sockets", p.Page) + ".sock"
+	}
+	if p.Rate < 0 {
+		notify.Fatal("--rate must be non-negative")
+	}
+	if p.Rate == 0 && p.Concurrency < 1 {
+		notify.Fatal("--concurrency must be positive")
+	}
+	if p.Count <= 0 && p.Duration <= 0 {
+		notify.Fatal("either --count or --duration must be positive")
+	}
+}
+
+func main() {
+	// Parse the command line.
+	notify = log.New(os.Stderr, os.Args[0]+": ", 0)
+	var p Parameters
+	ParseCommandLine(&p)
+
+	// Read the recorded requests.
+	var r io.Reader = os.Stdin
+	if p.RequestFile != "-" {
+		f, err := os.Open(p.RequestFile)
+		if err != nil {
+			notify.Fatal(err)
+		}
+		defer f.Close()
+		r = f
+	}
+	reqs, err := ReadRequests(r, p.Page)
+	if err != nil {
+		notify.Fatalf("%s: %v", p.RequestFile, err)
+	}
+
+	// Benchmark either a running server or one private server per plugin.
+	var names []string
+	var results []*Result
+	if p.SocketName != "" {
+		names = append(names, filepath.Base(p.SocketName))
+		results = append(results, Run(&p, p.SocketName, reqs))
+	}
+	for _, pl := range p.Plugins {
+		srv, err := LaunchServer(p.GospServer, pl)
+		if err != nil {
+			notify.Fatal(err)
+		}
+		names = append(names, pl)
+		results = append(results, Run(&p, srv.Socket, reqs))
+		srv.Stop()
+	}
+	if len(names) == 2 && filepath.Base(names[0]) != filepath.Base(names[1]) {
+		for i := range names {
+			names[i] = filepath.Base(names[i])
+		}
+	}
+	Report(os.Stdout, names, results)
+}
@@ -0,0 +1,247 @@
+// gosp-profile retrieves profiles and runtime statistics from a running
+// gosp-server process.
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"os"
+	"path/filepath"
+	"strings"
+	"time"
+)
+
+// Version defines the Go Server Pages version number.  It should be overridden
+// by the Makefile.
+var Version = "?.?.?"
+
+// notify is used to output error messages.
+var notify *log.Logger
+
+// defaultWorkDir is the Apache module's default work directory.
+const defaultWorkDir = "/var/cache/apache2/mod_gosp"
+
+// A ProfileRequest is the subset of gosp-server's ServiceRequest that
+// pertains to profiling.
+type ProfileRequest struct {
+	Profile        string  `json:",omitempty"` // Name of a runtime/pprof profile to retrieve
+	ProfileSeconds float64 `json:",omitempty"` // Seconds over which to collect a CPU, mutex, or block profile
+	ProfileDebug   int     `json:",omitempty"` // runtime/pprof debug level
+	Stats          bool    `json:",omitempty"` // If true, retrieve runtime statistics
+}
+
+// Parameters represents various parameters that control program operation.
+type Parameters struct {
+	SocketName  string         // Unix socket (filename) on which gosp-server is listening
+	OutFileName string         // Name of a file to which to write the result
+	Request     ProfileRequest // Request to send to gosp-server
+	WorkDir     string         // Apache module's work directory
+	Reoptimize  bool           // If true, discard plugins that are older than their PGO profiles
+	Pages       []string       // Gosp pages to re-optimize (empty = all)
+}
+
+// workFileForPage returns the name of a file the Apache module associates with
+// a given Gosp page.
+func workFileForPage(workDir, subdir, page, suffix string) string {
+	abs, err := filepath.Abs(page)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	return filepath.Join(workDir, subdir, abs) + suffix
+}
+
+// socketForPage returns the name of the socket the Apache module uses for a
+// given Gosp page.
+func socketForPage(workDir, page string) string {
+	return workFileForPage(workDir, "sockets", page, ".sock")
+}
+
+// ParseCommandLine parses the command line into a Parameters struct.  It
+// aborts the program on error.
+func ParseCommandLine(p *Parameters) {
+	// Parse the command line.
+	wantVersion := flag.Bool("version", false, "Output the version number and exit")
+	flag.StringVar(&p.SocketName, "socket", "",
+		"Unix socket (filename) on which gosp-server is listening")
+	flag.StringVar(&p.WorkDir, "work-dir", defaultWorkDir,
+		"Apache module's work directory, used to locate the socket, plugin, and profile for a named Gosp page")
+	flag.StringVar(&p.Request.Profile, "profile", "",
+		`Profile to retrieve: "cpu", "heap", "allocs", "goroutine", "mutex", "block", or "threadcreate"`)
+	dur := flag.Duration("duration", 30*time.Second,
+		"Time over which to collect a CPU, mutex, or block profile")
+	flag.IntVar(&p.Request.ProfileDebug, "debug", 0,
+		"Debug level for the profile (0 for binary pprof format; 1 or 2 for text)")
+	flag.BoolVar(&p.Request.Stats, "stats", false,
+		"Retrieve Go runtime statistics in JSON format")
+	flag.StringVar(&p.OutFileName, "o", "-",
+		`File to which to write the result ("-" for standard output)`)
+	flag.BoolVar(&p.Reoptimize, "reoptimize", false,
+		"Make the Apache module rebuild the named Gosp pages (default: all pages) whose profiles have changed")
+	flag.Usage = func() {
+		fmt.Fprintf(flag.CommandLine.Output(), "Usage: %s [options] [gosp-page]\n", os.Args[0])
+		fmt.Fprintf(flag.CommandLine.Output(), "       %s --reoptimize [--work-dir=dir] [gosp-page...]\n", os.Args[0])
+		flag.PrintDefaults()
+	}
+	flag.Parse()
+
+	// If requested, output the version number and exit.
+	if *wantVersion {
+		fmt.Fprintf(os.Stderr, "gosp-profile (Go Server Pages) %s\n", Version)
+		os.Exit(1)
+	}
+
+	// Re-optimization is a separate mode of operation.
+	if p.Reoptimize {
+		if p.SocketName != "" || p.Request.Profile != "" || p.Request.Stats {
+			notify.Fatal("--reoptimize cannot be combined with --socket, --profile, or --stats")
+		}
+		p.Pages = flag.Args()
+		return
+	}
+
+	// Validate the result.
+	switch {
+	case flag.NArg() > 1:
+		notify.Fatal("at most one Gosp page may be specified")
+	case flag.NArg() == 1 && p.SocketName != "":
+		notify.Fatal("a Gosp page and --socket are mutually exclusive")
+	case flag.NArg() == 1:
+		p.SocketName = socketForPage(p.WorkDir, flag.Arg(0))
+	case p.SocketName == "":
+		notify.Fatal("either a Gosp page or --socket must be specified")
+	}
+	if (p.Request.Profile == "") == !p.Request.Stats {
+		notify.Fatal("exactly one of --profile and --stats must be specified")
+	}
+	switch p.Request.Profile {
+	case "cpu":
+		if *dur <= 0 {
+			notify.Fatal("--duration must be positive for CPU profiles")
+		}
+		p.Request.ProfileSeconds = dur.Seconds()
+	case "mutex", "block":
+		p.Request.ProfileSeconds = dur.Seconds()
+	}
+}
+
+// Query sends a request to gosp-server and copies the response to w.
+func Query(p *Parameters, w io.Writer) error {
+	// Send the request.
+	conn, err := net.Dial("unix", p.SocketName)
+	if err != nil {
+		return err
+	}
+	defer conn.Close()
+	err = json.NewEncoder(conn).Encode(p.Request)
+	if err != nil {
+		return err
+	}
+
+	// Check the header line then copy the rest of the response.
+	r := bufio.NewReader(conn)
+	hdr, err := r.ReadString('\n')
+	if err != nil {
+		return fmt.Errorf("failed to read a response from %s (%v); is it a recent gosp-server?", p.SocketName, err)
+	}
+	hdr = strings.TrimSuffix(hdr, "\n")
+	switch {
+	case hdr == "gosp-profile", hdr == "gosp-stats":
+	case strings.HasPrefix(hdr, "gosp-error "):
+		return fmt.Errorf("%s", strings.TrimPrefix(hdr, "gosp-error "))
+	default:
+		return fmt.Errorf("unexpected response %q from %s", hdr, p.SocketName)
+	}
+	_, err = io.Copy(w, r)
+	return err
+}
+
+// reoptimizePage removes a Gosp page's plugin if the page's PGO profile is
+// newer.  The Apache module will then rebuild the plugin using the profile
+// and restart the page's server the next time the page is requested.
+func reoptimizePage(workDir, page string) error {
+	pgoFn := workFileForPage(workDir, "profiles", page, ".pgo")
+	plugFn := workFileForPage(workDir, "pages", page, ".so")
+	pgoInfo, err := os.Stat(pgoFn)
+	if err != nil {
+		return err
+	}
+	plugInfo, err := os.Stat(plugFn)
+	if os.IsNotExist(err) {
+		return nil // Nothing to do
+	}
+	if err != nil {
+		return err
+	}
+	if !pgoInfo.ModTime().After(plugInfo.ModTime()) {
+		return nil // Plugin is already up to date
+	}
+	fmt.Fprintf(os.Stderr, "Re-optimizing %s\n", page)
+	return os.Remove(plugFn)
+}
+
+// Reoptimize re-optimizes each Gosp page named in p.Pages or, if none are
+// named, every Gosp page for which a PGO profile exists.
+func Reoptimize(p *Parameters) error {
+	// Re-optimize the named pages.
+	if len(p.Pages) > 0 {
+		for _, pg := range p.Pages {
+			if err := reoptimizePage(p.WorkDir, pg); err != nil {
+				return err
+			}
+		}
+		return nil
+	}
+
+	// Re-optimize all pages with a profile.
+	top := filepath.Join(p.WorkDir, "profiles")
+	return filepath.Walk(top, func(fn string, info os.FileInfo, err error) error {
+		if err != nil {
+			return err
+		}
+		if info.IsDir() || !strings.HasSuffix(fn, ".pgo") {
+			return nil
+		}
+		pg := strings.TrimSuffix(strings.TrimPrefix(fn, top), ".pgo")
+		return reoptimizePage(p.WorkDir, pg)
+	})
+}
+
+func main() {
+	// Parse the command line.
+	notify = log.New(os.Stderr, os.Args[0]+": ", 0)
+	var p Parameters
+	ParseCommandLine(&p)
+
+	// Handle re-optimization requests.
+	if p.Reoptimize {
+		if err := Reoptimize(&p); err != nil {
+			notify.Fatal(err)
+		}
+		return
+	}
+
+	// Open the output file.
+	var w io.Writer = os.Stdout
+	if p.OutFileName != "-" {
+		f, err := os.Create(p.OutFileName)
+		if err != nil {
+			notify.Fatal(err)
+		}
+		defer func() {
+			if err := f.Close(); err != nil {
+				notify.Fatal(err)
+			}
+		}()
+		w = f
+	}
+
+	// Query the Gosp server.
+	if err := Query(&p, w); err != nil {
+		notify.Fatal(err)
+	}
+}
@@ -0,0 +1,55 @@
+// This file passes large page bodies to the Web server as a file descriptor
+// instead of copying them through the socket.
+
+package main
+
+import (
+	"bytes"
+	"errors"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"syscall"
+)
+
+// makeBodyFile writes a page body to an anonymous temporary file and
+// returns the file, positioned at the beginning.  It returns an error if the
+// body cannot be passed as a file descriptor over the given io.Writer.
+func makeBodyFile(w io.Writer, html *bytes.Buffer) (*os.File, error) {
+	// Descriptors can be passed only over Unix-domain sockets.
+	if _, ok := w.(*net.UnixConn); !ok {
+		return nil, errors.New("not a Unix-domain socket")
+	}
+
+	// Create a temporary file and unlink it immediately so it disappears
+	// as soon as both we and the Web server close it.
+	f, err := ioutil.TempFile("", "gosp-body-*")
+	if err != nil {
+		return nil, err
+	}
+	_ = os.Remove(f.Name())
+
+	// Copy the body into the file.  Leave html intact in case we need to
+	// fall back to sending it through the socket.
+	_, err = f.Write(html.Bytes())
+	if err == nil {
+		_, err = f.Seek(0, io.SeekStart)
+	}
+	if err != nil {
+		_ = f.Close()
+		return nil, err
+	}
+	return f, nil
+}
+
+// passBodyFile sends an open file's descriptor over a Unix-domain socket then
+// closes our copy of the file.  The descriptor accompanies a single newline
+// character of ordinary data.
+func passBodyFile(w io.Writer, f *os.File) error {
+	defer f.Close()
+	uc := w.(*net.UnixConn)
+	rights := syscall.UnixRights(int(f.Fd()))
+	_, _, err := uc.WriteMsgUnix([]byte{'\n'}, rights, nil)
+	return err
+}
@@ -0,0 +1,75 @@
+// This file places a Gosp server into a cgroup (v2) so its CPU and memory
+// usage can be limited independently of other pages' servers.
+
+package main
+
+import (
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+)
+
+// writeCgroupFile writes a value to one of a cgroup's control files.
+func writeCgroupFile(dir, name, value string) error {
+	fn := filepath.Join(dir, name)
+	err := ioutil.WriteFile(fn, []byte(value), 0644)
+	if err != nil {
+		return fmt.Errorf("failed to write %q to %s (%v)", value, fn, err)
+	}
+	return nil
+}
+
+// enableController ensures that a cgroup controller is enabled for a cgroup by
+// enabling it in the cgroup's parent if necessary.  The parent must contain
+// no processes of its own for this to succeed.
+func enableController(dir, ctl string) error {
+	parent := filepath.Dir(dir)
+	data, err := ioutil.ReadFile(filepath.Join(parent, "cgroup.subtree_control"))
+	if err != nil {
+		return fmt.Errorf("%s does not appear to lie within a cgroup v2 hierarchy (%v)", dir, err)
+	}
+	for _, c := range strings.Fields(string(data)) {
+		if c == ctl {
+			return nil
+		}
+	}
+	return writeCgroupFile(parent, "cgroup.subtree_control", "+"+ctl)
+}
+
+// JoinCgroup moves the current process into the cgroup named by p.Cgroup,
+// creating the cgroup if necessary and applying p.CPUWeight and p.MemoryMax
+// to it.  It does nothing if p.Cgroup is empty and aborts the program on
+// error.
+func JoinCgroup(p *Parameters) {
+	if p.Cgroup == "" {
+		return
+	}
+	err := os.MkdirAll(p.Cgroup, 0755)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	if p.CPUWeight > 0 {
+		err = enableController(p.Cgroup, "cpu")
+		if err == nil {
+			err = writeCgroupFile(p.Cgroup, "cpu.weight", fmt.Sprint(p.CPUWeight))
+		}
+		if err != nil {
+			notify.Fatal(err)
+		}
+	}
+	if p.MemoryMax != "" {
+		err = enableController(p.Cgroup, "memory")
+		if err == nil {
+			err = writeCgroupFile(p.Cgroup, "memory.max", p.MemoryMax)
+		}
+		if err != nil {
+			notify.Fatal(err)
+		}
+	}
+	err = writeCgroupFile(p.Cgroup, "cgroup.procs", fmt.Sprint(os.Getpid()))
+	if err != nil {
+		notify.Fatal(err)
+	}
+}
@@ -0,0 +1,99 @@
+// This file lets concurrent, identical requests share a single execution of
+// the user's Gosp page.
+
+package main
+
+import (
+	"bytes"
+	"gosp"
+	"io"
+	"strings"
+	"sync"
+)
+
+// A coalescedCall represents one in-flight execution of GospGeneratePage
+// whose output is shared by all of the requests that were coalesced into it.
+type coalescedCall struct {
+	done chan struct{} // Closed when resp is complete
+	resp []byte        // Complete response (metadata followed by data)
+}
+
+// A Coalescer merges concurrent, identical page requests into a single call
+// to LaunchPageGenerator and fans the result out to all waiters.
+type Coalescer struct {
+	mu    sync.Mutex                // Protects calls
+	calls map[string]*coalescedCall // In-flight calls, indexed by request key
+	vary  []string                  // Request headers that distinguish otherwise identical requests
+}
+
+// NewCoalescer returns a Coalescer that keys requests on their URI, query
+// arguments, and the named request headers.
+func NewCoalescer(vary []string) *Coalescer {
+	return &Coalescer{
+		calls: make(map[string]*coalescedCall),
+		vary:  vary,
+	}
+}
+
+// headerValue returns the value of a request header, ignoring case
+// differences in the header name.
+func headerValue(req *gosp.RequestData, name string) string {
+	if v, ok := req.HeaderData[name]; ok {
+		return v
+	}
+	for k, v := range req.HeaderData {
+		if strings.EqualFold(k, name) {
+			return v
+		}
+	}
+	return ""
+}
+
+// Key returns a string that is identical for all requests that are allowed to
+// share a response.  It returns the empty string for requests that must not
+// be coalesced (e.g., anything other than a GET request).
+func (c *Coalescer) Key(req *gosp.RequestData) string {
+	if req.Method != "GET" || len(req.PostData) > 0 {
+		return ""
+	}
+	var key strings.Builder
+	key.WriteString(req.URI)
+	key.WriteByte(0)
+	key.WriteString(req.PathInfo)
+	key.WriteByte(0)
+	key.WriteString(req.QueryArgs)
+	for _, h := range c.vary {
+		key.WriteByte(0)
+		key.WriteString(headerValue(req, h))
+	}
+	return key.String()
+}
+
+// Do invokes gen to produce a response for the given key unless another
+// goroutine is already doing so, in which case it waits for that goroutine's
+// response.  Either way, it returns the complete response.
+func (c *Coalescer) Do(key string, gen func(io.Writer)) []byte {
+	// Join an existing call if there is one.
+	c.mu.Lock()
+	if call, ok := c.calls[key]; ok {
+		c.mu.Unlock()
+		<-call.done
+		return call.resp
+	}
+	call := &coalescedCall{done: make(chan struct{})}
+	c.calls[key] = call
+	c.mu.Unlock()
+
+	// Generate the response ourselves then wake up everyone waiting on it.
+	// Requests that arrive after this point start a new call.
+	defer func() {
+		c.mu.Lock()
+		delete(c.calls, key)
+		c.mu.Unlock()
+		close(call.done)
+	}()
+	var buf bytes.Buffer
+	gen(&buf)
+	call.resp = buf.Bytes()
+	return call.resp
+}
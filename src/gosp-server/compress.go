@@ -0,0 +1,140 @@
+// This file compresses page bodies before they are sent to the Web server,
+// splicing in page text that gosp2go compressed when the page was built.
+
+package main
+
+import (
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"hash/crc32"
+	"io"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// minCompressSize is the smallest page body, in bytes, worth compressing.
+const minCompressSize = 512
+
+// gzipHeader is the fixed, 10-byte header we write at the start of every gzip
+// stream: magic number, DEFLATE method, no flags, no modification time, no
+// extra flags, and an unknown operating system.
+var gzipHeader = []byte{0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255}
+
+// flateWriters pools DEFLATE compressors, whose internal state is large and
+// expensive to allocate for every response.
+var flateWriters = sync.Pool{
+	New: func() interface{} {
+		fw, _ := flate.NewWriter(nil, flate.DefaultCompression)
+		return fw
+	},
+}
+
+// A staticSpan identifies a range of a pageBuffer that holds precompressed
+// page text.
+type staticSpan struct {
+	start, end int    // Byte offsets of the text within the buffer
+	deflated   string // The same text as raw DEFLATE blocks ending with a sync flush
+}
+
+// A pageBuffer accumulates a page's output, remembering which parts of it
+// gosp2go precompressed.  It implements gosp.StaticWriter.
+type pageBuffer struct {
+	bytes.Buffer
+	statics []staticSpan // Precompressed spans, in order of appearance
+}
+
+// WriteStatic appends page text to the buffer and records its precompressed
+// form.
+func (pb *pageBuffer) WriteStatic(text, deflated string) (int, error) {
+	start := pb.Len()
+	n, err := pb.WriteString(text)
+	if err == nil && deflated != "" {
+		pb.statics = append(pb.statics, staticSpan{start: start, end: start + n, deflated: deflated})
+	}
+	return n, err
+}
+
+// compressionEnabled reports whether a request's page body should be
+// compressed when the client accepts compressed responses.
+func compressionEnabled(p *Parameters, sr *ServiceRequest) bool {
+	return sr != nil && (sr.Compress || p.Compress)
+}
+
+// acceptsGzip reports whether an Accept-Encoding header value admits gzip
+// encoding, honoring "q=0" refusals and the "*" wildcard.
+func acceptsGzip(ae string) bool {
+	wildcard := false
+	for _, item := range strings.Split(ae, ",") {
+		fields := strings.Split(item, ";")
+		coding := strings.ToLower(strings.TrimSpace(fields[0]))
+		q := 1.0
+		for _, param := range fields[1:] {
+			param = strings.TrimSpace(param)
+			if len(param) > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=' {
+				if v, err := strconv.ParseFloat(param[2:], 64); err == nil {
+					q = v
+				}
+			}
+		}
+		switch coding {
+		case "gzip", "x-gzip":
+			return q > 0
+		case "*":
+			wildcard = q > 0
+		}
+	}
+	return wildcard
+}
+
+// compressible reports whether a MIME type denotes content that is likely to
+// benefit from compression.
+func compressible(mt string) bool {
+	if i := strings.IndexByte(mt, ';'); i >= 0 {
+		mt = mt[:i]
+	}
+	mt = strings.ToLower(strings.TrimSpace(mt))
+	switch {
+	case strings.HasPrefix(mt, "text/"):
+		return true
+	case strings.HasSuffix(mt, "+xml"), strings.HasSuffix(mt, "+json"):
+		return true
+	}
+	switch mt {
+	case "application/json", "application/javascript", "application/xml",
+		"application/xhtml+xml", "image/svg+xml":
+		return true
+	}
+	return false
+}
+
+// gzipPage compresses a page body into a gzip stream.  Dynamic output is
+// compressed with a pooled compressor.  Precompressed spans are copied as is,
+// with the compressor flushed to a byte boundary before each span and reset
+// after it so no back-reference crosses a span boundary.
+func gzipPage(pb *pageBuffer) *bytes.Buffer {
+	data := pb.Bytes()
+	out := bytes.NewBuffer(make([]byte, 0, len(data)/3+64))
+	out.Write(gzipHeader)
+	fw := flateWriters.Get().(*flate.Writer)
+	defer flateWriters.Put(fw)
+	fw.Reset(out)
+	pos := 0
+	for _, s := range pb.statics {
+		if s.start > pos {
+			_, _ = fw.Write(data[pos:s.start])
+			_ = fw.Flush()
+		}
+		_, _ = io.WriteString(out, s.deflated)
+		fw.Reset(out)
+		pos = s.end
+	}
+	_, _ = fw.Write(data[pos:])
+	_ = fw.Close()
+	var trailer [8]byte
+	binary.LittleEndian.PutUint32(trailer[0:], crc32.ChecksumIEEE(data))
+	binary.LittleEndian.PutUint32(trailer[4:], uint32(len(data)))
+	out.Write(trailer[:])
+	return out
+}
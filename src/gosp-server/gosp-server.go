@@ -1,7 +1,7 @@
 // gosp-server launches a server process that accepts requests on a local
-// socket and sends back metadata followed by data (e.g., HTML).  As an option,
+// socket and sends back metadata followed by data (e.g., HTML).  As options,
 // it can generate the data directly as a one-shot execution rather than from a
-// persistent server process.
+// persistent server process, or it can serve HTTP requests itself.
 package main
 
 import (
@@ -43,7 +43,15 @@ func main() {
 	notify = log.New(os.Stderr, os.Args[0]+": ", 0)
 	var p Parameters
 	ParseCommandLine(&p)
+	if p.Spare {
+		AwaitSpawn(&p)
+	}
+	if p.ZygoteSocket != "" {
+		notify.Fatal(StartZygote(&p))
+	}
+	JoinCgroup(&p)
 	LoadPlugin(&p)
+	gosp.SetFragmentCacheSize(p.FragmentCache)
 	if p.DryRun {
 		os.Exit(0)
 	}
@@ -55,6 +63,8 @@ func main() {
 		err = GospRequestFromFile(&p)
 	case p.SocketName != "":
 		err = StartServer(&p)
+	case p.HTTPAddr != "":
+		err = StartHTTPServer(&p)
 	default:
 		LaunchPageGenerator(&p, os.Stdout, nil)
 	}
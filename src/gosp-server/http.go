@@ -0,0 +1,307 @@
+// This file serves page requests directly over HTTP, with no intervening Web
+// server.
+
+package main
+
+import (
+	"context"
+	"fmt"
+	"gosp"
+	"io"
+	"net"
+	"net/http"
+	"os"
+	"os/signal"
+	"strconv"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+// maxPostSize is the maximum number of bytes of POST data we accept.  It
+// matches GOSP_MAX_POST_SIZE in the Apache module.
+const maxPostSize = 1048576
+
+// writeHTTPMetadata is a helper routine for LaunchPageGenerator that maps
+// HTTP metadata onto the response headers of an http.ResponseWriter.  It
+// returns an HTTP status as a string.  Early hints are sent as they arrive,
+// as are the headers if the page flushes them.  If the page asked to send a
+// file in place of its own output, writeHTTPMetadata additionally writes that
+// file as the response body.
+func writeHTTPMetadata(gospOut io.Writer, meta chan gosp.KeyValue) string {
+	// Read metadata from GospGeneratePage until no more remains.
+	w := gospOut.(http.ResponseWriter)
+	hdr := w.Header()
+	hdr.Set("Content-Type", "text/html")
+	status := okStr
+	sendFile := ""
+	contentLength := ""
+	flushed := false
+	for kv := range meta {
+		switch kv.Key {
+		case "mime-type":
+			hdr.Set("Content-Type", kv.Value)
+		case "http-status":
+			if flushed {
+				notify.Printf("ignoring HTTP status %s, which arrived after the headers were sent", kv.Value)
+				break
+			}
+			status = kv.Value
+		case "header-field":
+			// The value is "<replace> <key> <value>".
+			fields := strings.SplitN(kv.Value, " ", 3)
+			if len(fields) < 3 {
+				break
+			}
+			if fields[0] == "true" {
+				hdr.Set(fields[1], fields[2])
+			} else {
+				hdr.Add(fields[1], fields[2])
+			}
+		case "error-message":
+			notify.Print(kv.Value)
+		case "send-file":
+			sendFile = kv.Value
+		case "content-length":
+			contentLength = kv.Value
+		case "early-hints":
+			if flushed {
+				break
+			}
+			prev, had := hdr["Link"]
+			hdr.Set("Link", kv.Value)
+			w.WriteHeader(http.StatusEarlyHints)
+			if had {
+				hdr["Link"] = prev
+			} else {
+				hdr.Del("Link")
+			}
+		case "flush-headers":
+			if flushed || status != okStr {
+				break
+			}
+			w.WriteHeader(http.StatusOK)
+			if f, ok := w.(http.Flusher); ok {
+				f.Flush()
+			}
+			flushed = true
+		}
+	}
+	if flushed {
+		return status
+	}
+
+	// Write the HTTP status.
+	code, err := strconv.Atoi(status)
+	if err != nil || code < 100 || code > 999 {
+		notify.Printf("invalid HTTP status %q", status)
+		code = http.StatusInternalServerError
+		status = fmt.Sprint(code)
+	}
+	if status != okStr || sendFile == "" {
+		if status == okStr && contentLength != "" {
+			hdr.Set("Content-Length", contentLength)
+		}
+		w.WriteHeader(code)
+		return status
+	}
+
+	// Send the requested file.
+	f, err := os.Open(sendFile)
+	if err != nil {
+		notify.Print(err)
+		w.WriteHeader(http.StatusNotFound)
+		return fmt.Sprint(http.StatusNotFound)
+	}
+	defer f.Close()
+	if fi, err := f.Stat(); err == nil {
+		hdr.Set("Content-Length", fmt.Sprint(fi.Size()))
+	}
+	w.WriteHeader(code)
+	_, _ = io.Copy(w, f)
+	return status
+}
+
+// splitQuery splits a raw query string into {key, value} pairs the same way
+// the Apache module does, without unescaping either.  Later values replace
+// earlier values for the same key.
+func splitQuery(q string) map[string]string {
+	m := make(map[string]string)
+	for _, kv := range strings.Split(q, "&") {
+		if kv == "" {
+			continue
+		}
+		eq := strings.IndexByte(kv, '=')
+		if eq < 0 {
+			m[kv] = ""
+		} else {
+			m[kv[:eq]] = kv[eq+1:]
+		}
+	}
+	return m
+}
+
+// requestData converts an HTTP request to the gosp.RequestData that the Apache
+// module would have produced for it.
+func requestData(p *Parameters, r *http.Request) (*gosp.RequestData, error) {
+	// Determine the local host and port.
+	scheme := "http"
+	if r.TLS != nil {
+		scheme = "https"
+	}
+	host, portStr, err := net.SplitHostPort(r.Host)
+	if err != nil {
+		host = r.Host
+		portStr = ""
+	}
+	if portStr == "" {
+		if la, ok := r.Context().Value(http.LocalAddrContextKey).(net.Addr); ok {
+			_, portStr, _ = net.SplitHostPort(la.String())
+		}
+	}
+	port, _ := strconv.Atoi(portStr)
+
+	// Determine the remote host.
+	rhost, rport, err := net.SplitHostPort(r.RemoteAddr)
+	if err != nil {
+		rhost = r.RemoteAddr
+	}
+
+	// Parse POST data.
+	var post map[string]string
+	if r.Method == http.MethodPost {
+		r.Body = http.MaxBytesReader(nil, r.Body, maxPostSize)
+		if err := r.ParseForm(); err != nil {
+			return nil, err
+		}
+		post = make(map[string]string, len(r.PostForm))
+		for k, vs := range r.PostForm {
+			post[k] = vs[len(vs)-1]
+		}
+	}
+
+	// Convert the request headers to a map.
+	hdrs := make(map[string]string, len(r.Header)+1)
+	hdrs["Host"] = r.Host
+	for k, vs := range r.Header {
+		hdrs[k] = strings.Join(vs, ", ")
+	}
+
+	// Provide the CGI variables Apache would pass in its environment.
+	env := map[string]string{
+		"GATEWAY_INTERFACE": "CGI/1.1",
+		"SERVER_SOFTWARE":   "gosp-server/" + Version,
+		"SERVER_PROTOCOL":   r.Proto,
+		"SERVER_NAME":       host,
+		"SERVER_PORT":       fmt.Sprint(port),
+		"REQUEST_METHOD":    r.Method,
+		"REQUEST_URI":       r.RequestURI,
+		"REQUEST_SCHEME":    scheme,
+		"QUERY_STRING":      r.URL.RawQuery,
+		"SCRIPT_NAME":       r.URL.Path,
+		"SCRIPT_FILENAME":   p.PageName,
+		"REMOTE_ADDR":       rhost,
+		"REMOTE_PORT":       rport,
+	}
+	if scheme == "https" {
+		env["HTTPS"] = "on"
+	}
+
+	// Construct a complete URL.
+	url := scheme + "://" + r.Host + r.RequestURI
+	return &gosp.RequestData{
+		Scheme:         scheme,
+		LocalHostname:  host,
+		Port:           port,
+		URI:            r.URL.Path,
+		QueryArgs:      r.URL.RawQuery,
+		URL:            url,
+		Method:         r.Method,
+		RequestLine:    fmt.Sprintf("%s %s %s", r.Method, r.RequestURI, r.Proto),
+		RequestTime:    time.Now().UnixNano(),
+		RemoteHostname: rhost,
+		RemoteIP:       rhost,
+		Filename:       p.PageName,
+		PostData:       post,
+		GetData:        splitQuery(r.URL.RawQuery),
+		HeaderData:     hdrs,
+		Environment:    env,
+	}, nil
+}
+
+// An httpHandler passes HTTP requests to the user's Gosp page.
+type httpHandler struct {
+	p    *Parameters  // Program parameters
+	idle *IdleMonitor // Monitor of the server's activity
+}
+
+// ServeHTTP responds to a single HTTP request.
+func (h httpHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	start := time.Now()
+	h.idle.Touch()
+	rd, err := requestData(h.p, r)
+	if err != nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+	sr := ServiceRequest{UserData: *rd, decodeTime: time.Since(start)}
+	atomic.AddUint64(&pagesServed, 1)
+	LaunchPageGenerator(h.p, w, &sr)
+}
+
+// StartHTTPServer runs the program as a standalone HTTP/1.1 server, passing
+// every request it receives to the user's Gosp page.  The server shuts down
+// cleanly, letting in-flight requests complete, when sent SIGINT or SIGTERM
+// or once the IdleMonitor decides it has been idle for long enough.
+func StartHTTPServer(p *Parameters) error {
+	// Server code should write only to the io.Writer it's given and not
+	// read at all.
+	_ = os.Stdin.Close()
+	_ = os.Stdout.Close()
+	chdirOrAbort(p.PageName)
+
+	// Configure an HTTP server with timeouts suitable for direct exposure
+	// to clients.
+	idle := NewIdleMonitor(p)
+	srv := &http.Server{
+		Addr:              p.HTTPAddr,
+		Handler:           httpHandler{p: p, idle: idle},
+		ReadHeaderTimeout: 10 * time.Second,
+		ReadTimeout:       30 * time.Second,
+		WriteTimeout:      60 * time.Second,
+		IdleTimeout:       2 * time.Minute,
+		MaxHeaderBytes:    64 * 1024,
+		ErrorLog:          notify,
+	}
+
+	// Request a shutdown on SIGINT or SIGTERM.
+	stop := make(chan os.Signal, 1)
+	signal.Notify(stop, syscall.SIGINT, syscall.SIGTERM)
+
+	// Request a shutdown after a sufficient time of no activity.
+	go idle.Run(func() {
+		stop <- syscall.SIGTERM
+	})
+
+	// Periodically profile the page if so directed.
+	if p.PGOProfile != "" {
+		go CollectPGOProfiles(p.PGOProfile, p.PGODuration, p.PGOInterval)
+	}
+
+	// Serve requests until we're told to stop.
+	done := make(chan error, 1)
+	go func() {
+		<-stop
+		ctx, cancel := context.WithTimeout(context.Background(), 30*time.Second)
+		defer cancel()
+		err := srv.Shutdown(ctx)
+		idle.Save()
+		done <- err
+	}()
+	err := srv.ListenAndServe()
+	if err != http.ErrServerClosed {
+		return err
+	}
+	return <-done
+}
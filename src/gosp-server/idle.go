@@ -0,0 +1,188 @@
+// This file decides when an idle server should exit.
+
+package main
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// maxIdleGaps is the number of recent inter-arrival times on which an
+// adaptive idle timeout is based.
+const maxIdleGaps = 32
+
+// minIdleGaps is the number of inter-arrival times that must be observed
+// before an adaptive idle timeout replaces the fixed one.
+const minIdleGaps = 4
+
+// minIdleTimeout is the smallest idle timeout an adaptive timeout can select.
+const minIdleTimeout = 10 * time.Second
+
+// An idleHistory records a page's recent inter-arrival times across server
+// restarts.
+type idleHistory struct {
+	LastActive time.Time       // Time at which the previous server last saw a request
+	Gaps       []time.Duration // Recent inter-arrival times, oldest first
+}
+
+// An IdleMonitor tracks a server's activity and calls a function once the
+// server has been idle for long enough.  Request handlers merely increment a
+// counter, which a background goroutine samples periodically.  If adaptive
+// idle timeouts are enabled, the timeout follows the page's recent
+// inter-arrival times, which can persist across server restarts.
+type IdleMonitor struct {
+	activity    uint64        // Number of requests received (accessed atomically)
+	mu          sync.Mutex    // Protects hist and idleSince
+	base        time.Duration // Idle timeout to use when no better estimate is available
+	max         time.Duration // Largest adaptive idle timeout or 0 for a fixed timeout
+	historyFile string        // File in which to persist inter-arrival times or "" for none
+	hist        idleHistory   // Inter-arrival times and the time of the most recent request
+	idleSince   time.Time     // Time since which the server has been idle
+}
+
+// NewIdleMonitor returns an IdleMonitor configured by the program parameters,
+// initializing its history from p.IdleHistory if that file exists.
+func NewIdleMonitor(p *Parameters) *IdleMonitor {
+	m := &IdleMonitor{
+		base:        p.AutoKillTime,
+		max:         p.AdaptiveIdleTime,
+		historyFile: p.IdleHistory,
+		idleSince:   time.Now(),
+	}
+	if m.historyFile == "" {
+		return m
+	}
+	data, err := ioutil.ReadFile(m.historyFile)
+	if err == nil {
+		err = json.Unmarshal(data, &m.hist)
+	}
+	if err != nil && !os.IsNotExist(err) {
+		notify.Printf("ignoring idle history %s (%v)", m.historyFile, err)
+		m.hist = idleHistory{}
+	}
+	return m
+}
+
+// Touch records that the server received a request.  It is safe to call from
+// multiple goroutines.
+func (m *IdleMonitor) Touch() {
+	atomic.AddUint64(&m.activity, 1)
+}
+
+// Timeout returns the length of idle time after which the server should exit.
+// With adaptive timeouts, this is 1.5 times the 90th percentile of recent
+// inter-arrival times, provided that doesn't exceed the adaptive maximum.
+// Pages requested less often than that, and pages with too little history,
+// use the fixed timeout.
+func (m *IdleMonitor) Timeout() time.Duration {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if m.max <= 0 || len(m.hist.Gaps) < minIdleGaps {
+		return m.base
+	}
+	gaps := append([]time.Duration(nil), m.hist.Gaps...)
+	sort.Slice(gaps, func(i, j int) bool { return gaps[i] < gaps[j] })
+	want := gaps[len(gaps)*9/10] * 3 / 2
+	switch {
+	case want > m.max:
+		return m.base
+	case want < minIdleTimeout:
+		return minIdleTimeout
+	default:
+		return want
+	}
+}
+
+// observe records activity seen at a given time, noting the inter-arrival
+// time if it is long enough to have been measured by a sampling interval of
+// tick.
+func (m *IdleMonitor) observe(now time.Time, tick time.Duration) {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if !m.hist.LastActive.IsZero() {
+		if gap := now.Sub(m.hist.LastActive); gap >= 2*tick {
+			m.hist.Gaps = append(m.hist.Gaps, gap)
+			if len(m.hist.Gaps) > maxIdleGaps {
+				m.hist.Gaps = m.hist.Gaps[len(m.hist.Gaps)-maxIdleGaps:]
+			}
+		}
+	}
+	m.hist.LastActive = now
+	m.idleSince = now
+}
+
+// Save writes the monitor's history to its history file, if any.  The file is
+// replaced atomically so a concurrently starting server never reads a partial
+// history.
+func (m *IdleMonitor) Save() {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if m.historyFile == "" || m.hist.LastActive.IsZero() {
+		return
+	}
+	data, err := json.Marshal(m.hist)
+	if err == nil {
+		err = os.MkdirAll(filepath.Dir(m.historyFile), 0755)
+	}
+	var f *os.File
+	if err == nil {
+		f, err = ioutil.TempFile(filepath.Dir(m.historyFile), filepath.Base(m.historyFile)+".*")
+	}
+	if err == nil {
+		_, err = f.Write(data)
+		if cerr := f.Close(); err == nil {
+			err = cerr
+		}
+		if err == nil {
+			err = os.Chmod(f.Name(), 0644)
+		}
+		if err == nil {
+			err = os.Rename(f.Name(), m.historyFile)
+		}
+		if err != nil {
+			_ = os.Remove(f.Name())
+		}
+	}
+	if err != nil {
+		notify.Printf("failed to write idle history %s (%v)", m.historyFile, err)
+	}
+}
+
+// Run samples the activity counter until the server has been idle for
+// Timeout(), then saves the monitor's history and calls exit.  Run returns
+// immediately if the fixed timeout is zero, meaning the server should never
+// exit when idle.
+func (m *IdleMonitor) Run(exit func()) {
+	if m.base <= 0 {
+		return
+	}
+	tick := m.base / 20
+	switch {
+	case tick < 100*time.Millisecond:
+		tick = 100 * time.Millisecond
+	case tick > 5*time.Second:
+		tick = 5 * time.Second
+	}
+	prev := atomic.LoadUint64(&m.activity)
+	for now := range time.Tick(tick) {
+		if cur := atomic.LoadUint64(&m.activity); cur != prev {
+			prev = cur
+			m.observe(now, tick)
+			continue
+		}
+		m.mu.Lock()
+		idle := now.Sub(m.idleSince)
+		m.mu.Unlock()
+		if idle >= m.Timeout() {
+			m.Save()
+			exit()
+			return
+		}
+	}
+}
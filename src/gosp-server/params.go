@@ -8,6 +8,7 @@ import (
 	"gosp"
 	"io"
 	"os"
+	"strings"
 	"time"
 )
 
@@ -22,12 +23,33 @@ type MetadataWriter func(gospOut io.Writer, meta chan gosp.KeyValue) string
 // Parameters represents various parameters that control program operation.
 type Parameters struct {
 	SocketName       string         // Unix socket (filename) on which to listen for JSON requests
+	RingName         string         // File backing a shared-memory ring through which to accept page requests or "" for none
 	FileName         string         // Name of a file from which to read a JSON request
 	PluginName       string         // Name of a plugin file that provides a GospGeneratePage function
 	AutoKillTime     time.Duration  // Amount of idle time after which the program should automatically exit
+	AdaptiveIdleTime time.Duration  // Largest idle time that adapts to the page's request pattern or 0 for none
+	IdleHistory      string         // File in which to persist the page's recent inter-arrival times
 	WriteMetadata    MetadataWriter // Function that writes HTTP metadata in some particular format
 	GospGeneratePage PageGenerator  // Go Server Page as a function from a plugin
 	DryRun           bool           // If true, exit the program after parsing the command line and loading the plugin
+	Coalesce         bool           // If true, let concurrent, identical GET requests share a single page execution
+	CoalesceVary     []string       // Request headers that distinguish otherwise identical coalesced requests
+	PGOProfile       string         // Name of a file to which to periodically write a CPU profile for profile-guided optimization
+	PGODuration      time.Duration  // Time over which to collect each PGO profile
+	PGOInterval      time.Duration  // Time between successive PGO profiles
+	HTTPAddr         string         // TCP address on which to serve HTTP requests directly
+	PageName         string         // Name of the Gosp page from which the plugin was built
+	ZygoteSocket     string         // Unix socket (filename) on which to listen for requests to spawn Gosp servers
+	Spares           int            // Number of spare processes a zygote keeps running
+	Spare            bool           // If true, wait for a zygote to provide our command-line arguments
+	Ready            func()         // Function to call once the server is listening for requests
+	Supervise        bool           // If true, a zygote restarts the servers it launches if they crash
+	HealthInterval   time.Duration  // Time between a supervising zygote's health checks of its servers
+	Cgroup           string         // cgroup (v2) directory into which to move the server or "" for none
+	CPUWeight        int            // cpu.weight to assign to Cgroup or 0 to leave it unchanged
+	MemoryMax        string         // memory.max to assign to Cgroup or "" to leave it unchanged
+	Compress         bool           // If true, gzip-compress page bodies for clients that accept it
+	FragmentCache    int64          // Capacity in bytes of the cache of <?go:cache?> fragments
 }
 
 // ParseCommandLine parses the command line to fill in some of the fields of a
@@ -37,16 +59,56 @@ func ParseCommandLine(p *Parameters) {
 	wantVersion := flag.Bool("version", false, "Output the version number and exit")
 	flag.StringVar(&p.SocketName, "socket", "",
 		"Unix socket (filename) on which to listen for JSON requests")
+	flag.StringVar(&p.RingName, "ring", "",
+		"File to create to back a shared-memory ring through which to accept page requests (used with --socket)")
 	flag.StringVar(&p.FileName, "file", "",
 		"File name from which to read a JSON request")
 	flag.StringVar(&p.PluginName, "plugin", "",
 		"Name of a plugin compiled from a Go Server Page by gosp2go")
 	flag.DurationVar(&p.AutoKillTime, "max-idle", 5*time.Minute,
 		"Maximum idle time before automatic server exit or 0s for infinite")
+	flag.DurationVar(&p.AdaptiveIdleTime, "adaptive-idle", 0,
+		"Largest idle time before automatic server exit that adapts to the page's request pattern or 0s to always use --max-idle")
+	flag.StringVar(&p.IdleHistory, "idle-history", "",
+		"File in which to persist the page's recent inter-arrival times across server restarts")
 	flag.BoolVar(&p.DryRun, "dry-run", false,
 		"If specified, exit before serving any files")
 	hType := flag.String("http-headers", "mod_gosp",
 		`HTTP header format: "mod_gosp", "raw", or "none"`)
+	flag.BoolVar(&p.Coalesce, "coalesce", false,
+		"If specified, let concurrent, identical GET requests share a single page execution")
+	vary := flag.String("coalesce-vary", "",
+		"Comma-separated list of request headers that distinguish coalesced requests")
+	flag.BoolVar(&p.Compress, "compress", false,
+		"If specified, gzip-compress page bodies for clients that accept gzip encoding")
+	flag.StringVar(&p.PGOProfile, "pgo-profile", "",
+		"File to which to periodically write a CPU profile for profile-guided optimization")
+	flag.DurationVar(&p.PGODuration, "pgo-duration", 30*time.Second,
+		"Time over which to collect each profile written to --pgo-profile")
+	flag.DurationVar(&p.PGOInterval, "pgo-interval", 10*time.Minute,
+		"Time between the starts of successive profiles written to --pgo-profile")
+	flag.StringVar(&p.HTTPAddr, "http", "",
+		`TCP address (e.g., ":8080") on which to serve HTTP requests directly`)
+	flag.StringVar(&p.PageName, "page", "",
+		"Name of the Gosp page from which the plugin was built (used with --http)")
+	flag.StringVar(&p.ZygoteSocket, "zygote", "",
+		"Unix socket (filename) on which to listen for requests to spawn Gosp servers")
+	flag.IntVar(&p.Spares, "spares", 2,
+		"Number of pre-initialized processes a zygote keeps ready to become Gosp servers")
+	flag.BoolVar(&p.Supervise, "supervise", false,
+		"If specified, have the zygote restart crashed or unresponsive servers and run until asked to shut down")
+	flag.DurationVar(&p.HealthInterval, "health-interval", 10*time.Second,
+		"Time between a supervising zygote's health checks of its servers or 0s for none")
+	flag.BoolVar(&p.Spare, "spare", false,
+		"Wait for a zygote to provide the remaining command-line arguments (internal use only)")
+	flag.StringVar(&p.Cgroup, "cgroup", "",
+		"cgroup (v2) directory, created if necessary, into which to move the server")
+	flag.IntVar(&p.CPUWeight, "cpu-weight", 0,
+		"CPU weight (1-10000) to assign to the --cgroup cgroup")
+	flag.StringVar(&p.MemoryMax, "memory-max", "",
+		`Memory limit in bytes, optionally with a "K", "M", or "G" suffix, to assign to the --cgroup cgroup`)
+	flag.Int64Var(&p.FragmentCache, "fragment-cache", gosp.DefaultFragmentCacheSize,
+		"Capacity in bytes of the cache of page fragments marked with go:cache or 0 to disable caching")
 	flag.Parse()
 
 	// If requested, output the version number and exit.
@@ -55,21 +117,83 @@ func ParseCommandLine(p *Parameters) {
 		os.Exit(1)
 	}
 
+	// A spare learns its real arguments later, and a zygote loads no
+	// plugin.
+	if p.Spare {
+		return
+	}
+	if p.ZygoteSocket != "" {
+		if p.PluginName != "" || p.SocketName != "" || p.FileName != "" || p.HTTPAddr != "" {
+			notify.Fatal("--zygote cannot be combined with --plugin, --socket, --file, or --http")
+		}
+		if p.Spares < 1 {
+			notify.Fatal("--spares must be at least 1")
+		}
+		return
+	}
+	if p.Supervise {
+		notify.Fatal("--supervise requires --zygote")
+	}
+
 	// Validate the result.
 	if p.PluginName == "" {
 		notify.Fatal("--plugin is a required option")
 	}
-	if p.SocketName != "" && p.FileName != "" {
-		notify.Fatal("--socket and --file are mutually exclusive")
+	nModes := 0
+	for _, m := range []string{p.SocketName, p.FileName, p.HTTPAddr} {
+		if m != "" {
+			nModes++
+		}
+	}
+	if nModes > 1 {
+		notify.Fatal("--socket, --file, and --http are mutually exclusive")
+	}
+	if p.RingName != "" && p.SocketName == "" {
+		notify.Fatal("--ring requires --socket")
+	}
+	if p.HTTPAddr != "" && p.Coalesce {
+		notify.Fatal("--coalesce is not supported with --http")
 	}
-	switch *hType {
-	case "mod_gosp":
+	if p.Cgroup == "" && (p.CPUWeight != 0 || p.MemoryMax != "") {
+		notify.Fatal("--cpu-weight and --memory-max require --cgroup")
+	}
+	if p.CPUWeight < 0 || p.CPUWeight > 10000 {
+		notify.Fatal("--cpu-weight must lie in the range 1 to 10000")
+	}
+	if p.PGOProfile != "" && (p.PGODuration <= 0 || p.PGOInterval < p.PGODuration) {
+		notify.Fatal("--pgo-duration must be positive and no greater than --pgo-interval")
+	}
+	switch {
+	case p.HTTPAddr != "":
+		// Metadata always become HTTP response headers.
+		p.WriteMetadata = writeHTTPMetadata
+	case *hType == "mod_gosp":
 		p.WriteMetadata = writeModGospMetadata
-	case "raw":
+	case *hType == "raw":
 		p.WriteMetadata = writeRawMetadata
-	case "none":
+	case *hType == "none":
 		p.WriteMetadata = writeNoMetadata
 	default:
 		notify.Fatalf("%q is not a valid argument to --http-headers", *hType)
 	}
+
+	// A standalone HTTP server should not exit when idle unless the user
+	// asks it to.
+	if p.HTTPAddr != "" {
+		idleSet := false
+		flag.Visit(func(f *flag.Flag) {
+			if f.Name == "max-idle" {
+				idleSet = true
+			}
+		})
+		if !idleSet {
+			p.AutoKillTime = 0
+		}
+	}
+	for _, h := range strings.Split(*vary, ",") {
+		h = strings.TrimSpace(h)
+		if h != "" {
+			p.CoalesceVary = append(p.CoalesceVary, h)
+		}
+	}
 }
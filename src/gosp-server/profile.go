@@ -0,0 +1,201 @@
+// This file lets an operator profile a running Gosp server and query its
+// runtime statistics.
+
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"gosp"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"runtime"
+	"runtime/pprof"
+	"sync/atomic"
+	"time"
+)
+
+// pagesServed counts the page requests the server has received.  It lets
+// CollectPGOProfiles avoid replacing a useful profile with one from an idle
+// server.
+var pagesServed uint64
+
+// startTime is the time at which the server started running.
+var startTime = time.Now()
+
+// RuntimeStats represents a snapshot of a Gosp server's Go runtime
+// statistics.
+type RuntimeStats struct {
+	PID           int               // Process ID
+	GoVersion     string            // Go version with which the server was built
+	Uptime        float64           // Time in seconds since the server started
+	GOMAXPROCS    int               // Maximum number of CPUs executing Go code simultaneously
+	NumGoroutine  int               // Number of existing goroutines
+	HeapAlloc     uint64            // Bytes of allocated heap objects
+	HeapInuse     uint64            // Bytes in in-use heap spans
+	HeapObjects   uint64            // Number of allocated heap objects
+	HeapSys       uint64            // Bytes of heap memory obtained from the OS
+	Sys           uint64            // Total bytes of memory obtained from the OS
+	TotalAlloc    uint64            // Cumulative bytes allocated for heap objects
+	Mallocs       uint64            // Cumulative count of heap objects allocated
+	Frees         uint64            // Cumulative count of heap objects freed
+	NumGC         uint32            // Number of completed GC cycles
+	PauseTotalNs  uint64            // Cumulative nanoseconds in GC stop-the-world pauses
+	RecentPauseNs []uint64          // Most recent GC pause times in nanoseconds, newest first
+	GCCPUFraction float64           // Fraction of available CPU time used by the GC
+	LastGC        time.Time         // Time at which the last GC finished
+	Caches        []gosp.CacheStats // Statistics of each gosp.Cache, including the fragment cache
+	Pools         []gosp.PoolStats  // Statistics of each gosp.Pool
+}
+
+// GetRuntimeStats returns a snapshot of the server's runtime statistics.
+func GetRuntimeStats() RuntimeStats {
+	var ms runtime.MemStats
+	runtime.ReadMemStats(&ms)
+	st := RuntimeStats{
+		PID:           os.Getpid(),
+		GoVersion:     runtime.Version(),
+		Uptime:        time.Since(startTime).Seconds(),
+		GOMAXPROCS:    runtime.GOMAXPROCS(0),
+		NumGoroutine:  runtime.NumGoroutine(),
+		HeapAlloc:     ms.HeapAlloc,
+		HeapInuse:     ms.HeapInuse,
+		HeapObjects:   ms.HeapObjects,
+		HeapSys:       ms.HeapSys,
+		Sys:           ms.Sys,
+		TotalAlloc:    ms.TotalAlloc,
+		Mallocs:       ms.Mallocs,
+		Frees:         ms.Frees,
+		NumGC:         ms.NumGC,
+		PauseTotalNs:  ms.PauseTotalNs,
+		GCCPUFraction: ms.GCCPUFraction,
+		LastGC:        time.Unix(0, int64(ms.LastGC)),
+		Caches:        gosp.AllCacheStats(),
+		Pools:         gosp.AllPoolStats(),
+	}
+	n := int(ms.NumGC)
+	if n > len(ms.PauseNs) {
+		n = len(ms.PauseNs)
+	}
+	for i := 0; i < n; i++ {
+		idx := (int(ms.NumGC) - 1 - i + len(ms.PauseNs)) % len(ms.PauseNs)
+		st.RecentPauseNs = append(st.RecentPauseNs, ms.PauseNs[idx])
+	}
+	return st
+}
+
+// WriteStats writes the server's runtime statistics in JSON format, preceded
+// by a "gosp-stats" line.
+func WriteStats(w io.Writer) error {
+	fmt.Fprintln(w, "gosp-stats")
+	enc := json.NewEncoder(w)
+	enc.SetIndent("", "  ")
+	return enc.Encode(GetRuntimeStats())
+}
+
+// writeProfileData writes the named profile to w.  CPU profiles are collected
+// for the given duration, as are mutex and block profiles if the duration is
+// positive.  The latter two kinds of profiling are disabled afterwards.
+func writeProfileData(w io.Writer, name string, d time.Duration, debug int) error {
+	switch name {
+	case "cpu":
+		if err := pprof.StartCPUProfile(w); err != nil {
+			return err
+		}
+		time.Sleep(d)
+		pprof.StopCPUProfile()
+		return nil
+	case "mutex":
+		if d > 0 && runtime.SetMutexProfileFraction(-1) == 0 {
+			runtime.SetMutexProfileFraction(1)
+			time.Sleep(d)
+			defer runtime.SetMutexProfileFraction(0)
+		}
+	case "block":
+		if d > 0 {
+			runtime.SetBlockProfileRate(1)
+			time.Sleep(d)
+			defer runtime.SetBlockProfileRate(0)
+		}
+	}
+	prof := pprof.Lookup(name)
+	if prof == nil {
+		return fmt.Errorf("unknown profile %q", name)
+	}
+	return prof.WriteTo(w, debug)
+}
+
+// WriteProfile writes the named profile, preceded by a "gosp-profile" line.
+// On error it instead writes a "gosp-error" line.
+func WriteProfile(w io.Writer, name string, d time.Duration, debug int) {
+	// Validate the profile name before writing anything.
+	if name != "cpu" && pprof.Lookup(name) == nil {
+		fmt.Fprintf(w, "gosp-error unknown profile %q\n", name)
+		return
+	}
+	if name == "cpu" && d <= 0 {
+		fmt.Fprintln(w, "gosp-error a positive duration is required for CPU profiles")
+		return
+	}
+
+	// Write the profile.  Once the header line is sent, errors can only be
+	// logged.
+	fmt.Fprintln(w, "gosp-profile")
+	if err := writeProfileData(w, name, d, debug); err != nil {
+		notify.Print(err)
+	}
+}
+
+// writePGOProfile collects a CPU profile for the given duration and atomically
+// replaces the named file with it unless no pages were served during that
+// time.
+func writePGOProfile(fn string, d time.Duration) error {
+	// Write the profile to a temporary file in the same directory.
+	f, err := ioutil.TempFile(filepath.Dir(fn), filepath.Base(fn)+".*")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(f.Name())
+	before := atomic.LoadUint64(&pagesServed)
+	err = writeProfileData(f, "cpu", d, 0)
+	if err != nil {
+		f.Close()
+		return err
+	}
+	err = f.Close()
+	if err != nil {
+		return err
+	}
+	if atomic.LoadUint64(&pagesServed) == before {
+		return nil
+	}
+
+	// Rename the temporary file so gosp2go never sees a partial profile.
+	err = os.Chmod(f.Name(), 0644)
+	if err != nil {
+		return err
+	}
+	return os.Rename(f.Name(), fn)
+}
+
+// CollectPGOProfiles runs indefinitely.  At launch and every interval
+// thereafter it collects a CPU profile over the given duration and writes it to
+// the named file, from which gosp2go can perform profile-guided optimization.
+// Failures, such as a CPU profile already being collected on behalf of
+// gosp-profile, are logged and otherwise ignored.
+func CollectPGOProfiles(fn string, d, interval time.Duration) {
+	err := os.MkdirAll(filepath.Dir(fn), 0755)
+	if err != nil {
+		notify.Print(err)
+		return
+	}
+	for {
+		err = writePGOProfile(fn, d)
+		if err != nil {
+			notify.Printf("failed to write profile %s (%v)", fn, err)
+		}
+		time.Sleep(interval - d)
+	}
+}
@@ -0,0 +1,304 @@
+// This file lets a Gosp server accept page requests through a shared-memory
+// ring in addition to its Unix-domain socket.  The ring avoids the connect,
+// accept, and per-read system calls of the socket for small pages.  Its
+// layout must be kept consistent with the ring code in comm.c.
+
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// Define the ring's geometry.  The module reads the geometry from the ring's
+// header, so these values can change without changing the module.
+const (
+	ringMagic          = 0x52505347 // "GSPR" in little-endian byte order
+	ringVersion        = 1          // Version of the ring layout
+	ringHeaderSize     = 64         // Bytes reserved for the header
+	ringSlots          = 64         // Number of request slots
+	ringSlotHeaderSize = 64         // Bytes reserved for each slot's header
+	ringSlotSize       = 65536 - ringSlotHeaderSize
+)
+
+// Define the byte offsets of the fields of the ring's header.  Each is a
+// 32-bit unsigned integer in host byte order.
+const (
+	hdrMagic         = 0  // ringMagic
+	hdrVersion       = 4  // ringVersion
+	hdrNumSlots      = 8  // Number of slots
+	hdrSlotSize      = 12 // Number of data bytes per slot
+	hdrServerPID     = 16 // Process ID of the Gosp server
+	hdrDoorbell      = 20 // Counter the module increments after posting a request
+	hdrServerWaiting = 24 // 1 if the server is sleeping on the doorbell
+	hdrNextSlot      = 28 // Counter the module uses to spread out slot allocations
+)
+
+// Define the byte offsets of the fields of each slot's header.
+const (
+	slotState     = 0 // One of the slot states below
+	slotLength    = 4 // Number of valid bytes in the slot's data
+	slotClientPID = 8 // Process ID of the Apache process that claimed the slot
+)
+
+// Enumerate the states a slot can be in.  The module claims a FREE slot,
+// writes a request, and marks it REQUEST.  The server marks it BUSY, writes
+// the response one slot-full at a time, marking each CHUNK until the module
+// has consumed it, and marks the final piece DONE.  The module then marks the
+// slot FREE.  A module that gives up on a request marks the slot
+// ABANDONED_REQUEST (not yet seen by the server) or ABANDONED (seen by the
+// server), and the server frees it.
+const (
+	slotFree uint32 = iota
+	slotClaimed
+	slotRequest
+	slotBusy
+	slotChunk
+	slotDone
+	slotAbandonedRequest
+	slotAbandoned
+)
+
+// Define the futex operations we use.
+const (
+	futexWaitOp = 0 // FUTEX_WAIT
+	futexWakeOp = 1 // FUTEX_WAKE
+)
+
+// ringCheckInterval is the longest the server sleeps on a futex before
+// checking for requests or clients that have gone away.
+const ringCheckInterval = time.Second
+
+// errRingAbandoned is returned by writes to a slot whose request the module
+// abandoned.
+var errRingAbandoned = errors.New("the Web server abandoned the request")
+
+// A Ring is a shared-memory region through which the module sends page
+// requests and receives responses.
+type Ring struct {
+	name string // Name of the file backing the ring
+	mem  []byte // Ring contents
+}
+
+// CreateRing creates and maps a ring backed by the named file, replacing any
+// existing ring.  The file is written under a temporary name and renamed
+// into place so the module never maps a partially initialized ring.
+func CreateRing(name string) (*Ring, error) {
+	f, err := ioutil.TempFile(filepath.Dir(name), filepath.Base(name)+".*")
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	size := ringHeaderSize + ringSlots*(ringSlotHeaderSize+ringSlotSize)
+	err = f.Truncate(int64(size))
+	if err != nil {
+		_ = os.Remove(f.Name())
+		return nil, err
+	}
+	mem, err := syscall.Mmap(int(f.Fd()), 0, size, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		_ = os.Remove(f.Name())
+		return nil, err
+	}
+	rg := &Ring{name: name, mem: mem}
+	*rg.word(hdrMagic) = ringMagic
+	*rg.word(hdrVersion) = ringVersion
+	*rg.word(hdrNumSlots) = ringSlots
+	*rg.word(hdrSlotSize) = ringSlotSize
+	*rg.word(hdrServerPID) = uint32(os.Getpid())
+	err = os.Rename(f.Name(), name)
+	if err != nil {
+		_ = os.Remove(f.Name())
+		_ = syscall.Munmap(mem)
+		return nil, err
+	}
+	return rg, nil
+}
+
+// Remove removes the file backing the ring so the module stops sending
+// requests through it.  The mapping itself remains valid until the process
+// exits.
+func (rg *Ring) Remove() {
+	_ = os.Remove(rg.name)
+}
+
+// word returns a pointer to the 32-bit word at a given byte offset into the
+// ring.
+func (rg *Ring) word(off int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&rg.mem[off]))
+}
+
+// slotWord returns a pointer to a field of a slot's header.
+func (rg *Ring) slotWord(i, field int) *uint32 {
+	return rg.word(ringHeaderSize + i*(ringSlotHeaderSize+ringSlotSize) + field)
+}
+
+// slotData returns a slot's data area.
+func (rg *Ring) slotData(i int) []byte {
+	off := ringHeaderSize + i*(ringSlotHeaderSize+ringSlotSize) + ringSlotHeaderSize
+	return rg.mem[off : off+ringSlotSize]
+}
+
+// futexWait sleeps until another process wakes addr, *addr no longer equals
+// val, or the timeout expires.
+func futexWait(addr *uint32, val uint32, timeout time.Duration) {
+	ts := syscall.NsecToTimespec(int64(timeout))
+	_, _, _ = syscall.Syscall6(syscall.SYS_FUTEX, uintptr(unsafe.Pointer(addr)),
+		futexWaitOp, uintptr(val), uintptr(unsafe.Pointer(&ts)), 0, 0)
+}
+
+// futexWake wakes one process sleeping on addr.
+func futexWake(addr *uint32) {
+	_, _, _ = syscall.Syscall6(syscall.SYS_FUTEX, uintptr(unsafe.Pointer(addr)),
+		futexWakeOp, 1, 0, 0, 0)
+}
+
+// processExists reports whether a process with the given ID is running.
+func processExists(pid uint32) bool {
+	return pid == 0 || syscall.Kill(int(pid), 0) != syscall.ESRCH
+}
+
+// Serve accepts page requests from the ring until the process exits,
+// passing each to handle in a goroutine of its own.
+func (rg *Ring) Serve(handle func(w io.Writer, sr *ServiceRequest)) {
+	doorbell := rg.word(hdrDoorbell)
+	waiting := rg.word(hdrServerWaiting)
+	for {
+		// Start every pending request.
+		seq := atomic.LoadUint32(doorbell)
+		found := false
+		for i := 0; i < ringSlots; i++ {
+			state := rg.slotWord(i, slotState)
+			if atomic.CompareAndSwapUint32(state, slotRequest, slotBusy) {
+				found = true
+				go rg.serveSlot(i, handle)
+				continue
+			}
+			atomic.CompareAndSwapUint32(state, slotAbandonedRequest, slotFree)
+		}
+		if found {
+			continue
+		}
+
+		// Sleep until the module rings the doorbell.  On a timeout,
+		// reclaim slots held by Apache processes that have exited.
+		atomic.StoreUint32(waiting, 1)
+		futexWait(doorbell, seq, ringCheckInterval)
+		atomic.StoreUint32(waiting, 0)
+		if atomic.LoadUint32(doorbell) == seq {
+			rg.reclaimSlots()
+		}
+	}
+}
+
+// reclaimSlots frees slots holding responses for Apache processes that no
+// longer exist.
+func (rg *Ring) reclaimSlots() {
+	for i := 0; i < ringSlots; i++ {
+		state := rg.slotWord(i, slotState)
+		if atomic.LoadUint32(state) != slotDone {
+			continue
+		}
+		if !processExists(atomic.LoadUint32(rg.slotWord(i, slotClientPID))) {
+			atomic.CompareAndSwapUint32(state, slotDone, slotFree)
+		}
+	}
+}
+
+// serveSlot decodes the request in a BUSY slot, passes it to handle, and
+// writes the response back into the slot.
+func (rg *Ring) serveSlot(i int, handle func(w io.Writer, sr *ServiceRequest)) {
+	start := time.Now()
+	w := &ringWriter{rg: rg, slot: i}
+	n := atomic.LoadUint32(rg.slotWord(i, slotLength))
+	var sr ServiceRequest
+	if n <= ringSlotSize && json.Unmarshal(rg.slotData(i)[:n], &sr) == nil {
+		// The page body always travels through the ring, never as a
+		// file descriptor.
+		sr.BodyFDThreshold = 0
+		sr.decodeTime = time.Since(start)
+		handle(w, &sr)
+	}
+	w.finish()
+}
+
+// A ringWriter is an io.Writer that writes a response into a ring slot,
+// handing the module one slot-full at a time.
+type ringWriter struct {
+	rg        *Ring // Ring containing the slot
+	slot      int   // Slot number
+	n         int   // Number of bytes buffered in the slot
+	abandoned bool  // true if the module abandoned the request
+}
+
+// Write copies data into the slot, waiting for the module to consume each
+// slot-full before writing more.
+func (w *ringWriter) Write(p []byte) (int, error) {
+	data := w.rg.slotData(w.slot)
+	total := len(p)
+	for len(p) > 0 {
+		if w.abandoned {
+			return total - len(p), errRingAbandoned
+		}
+		if w.n == len(data) {
+			w.publish(slotChunk)
+			continue
+		}
+		c := copy(data[w.n:], p)
+		w.n += c
+		p = p[c:]
+	}
+	return total, nil
+}
+
+// finish hands the module the final piece of the response.
+func (w *ringWriter) finish() {
+	if !w.abandoned {
+		w.publish(slotDone)
+	}
+}
+
+// publish hands the module the data buffered in the slot, marking the slot
+// with the given state.  For a CHUNK, it then waits for the module to consume
+// the data or, if the module has exited, gives up on the request.
+func (w *ringWriter) publish(newState uint32) {
+	state := w.rg.slotWord(w.slot, slotState)
+	atomic.StoreUint32(w.rg.slotWord(w.slot, slotLength), uint32(w.n))
+	if !atomic.CompareAndSwapUint32(state, slotBusy, newState) {
+		// The module abandoned the request.
+		atomic.StoreUint32(state, slotFree)
+		w.abandoned = true
+		return
+	}
+	futexWake(state)
+	if newState != slotChunk {
+		return
+	}
+	for {
+		switch atomic.LoadUint32(state) {
+		case slotBusy:
+			w.n = 0
+			return
+		case slotAbandoned:
+			atomic.StoreUint32(state, slotFree)
+			w.abandoned = true
+			return
+		}
+		if !processExists(atomic.LoadUint32(w.rg.slotWord(w.slot, slotClientPID))) {
+			if atomic.CompareAndSwapUint32(state, slotChunk, slotFree) {
+				w.abandoned = true
+				return
+			}
+			continue
+		}
+		futexWait(state, slotChunk, ringCheckInterval)
+	}
+}
@@ -3,7 +3,6 @@
 package main
 
 import (
-	"bytes"
 	"encoding/json"
 	"fmt"
 	"gosp"
@@ -12,6 +11,8 @@ import (
 	"net/http"
 	"os"
 	"path/filepath"
+	"strconv"
+	"strings"
 	"sync"
 	"sync/atomic"
 	"time"
@@ -19,35 +20,132 @@ import (
 
 // A ServiceRequest is a request for service sent to us by the Web server.
 type ServiceRequest struct {
-	UserData gosp.RequestData // Data to pass to the user's code
-	GetPID   bool             // If true, respond with our process ID
-	ExitNow  bool             // If true, shut down the program cleanly
+	UserData        gosp.RequestData // Data to pass to the user's code
+	GetPID          bool             // If true, respond with our process ID
+	ExitNow         bool             // If true, shut down the program cleanly
+	BodyFDThreshold int64            // If positive, pass page bodies of at least this many bytes as a file descriptor
+	WantTiming      bool             // If true, report the time spent in each server-side phase of the request
+	Profile         string           // If non-empty, respond with the named runtime/pprof profile
+	ProfileSeconds  float64          // Number of seconds over which to collect a CPU, mutex, or block profile
+	ProfileDebug    int              // Debug level to pass to runtime/pprof (0 for binary output)
+	Stats           bool             // If true, respond with Go runtime statistics
+	Compress        bool             // If true, gzip-compress the page body if the client accepts it
+
+	decodeTime time.Duration // Time spent receiving and decoding the request
+}
+
+// serverTiming returns a metadata item reporting the time spent in a named
+// phase of processing a request.
+func serverTiming(name string, d time.Duration) gosp.KeyValue {
+	return gosp.KeyValue{
+		Key:   "server-timing",
+		Value: fmt.Sprintf("%s %d", name, d.Microseconds()),
+	}
 }
 
 // okStr represents an HTTP success code as a string.
 var okStr = fmt.Sprint(http.StatusOK)
 
 // LaunchPageGenerator starts GospGeneratePage in a separate goroutine and
-// waits for it to finish.
-func LaunchPageGenerator(p *Parameters, gospOut io.Writer, gospReq *gosp.RequestData) {
+// waits for it to finish.  sr can be nil, in which case GospGeneratePage is
+// given no request data.
+func LaunchPageGenerator(p *Parameters, gospOut io.Writer, sr *ServiceRequest) {
 	// Spawn GospGeneratePage, giving it a buffer in which to write the
 	// page data and a channel in which to send metadata.
-	html := bytes.NewBuffer(nil)
-	meta := make(chan gosp.KeyValue, 5)
-	go p.GospGeneratePage(gospReq, html, meta)
+	var gospReq *gosp.RequestData
+	if sr != nil {
+		gospReq = &sr.UserData
+	}
+	html := &pageBuffer{}
+	body := &html.Buffer
+	pageMeta := make(chan gosp.KeyValue, 5)
+	pageStart := time.Now()
+	go p.GospGeneratePage(gospReq, html, pageMeta)
 
 	// Tell the server what we think its JSON request is.
+	meta := make(chan gosp.KeyValue, 5)
 	meta <- gosp.KeyValue{
 		Key:   "debug-message",
 		Value: sanitizeString(fmt.Sprintf("Handling %#v", gospReq)),
 	}
 
+	// Relay metadata from GospGeneratePage to the metadata writer.  Once
+	// the page is complete, append metadata describing how the page data
+	// will be delivered.
+	var bodyFile *os.File
+	sendingFile := false
+	go func() {
+		status := okStr
+		mimeType := "text/html"
+		encoded := false
+		flushed := false
+		for kv := range pageMeta {
+			switch kv.Key {
+			case "http-status":
+				status = kv.Value
+			case "send-file":
+				sendingFile = true
+			case "mime-type":
+				mimeType = kv.Value
+			case "flush-headers":
+				flushed = true
+			case "header-field":
+				fields := strings.SplitN(kv.Value, " ", 3)
+				if len(fields) > 1 && strings.EqualFold(fields[1], "Content-Encoding") {
+					encoded = true
+				}
+			}
+			meta <- kv
+		}
+		if sr != nil && sr.WantTiming {
+			meta <- serverTiming("decode", sr.decodeTime)
+			meta <- serverTiming("page", time.Since(pageStart))
+		}
+
+		// Compress the page body if both we and the client are
+		// willing and the headers haven't already been sent.
+		// Responses that could have been compressed vary with the
+		// client's Accept-Encoding header.
+		if status == okStr && !sendingFile && !encoded && !flushed && compressionEnabled(p, sr) && compressible(mimeType) {
+			meta <- gosp.KeyValue{Key: "header-field", Value: "false Vary Accept-Encoding"}
+			if html.Len() >= minCompressSize && acceptsGzip(headerValue(&sr.UserData, "Accept-Encoding")) {
+				start := time.Now()
+				body = gzipPage(html)
+				meta <- gosp.KeyValue{Key: "header-field", Value: "true Content-Encoding gzip"}
+				if sr.WantTiming {
+					meta <- serverTiming("compress", time.Since(start))
+				}
+			}
+		}
+		if status == okStr && !sendingFile && sr != nil && sr.BodyFDThreshold > 0 && int64(body.Len()) >= sr.BodyFDThreshold {
+			var err error
+			bodyFile, err = makeBodyFile(gospOut, body)
+			if err != nil {
+				meta <- gosp.KeyValue{
+					Key:   "debug-message",
+					Value: fmt.Sprintf("Sending the page body inline (%s)", err),
+				}
+			} else {
+				meta <- gosp.KeyValue{Key: "body-fd", Value: fmt.Sprint(body.Len())}
+			}
+		}
+		if _, ok := gospOut.(http.ResponseWriter); ok && !sendingFile {
+			meta <- gosp.KeyValue{Key: "content-length", Value: fmt.Sprint(body.Len())}
+		}
+		close(meta)
+	}()
+
 	// Read metadata from GospGeneratePage until no more remains.
 	status := p.WriteMetadata(gospOut, meta)
 
-	// Write the generated page, but only on success.
-	if status == okStr {
-		fmt.Fprint(gospOut, html)
+	// Write the generated page, but only on success and only if the Web
+	// server isn't sending a file instead.
+	switch {
+	case status != okStr, sendingFile:
+	case bodyFile != nil:
+		_ = passBodyFile(gospOut, bodyFile)
+	default:
+		fmt.Fprint(gospOut, body)
 	}
 }
 
@@ -78,24 +176,46 @@ func GospRequestFromFile(p *Parameters) error {
 		return err
 	}
 	chdirOrAbort(sr.UserData.Filename)
-	LaunchPageGenerator(p, os.Stdout, &sr.UserData)
+	LaunchPageGenerator(p, os.Stdout, &sr)
 	return nil
 }
 
-// ResetKillClock adds time to the auto-kill clock.
-func ResetKillClock(t *time.Timer, d time.Duration) {
-	if d == 0 {
-		return
+// ServePage passes a page request to the user-defined Gosp code and writes
+// the response to w.  If an identical request is already being processed, it
+// shares that request's response instead.
+func ServePage(p *Parameters, coal *Coalescer, w io.Writer, sr *ServiceRequest) {
+	chdirOrAbort(sr.UserData.Filename)
+	atomic.AddUint64(&pagesServed, 1)
+	key := ""
+	if coal != nil && !sr.WantTiming {
+		// Server timings describe a single execution, so requests
+		// that ask for them are never coalesced.  Responses are
+		// shared only among requests with the same body-descriptor
+		// threshold.
+		key = coal.Key(&sr.UserData)
+		if key != "" {
+			key += "\x00" + strconv.FormatInt(sr.BodyFDThreshold, 10)
+		}
+		if key != "" && compressionEnabled(p, sr) {
+			// Compressed and uncompressed responses can't be
+			// shared.
+			key += "\x00" + strconv.FormatBool(acceptsGzip(headerValue(&sr.UserData, "Accept-Encoding")))
+		}
 	}
-	if !t.Stop() {
-		<-t.C
+	if key == "" {
+		LaunchPageGenerator(p, w, sr)
+		return
 	}
-	t.Reset(d)
+	resp := coal.Do(key, func(cw io.Writer) {
+		LaunchPageGenerator(p, cw, sr)
+	})
+	_, _ = w.Write(resp)
 }
 
 // StartServer runs the program in server mode.  It accepts a connection on
 // a Unix-domain socket, reads a gosp.Request in JSON format, and spawns
-// LaunchPageGenerator to respond to the request.  The server terminates
+// LaunchPageGenerator to respond to the request.  If so directed, it also
+// accepts page requests through a shared-memory ring.  The server terminates
 // when given a request with ExitNow set to true.
 func StartServer(p *Parameters) error {
 	// Server code should write only to the io.Writer it's given and not
@@ -113,16 +233,47 @@ func StartServer(p *Parameters) error {
 	if err != nil {
 		return err
 	}
+	var ring *Ring
+	if p.RingName != "" {
+		ring, err = CreateRing(p.RingName)
+		if err != nil {
+			return err
+		}
+		defer ring.Remove()
+	}
+	if p.Ready != nil {
+		p.Ready()
+	}
 
-	// Exit automatically after AutoKillTime time of no activity.
-	var killClk *time.Timer
-	if p.AutoKillTime > 0 {
-		killClk = time.AfterFunc(p.AutoKillTime, func() {
-			_ = os.Remove(sock)
-			os.Exit(0)
+	// Exit automatically after a sufficient time of no activity.
+	idle := NewIdleMonitor(p)
+	go idle.Run(func() {
+		if ring != nil {
+			ring.Remove()
+		}
+		_ = os.Remove(sock)
+		os.Exit(0)
+	})
+
+	// Prepare to coalesce identical requests if so directed.
+	var coal *Coalescer
+	if p.Coalesce {
+		coal = NewCoalescer(p.CoalesceVary)
+	}
+
+	// Accept page requests through the shared-memory ring if we have one.
+	if ring != nil {
+		go ring.Serve(func(w io.Writer, sr *ServiceRequest) {
+			idle.Touch()
+			ServePage(p, coal, w, sr)
 		})
 	}
 
+	// Periodically profile the page if so directed.
+	if p.PGOProfile != "" {
+		go CollectPGOProfiles(p.PGOProfile, p.PGODuration, p.PGOInterval)
+	}
+
 	// Process connections until we're told to stop.
 	var done int32
 	var wg sync.WaitGroup
@@ -132,12 +283,12 @@ func StartServer(p *Parameters) error {
 		if err != nil {
 			return err
 		}
-		ResetKillClock(killClk, p.AutoKillTime)
 		wg.Add(1)
 		go func(conn net.Conn) {
 			// Parse the request as a JSON object.
 			defer wg.Done()
 			defer conn.Close()
+			start := time.Now()
 			err = conn.SetDeadline(time.Now().Add(10 * time.Second))
 			if err != nil {
 				return
@@ -148,6 +299,7 @@ func StartServer(p *Parameters) error {
 			if err != nil {
 				return
 			}
+			sr.decodeTime = time.Since(start)
 
 			// If we were asked to exit, send back our PID, notify
 			// our parent, and establish a dummy connection to
@@ -163,19 +315,35 @@ func StartServer(p *Parameters) error {
 			}
 
 			// If we were sent a PID request, send back our PID in
-			// response.  Ignore the rest of the request.
+			// response.  Ignore the rest of the request.  PID
+			// requests serve as health checks, so they don't count
+			// as activity.
 			if sr.GetPID {
 				fmt.Fprintf(conn, "gosp-pid %d\n", os.Getpid())
 				return
 			}
+			idle.Touch()
+
+			// If we were sent a request for profiling data or
+			// runtime statistics, send back the data requested.
+			if sr.Profile != "" {
+				d := time.Duration(sr.ProfileSeconds * float64(time.Second))
+				_ = conn.SetDeadline(time.Now().Add(d + 10*time.Second))
+				WriteProfile(conn, sr.Profile, d, sr.ProfileDebug)
+				return
+			}
+			if sr.Stats {
+				_ = WriteStats(conn)
+				return
+			}
 
 			// Pass the request to the user-defined Gosp code.
-			chdirOrAbort(sr.UserData.Filename)
-			LaunchPageGenerator(p, conn, &sr.UserData)
+			ServePage(p, coal, conn, &sr)
 		}(conn)
 	}
 
 	// Wait until all existing requests complete before we return.
 	wg.Wait()
+	idle.Save()
 	return nil
 }
@@ -0,0 +1,225 @@
+// This file lets a zygote supervise the Gosp servers it launches, restarting
+// servers that crash or stop responding and stopping all of them on request.
+
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"net"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// maxRapidCrashes is the number of consecutive times a server can crash soon
+// after being launched before the supervisor stops restarting it.
+const maxRapidCrashes = 3
+
+// rapidCrashTime is the time after launch within which a crash counts toward
+// maxRapidCrashes.
+const rapidCrashTime = time.Minute
+
+// maxMissedPings is the number of consecutive health checks a server can fail
+// before the supervisor kills and restarts it.
+const maxMissedPings = 2
+
+// A supervisedServer is a Gosp server launched by a supervising zygote.
+type supervisedServer struct {
+	args      []string  // gosp-server command-line arguments, excluding the program name
+	sock      string    // Unix socket on which the server listens
+	spare     *spare    // Process running the server
+	started   time.Time // Time at which the server was launched
+	crashes   int       // Number of consecutive rapid crashes preceding this launch
+	missed    int       // Number of consecutive failed health checks
+	unhealthy bool      // true=the supervisor killed the server for failing health checks
+}
+
+// A supervisor restarts Gosp servers that crash or stop responding.
+type supervisor struct {
+	z        *zygote                      // Zygote from which to launch replacement servers
+	interval time.Duration                // Time between health checks
+	mu       sync.Mutex                   // Protects all of the following
+	servers  map[string]*supervisedServer // Running servers, keyed by socket name
+	stopping bool                         // true=shutting down; don't restart anything
+}
+
+// newSupervisor returns a supervisor that launches servers using a given
+// zygote and checks their health at a given interval.
+func newSupervisor(z *zygote, interval time.Duration) *supervisor {
+	sv := &supervisor{
+		z:        z,
+		interval: interval,
+		servers:  make(map[string]*supervisedServer),
+	}
+	if interval > 0 {
+		go sv.checkHealth()
+	}
+	return sv
+}
+
+// socketArg returns the value of the --socket option in a gosp-server
+// command line.
+func socketArg(args []string) string {
+	for i, a := range args {
+		a = strings.TrimLeft(a, "-")
+		switch {
+		case a == "socket" && i+1 < len(args):
+			return args[i+1]
+		case strings.HasPrefix(a, "socket="):
+			return a[7:]
+		}
+	}
+	return ""
+}
+
+// watch begins supervising a server that a spare has just become.
+func (sv *supervisor) watch(args []string, s *spare, crashes int) {
+	ss := &supervisedServer{
+		args:    args,
+		sock:    socketArg(args),
+		spare:   s,
+		started: time.Now(),
+		crashes: crashes,
+	}
+	sv.mu.Lock()
+	sv.servers[ss.sock] = ss
+	sv.mu.Unlock()
+	go sv.await(ss)
+}
+
+// crashed reports whether a process exited abnormally.  Exiting with status 0
+// (e.g., when idle or asked to exit) and being killed by SIGTERM, SIGINT, or
+// SIGKILL are considered deliberate.
+func crashed(s *spare) bool {
+	ws, ok := s.cmd.ProcessState.Sys().(syscall.WaitStatus)
+	if !ok {
+		return !s.cmd.ProcessState.Success()
+	}
+	if ws.Signaled() {
+		switch ws.Signal() {
+		case syscall.SIGTERM, syscall.SIGINT, syscall.SIGKILL:
+			return false
+		}
+		return true
+	}
+	return ws.ExitStatus() != 0
+}
+
+// await waits for a supervised server to exit and restarts it if it crashed
+// or was killed for failing health checks.
+func (sv *supervisor) await(ss *supervisedServer) {
+	<-ss.spare.done
+	sv.mu.Lock()
+	current := sv.servers[ss.sock] == ss
+	if current {
+		delete(sv.servers, ss.sock)
+	}
+	restart := current && !sv.stopping && (ss.unhealthy || crashed(ss.spare))
+	sv.mu.Unlock()
+	if !restart {
+		return
+	}
+
+	// Avoid restarting a server that crashes repeatedly.
+	crashes := 0
+	if time.Since(ss.started) < rapidCrashTime {
+		crashes = ss.crashes + 1
+	}
+	if crashes > maxRapidCrashes {
+		notify.Printf("not restarting the Gosp server for %s after %d rapid crashes",
+			ss.sock, crashes)
+		return
+	}
+	notify.Printf("restarting the Gosp server for %s (%v)", ss.sock, ss.spare.cmd.ProcessState)
+	reply, s := sv.z.spawn(ss.args)
+	if !strings.HasPrefix(reply, "gosp-pid ") {
+		notify.Printf("failed to restart the Gosp server for %s (%s)", ss.sock, reply)
+		return
+	}
+	sv.watch(ss.args, s, crashes)
+}
+
+// ask sends a request to a Gosp server and reports whether it replied with
+// its process ID.
+func ask(sock string, req ServiceRequest) bool {
+	conn, err := net.DialTimeout("unix", sock, 5*time.Second)
+	if err != nil {
+		return false
+	}
+	defer conn.Close()
+	_ = conn.SetDeadline(time.Now().Add(5 * time.Second))
+	err = json.NewEncoder(conn).Encode(req)
+	if err != nil {
+		return false
+	}
+	line, err := bufio.NewReader(conn).ReadString('\n')
+	return err == nil && strings.HasPrefix(line, "gosp-pid ")
+}
+
+// snapshot returns a list of all running servers.
+func (sv *supervisor) snapshot() []*supervisedServer {
+	sv.mu.Lock()
+	defer sv.mu.Unlock()
+	list := make([]*supervisedServer, 0, len(sv.servers))
+	for _, ss := range sv.servers {
+		list = append(list, ss)
+	}
+	return list
+}
+
+// checkHealth periodically pings every running server, killing any server that
+// fails maxMissedPings consecutive pings so it can be restarted.
+func (sv *supervisor) checkHealth() {
+	for range time.Tick(sv.interval) {
+		for _, ss := range sv.snapshot() {
+			sv.mu.Lock()
+			killed := ss.unhealthy
+			sv.mu.Unlock()
+			if killed {
+				continue // Already killed but not yet reaped
+			}
+			if ask(ss.sock, ServiceRequest{GetPID: true}) {
+				ss.missed = 0
+				continue
+			}
+			ss.missed++
+			if ss.missed < maxMissedPings {
+				continue
+			}
+			notify.Printf("the Gosp server for %s failed %d consecutive health checks",
+				ss.sock, ss.missed)
+			sv.mu.Lock()
+			ss.unhealthy = true
+			sv.mu.Unlock()
+			_ = ss.spare.cmd.Process.Kill()
+		}
+	}
+}
+
+// shutdown asks every running server to exit, waits briefly for them to do
+// so, and kills any that remain.
+func (sv *supervisor) shutdown() {
+	sv.mu.Lock()
+	sv.stopping = true
+	sv.mu.Unlock()
+	list := sv.snapshot()
+	for _, ss := range list {
+		go ask(ss.sock, ServiceRequest{ExitNow: true})
+	}
+	timer := time.NewTimer(5 * time.Second)
+	defer timer.Stop()
+	expired := false
+	for _, ss := range list {
+		if !expired {
+			select {
+			case <-ss.spare.done:
+				continue
+			case <-timer.C:
+				expired = true
+			}
+		}
+		_ = ss.spare.cmd.Process.Kill()
+	}
+}
@@ -7,6 +7,7 @@ import (
 	"gosp"
 	"io"
 	"strings"
+	"time"
 	"unicode"
 )
 
@@ -67,23 +68,41 @@ func sanitizeString(s string) string {
 
 // writeModGospMetadata is a helper routine for LaunchPageGenerator that writes
 // HTTP metadata in the format expected by the Gosp Apache module.  It returns
-// an HTTP status as a string.
+// an HTTP status as a string.  If the metadata include timing information,
+// writeModGospMetadata additionally reports the time it spent writing
+// metadata.
 func writeModGospMetadata(gospOut io.Writer, meta chan gosp.KeyValue) string {
 	// Read metadata from GospGeneratePage until no more remains.
 	status := okStr
+	timed := false
+	var writeTime time.Duration
 	for kv := range meta {
 		switch kv.Key {
-		case "mime-type", "http-status", "header-field", "keep-alive", "error-message", "debug-message":
+		case "mime-type", "http-status", "header-field", "keep-alive", "error-message", "debug-message", "body-fd", "send-file", "server-timing", "early-hints", "flush-headers":
+			start := time.Now()
 			k := sanitizeString(kv.Key)
 			v := sanitizeString(kv.Value)
-			fmt.Fprintln(gospOut, k, v)
+			if v == "" {
+				fmt.Fprintln(gospOut, k)
+			} else {
+				fmt.Fprintln(gospOut, k, v)
+			}
+			writeTime += time.Since(start)
 		}
 
-		// Keep track of the current HTTP status code.
-		if kv.Key == "http-status" {
+		// Keep track of the current HTTP status code and whether
+		// timing was requested.
+		switch kv.Key {
+		case "http-status":
 			status = kv.Value
+		case "server-timing":
+			timed = true
 		}
 	}
+	if timed {
+		kv := serverTiming("metadata", writeTime)
+		fmt.Fprintln(gospOut, kv.Key, kv.Value)
+	}
 	fmt.Fprintln(gospOut, "end-header")
 	return status
 }
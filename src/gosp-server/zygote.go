@@ -0,0 +1,290 @@
+// This file implements a zygote process that keeps pre-initialized gosp-server
+// processes on hand so a Gosp server can be launched without waiting for a
+// new process to start up.
+
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// A SpawnRequest asks a zygote to turn one of its spare processes into a
+// Gosp server or to shut down.
+type SpawnRequest struct {
+	Spawn    []string // gosp-server command-line arguments, excluding the program name
+	Shutdown bool     // If true, exit, first stopping all supervised servers
+}
+
+// A spare is a gosp-server process that has initialized the Go runtime and is
+// waiting to be told which plugin to serve.
+type spare struct {
+	cmd  *exec.Cmd     // Spare process
+	ctl  net.Conn      // Connection over which to send the spare its arguments
+	done chan struct{} // Closed once the process has exited and been reaped
+}
+
+// startSpare launches a spare gosp-server process.  The spare runs in its own
+// session so it outlives the zygote once it begins serving a page.
+func startSpare() (*spare, error) {
+	// Create a socket pair over which to control the spare.
+	fds, err := syscall.Socketpair(syscall.AF_UNIX, syscall.SOCK_STREAM, 0)
+	if err != nil {
+		return nil, err
+	}
+	ours := os.NewFile(uintptr(fds[0]), "spare-control")
+	theirs := os.NewFile(uintptr(fds[1]), "zygote-control")
+	defer theirs.Close()
+	ctl, err := net.FileConn(ours)
+	ours.Close()
+	if err != nil {
+		return nil, err
+	}
+
+	// Launch the spare, passing it its end of the socket pair as file
+	// descriptor 3.
+	exe, err := os.Executable()
+	if err != nil {
+		ctl.Close()
+		return nil, err
+	}
+	cmd := exec.Command(exe, "-spare")
+	cmd.Stderr = os.Stderr
+	cmd.ExtraFiles = []*os.File{theirs}
+	cmd.SysProcAttr = &syscall.SysProcAttr{Setsid: true}
+	err = cmd.Start()
+	if err != nil {
+		ctl.Close()
+		return nil, err
+	}
+	s := &spare{cmd: cmd, ctl: ctl, done: make(chan struct{})}
+	go func() {
+		// Reap the spare when it exits.
+		_ = cmd.Wait()
+		close(s.done)
+	}()
+	return s, nil
+}
+
+// spawn asks a spare to become a Gosp server with the given command-line
+// arguments.  It returns the spare's one-line reply, which is either
+// "gosp-pid <pid>" or "gosp-error <message>".  spawn returns an error if the
+// spare could not be sent the arguments, typically because it has exited.
+func (s *spare) spawn(args []string) (string, error) {
+	defer s.ctl.Close()
+	_ = s.ctl.SetDeadline(time.Now().Add(30 * time.Second))
+	err := json.NewEncoder(s.ctl).Encode(SpawnRequest{Spawn: args})
+	if err != nil {
+		return "", err
+	}
+	line, err := bufio.NewReader(s.ctl).ReadString('\n')
+	if err != nil {
+		return "gosp-error gosp-server exited without launching", nil
+	}
+	return strings.TrimSuffix(line, "\n"), nil
+}
+
+// A zygote keeps a pool of spare processes.
+type zygote struct {
+	spares chan *spare   // Spares ready to be handed out
+	tokens chan struct{} // One token per spare that needs to be started
+}
+
+// newZygote starts n spares and thereafter replaces each spare that is handed
+// out.
+func newZygote(n int) *zygote {
+	z := &zygote{
+		spares: make(chan *spare, n),
+		tokens: make(chan struct{}, n),
+	}
+	for i := 0; i < n; i++ {
+		z.tokens <- struct{}{}
+	}
+	go func() {
+		for range z.tokens {
+			s, err := startSpare()
+			for err != nil {
+				notify.Print(err)
+				time.Sleep(time.Second)
+				s, err = startSpare()
+			}
+			z.spares <- s
+		}
+	}()
+	return z
+}
+
+// spawn has a spare become a Gosp server with the given command-line
+// arguments.  It returns the spare's reply and the spare itself.
+func (z *zygote) spawn(args []string) (string, *spare) {
+	for {
+		s := <-z.spares
+		z.tokens <- struct{}{}
+		reply, err := s.spawn(args)
+		if err != nil {
+			notify.Print(err)
+			continue // Try another spare.
+		}
+		return reply, s
+	}
+}
+
+// StartZygote runs the program as a zygote.  It keeps p.Spares spare
+// gosp-server processes running and hands one to each SpawnRequest it
+// receives on a Unix-domain socket, replying with the resulting Gosp server's
+// process ID or an error message.  If p.Supervise is true, the zygote also
+// supervises the servers it launches and runs until asked to shut down.
+// Otherwise, it exits after AutoKillTime time of no activity.  Only one
+// zygote at a time can listen on a given socket; any other exits immediately.
+func StartZygote(p *Parameters) error {
+	// Server code should write only to the io.Writer it's given and not
+	// read at all.
+	_ = os.Stdin.Close()
+	_ = os.Stdout.Close()
+
+	// Ensure we're the only zygote using the named Unix-domain socket.
+	sock, err := filepath.Abs(p.ZygoteSocket)
+	if err != nil {
+		return err
+	}
+	lock, err := os.OpenFile(sock+".lock", os.O_RDWR|os.O_CREATE, 0644)
+	if err != nil {
+		return err
+	}
+	err = syscall.Flock(int(lock.Fd()), syscall.LOCK_EX|syscall.LOCK_NB)
+	if err == syscall.EWOULDBLOCK {
+		os.Exit(0)
+	}
+	if err != nil {
+		return err
+	}
+
+	// Listen on the named Unix-domain socket.
+	_ = os.Remove(sock) // It's not an error if the socket doesn't exist.
+	ln, err := net.Listen("unix", sock)
+	if err != nil {
+		return err
+	}
+
+	// Keep exactly p.Spares spares available.  Unused spares exit when
+	// they see their control connection close.
+	z := newZygote(p.Spares)
+
+	// Either supervise the servers we launch or exit automatically after
+	// AutoKillTime time of no activity.
+	var sv *supervisor
+	idle := NewIdleMonitor(p)
+	if p.Supervise {
+		sv = newSupervisor(z, p.HealthInterval)
+	} else {
+		go idle.Run(func() {
+			_ = os.Remove(sock)
+			os.Exit(0)
+		})
+	}
+
+	// Hand a spare to each incoming request.
+	for {
+		conn, err := ln.Accept()
+		if err != nil {
+			return err
+		}
+		idle.Touch()
+		go func(conn net.Conn) {
+			defer conn.Close()
+			_ = conn.SetDeadline(time.Now().Add(10 * time.Second))
+			var req SpawnRequest
+			err := json.NewDecoder(conn).Decode(&req)
+			if err != nil {
+				return
+			}
+			if req.Shutdown {
+				if sv != nil {
+					sv.shutdown()
+				}
+				_ = os.Remove(sock)
+				fmt.Fprintln(conn, "gosp-ok")
+				os.Exit(0)
+			}
+			reply, s := z.spawn(req.Spawn)
+			if sv != nil && strings.HasPrefix(reply, "gosp-pid ") {
+				sv.watch(req.Spawn, s, 0)
+			}
+			fmt.Fprintln(conn, reply)
+		}(conn)
+	}
+}
+
+// A spawnReporter relays log messages to the zygote as "gosp-error" lines
+// until the spare reports that it is ready.
+type spawnReporter struct {
+	sync.Mutex
+	ctl io.WriteCloser // Connection to the zygote or nil once the spare is ready
+}
+
+// Write sends a log message to the zygote.
+func (sr *spawnReporter) Write(p []byte) (int, error) {
+	sr.Lock()
+	defer sr.Unlock()
+	if sr.ctl != nil {
+		msg := sanitizeString(strings.TrimSpace(string(p)))
+		_, _ = fmt.Fprintln(sr.ctl, "gosp-error", msg)
+	}
+	return len(p), nil
+}
+
+// Ready tells the zygote our process ID and stops relaying log messages.
+func (sr *spawnReporter) Ready() {
+	sr.Lock()
+	defer sr.Unlock()
+	if sr.ctl != nil {
+		fmt.Fprintf(sr.ctl, "gosp-pid %d\n", os.Getpid())
+		_ = sr.ctl.Close()
+		sr.ctl = nil
+	}
+}
+
+// AwaitSpawn is run by a spare process.  It waits for the zygote to send it
+// command-line arguments then reparses the command line with those in place of
+// our own.  Until p.Ready is called, log messages, including those from fatal
+// errors, are also sent to the zygote so it can relay them to the Web server.
+func AwaitSpawn(p *Parameters) {
+	// Read a SpawnRequest from the zygote.  If the zygote exits first,
+	// so do we.
+	ctl := os.NewFile(3, "zygote-control")
+	var req SpawnRequest
+	err := json.NewDecoder(ctl).Decode(&req)
+	if err != nil {
+		os.Exit(0)
+	}
+
+	// Relay errors to the zygote.
+	rep := &spawnReporter{ctl: ctl}
+	notify = log.New(io.MultiWriter(os.Stderr, rep), notify.Prefix(), notify.Flags())
+
+	// Parse the arguments we were given as if they were our own.
+	os.Args = append(os.Args[:1], req.Spawn...)
+	flag.CommandLine = flag.NewFlagSet(os.Args[0], flag.ExitOnError)
+	flag.CommandLine.SetOutput(rep)
+	*p = Parameters{}
+	ParseCommandLine(p)
+	switch {
+	case p.SocketName == "":
+		notify.Fatal("a spawned Gosp server requires --socket")
+	case p.Spare, p.ZygoteSocket != "", p.DryRun:
+		notify.Fatal("a spawned Gosp server cannot use --spare, --zygote, or --dry-run")
+	}
+	p.Ready = rep.Ready
+}
@@ -0,0 +1,342 @@
+// This file implements process-wide, size-bounded caches that pages can use to
+// keep data across requests, including the cache of rendered page fragments.
+
+package gosp
+
+import (
+	"bytes"
+	"container/list"
+	"fmt"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// cacheShards is the number of independently locked shards into which each
+// Cache is divided.
+const cacheShards = 16
+
+// entryOverhead approximates the memory in bytes that a cache entry consumes
+// in addition to its key and value.
+const entryOverhead = 128
+
+// DefaultFragmentCacheSize is the default capacity in bytes of the fragment
+// cache.
+const DefaultFragmentCacheSize = 64 << 20
+
+// A cacheEntry is a single cached value.
+type cacheEntry struct {
+	key     string        // Key under which the value is cached
+	value   interface{}   // Cached value
+	size    int64         // Bytes charged against the shard's capacity
+	expires time.Time     // Time after which the value is stale or zero for never
+	elt     *list.Element // Position of the entry in the shard's LRU list
+}
+
+// A cacheShard is an independently locked, least-recently-used portion of a
+// Cache.
+type cacheShard struct {
+	mu      sync.Mutex             // Protects all of the following
+	limit   int64                  // Capacity in bytes
+	size    int64                  // Bytes currently consumed
+	lru     *list.List             // Entries, most recently used first
+	entries map[string]*cacheEntry // Entries by key
+}
+
+// A cacheLoad represents a value that is currently being loaded.  Other
+// requests for the same key wait for the load to complete rather than loading
+// the value themselves.
+type cacheLoad struct {
+	done  chan struct{} // Closed when the load completes
+	value interface{}   // Loaded value
+	err   error         // Error returned by the load function
+	ok    bool          // true=value and err are valid; false=the load panicked
+}
+
+// A Cache is a concurrency-safe, size-bounded cache of arbitrary values keyed
+// by strings.  Each cache is divided into shards to reduce lock contention.
+// When a shard exceeds its share of the cache's capacity, its least recently
+// used values are evicted.  Values can additionally expire after a
+// time-to-live.  A Cache is typically declared in <?go:top ?> markup so it
+// persists across requests.
+type Cache struct {
+	hits        uint64 // Number of lookups that found a fresh value
+	misses      uint64 // Number of lookups that found no fresh value
+	evictions   uint64 // Number of values evicted to stay within capacity
+	expirations uint64 // Number of values discarded because they were stale
+
+	name     string                  // Name under which the cache reports statistics
+	ttl      time.Duration           // Default time-to-live or 0 for none
+	maxBytes int64                   // Capacity in bytes
+	shards   [cacheShards]cacheShard // Independently locked portions of the cache
+	loadMu   sync.Mutex              // Protects loads
+	loads    map[string]*cacheLoad   // Values being loaded by key
+}
+
+// CacheStats summarizes a Cache's contents and effectiveness.
+type CacheStats struct {
+	Name        string  // Name of the cache
+	Entries     int     // Number of values currently cached
+	Bytes       int64   // Approximate bytes consumed by the cached values
+	MaxBytes    int64   // Capacity in bytes
+	Hits        uint64  // Number of lookups that found a fresh value
+	Misses      uint64  // Number of lookups that found no fresh value
+	HitRate     float64 // Hits divided by total lookups
+	Evictions   uint64  // Number of values evicted to stay within capacity
+	Expirations uint64  // Number of values discarded because they were stale
+}
+
+// caches lists every Cache in the process so their statistics can be reported.
+var caches struct {
+	mu  sync.Mutex
+	all []*Cache
+}
+
+// NewCache returns a new Cache that reports statistics under a given name,
+// holds at most maxBytes bytes of keys and values, and discards values older
+// than ttl (or never if ttl is 0).  A single value larger than 1/16 of
+// maxBytes is never cached.
+func NewCache(name string, maxBytes int64, ttl time.Duration) *Cache {
+	c := &Cache{
+		name:     name,
+		ttl:      ttl,
+		maxBytes: maxBytes,
+		loads:    make(map[string]*cacheLoad),
+	}
+	for i := range c.shards {
+		sh := &c.shards[i]
+		sh.limit = maxBytes / cacheShards
+		sh.lru = list.New()
+		sh.entries = make(map[string]*cacheEntry)
+	}
+	caches.mu.Lock()
+	caches.all = append(caches.all, c)
+	caches.mu.Unlock()
+	return c
+}
+
+// shard returns the shard responsible for a given key.
+func (c *Cache) shard(key string) *cacheShard {
+	h := uint32(2166136261) // FNV-1a
+	for i := 0; i < len(key); i++ {
+		h ^= uint32(key[i])
+		h *= 16777619
+	}
+	return &c.shards[h%cacheShards]
+}
+
+// evict discards least-recently-used entries until the shard fits within its
+// capacity and returns the number of entries discarded.  The caller must hold
+// the shard's lock.
+func (sh *cacheShard) evict() uint64 {
+	var n uint64
+	for sh.size > sh.limit && sh.lru.Len() > 0 {
+		sh.remove(sh.lru.Back().Value.(*cacheEntry))
+		n++
+	}
+	return n
+}
+
+// remove discards an entry.  The caller must hold the shard's lock.
+func (sh *cacheShard) remove(e *cacheEntry) {
+	sh.lru.Remove(e.elt)
+	delete(sh.entries, e.key)
+	sh.size -= e.size
+}
+
+// SetMaxBytes changes the cache's capacity, evicting values as necessary.  A
+// capacity of zero or less disables caching.
+func (c *Cache) SetMaxBytes(n int64) {
+	for i := range c.shards {
+		sh := &c.shards[i]
+		sh.mu.Lock()
+		sh.limit = n / cacheShards
+		atomic.AddUint64(&c.evictions, sh.evict())
+		sh.mu.Unlock()
+	}
+	atomic.StoreInt64(&c.maxBytes, n)
+}
+
+// Get returns the value cached under a given key and true or, if no fresh
+// value is cached, nil and false.
+func (c *Cache) Get(key string) (interface{}, bool) {
+	sh := c.shard(key)
+	sh.mu.Lock()
+	defer sh.mu.Unlock()
+	e, ok := sh.entries[key]
+	if ok && !e.expires.IsZero() && !time.Now().Before(e.expires) {
+		sh.remove(e)
+		atomic.AddUint64(&c.expirations, 1)
+		ok = false
+	}
+	if !ok {
+		atomic.AddUint64(&c.misses, 1)
+		return nil, false
+	}
+	sh.lru.MoveToFront(e.elt)
+	atomic.AddUint64(&c.hits, 1)
+	return e.value, true
+}
+
+// Set caches a value under a given key using the cache's default
+// time-to-live.  size is the approximate number of bytes the value consumes.
+// If size is zero or less, it is taken to be the length of a string or []byte
+// value and zero for any other type of value.
+func (c *Cache) Set(key string, value interface{}, size int64) {
+	c.SetWithTTL(key, value, size, c.ttl)
+}
+
+// SetWithTTL is like Set but specifies the value's time-to-live explicitly.  A
+// ttl of 0 means the value never expires.
+func (c *Cache) SetWithTTL(key string, value interface{}, size int64, ttl time.Duration) {
+	if size <= 0 {
+		switch v := value.(type) {
+		case string:
+			size = int64(len(v))
+		case []byte:
+			size = int64(len(v))
+		}
+	}
+	e := &cacheEntry{
+		key:   key,
+		value: value,
+		size:  size + int64(len(key)) + entryOverhead,
+	}
+	if ttl > 0 {
+		e.expires = time.Now().Add(ttl)
+	}
+	sh := c.shard(key)
+	sh.mu.Lock()
+	defer sh.mu.Unlock()
+	if old, ok := sh.entries[key]; ok {
+		sh.remove(old)
+	}
+	if e.size > sh.limit {
+		return
+	}
+	e.elt = sh.lru.PushFront(e)
+	sh.entries[key] = e
+	sh.size += e.size
+	atomic.AddUint64(&c.evictions, sh.evict())
+}
+
+// Delete discards any value cached under a given key.
+func (c *Cache) Delete(key string) {
+	sh := c.shard(key)
+	sh.mu.Lock()
+	if e, ok := sh.entries[key]; ok {
+		sh.remove(e)
+	}
+	sh.mu.Unlock()
+}
+
+// GetOrLoad returns the value cached under a given key.  If no fresh value is
+// cached, GetOrLoad calls load to produce the value and its approximate size
+// (as for Set) and caches the result unless load returns an error.
+// Concurrent calls for the same key that find no cached value wait for a
+// single call to load instead of each calling it.
+func (c *Cache) GetOrLoad(key string, load func() (interface{}, int64, error)) (interface{}, error) {
+	return c.getOrLoad(key, c.ttl, load)
+}
+
+// getOrLoad implements GetOrLoad with an explicit time-to-live.
+func (c *Cache) getOrLoad(key string, ttl time.Duration, load func() (interface{}, int64, error)) (interface{}, error) {
+	for {
+		if v, ok := c.Get(key); ok {
+			return v, nil
+		}
+
+		// Wait for a load already in progress.  If it panicked, try
+		// again.
+		c.loadMu.Lock()
+		if ld, ok := c.loads[key]; ok {
+			c.loadMu.Unlock()
+			<-ld.done
+			if ld.ok {
+				return ld.value, ld.err
+			}
+			continue
+		}
+		ld := &cacheLoad{done: make(chan struct{})}
+		c.loads[key] = ld
+		c.loadMu.Unlock()
+
+		// Load the value ourself, releasing any waiters even if load
+		// panics.
+		defer func() {
+			c.loadMu.Lock()
+			delete(c.loads, key)
+			c.loadMu.Unlock()
+			close(ld.done)
+		}()
+		v, size, err := load()
+		if err == nil {
+			c.SetWithTTL(key, v, size, ttl)
+		}
+		ld.value, ld.err, ld.ok = v, err, true
+		return v, err
+	}
+}
+
+// Stats returns a summary of the cache's contents and effectiveness.
+func (c *Cache) Stats() CacheStats {
+	st := CacheStats{
+		Name:        c.name,
+		MaxBytes:    atomic.LoadInt64(&c.maxBytes),
+		Hits:        atomic.LoadUint64(&c.hits),
+		Misses:      atomic.LoadUint64(&c.misses),
+		Evictions:   atomic.LoadUint64(&c.evictions),
+		Expirations: atomic.LoadUint64(&c.expirations),
+	}
+	for i := range c.shards {
+		sh := &c.shards[i]
+		sh.mu.Lock()
+		st.Entries += len(sh.entries)
+		st.Bytes += sh.size
+		sh.mu.Unlock()
+	}
+	if st.Hits+st.Misses > 0 {
+		st.HitRate = float64(st.Hits) / float64(st.Hits+st.Misses)
+	}
+	return st
+}
+
+// AllCacheStats returns the statistics of every Cache in the process.
+func AllCacheStats() []CacheStats {
+	caches.mu.Lock()
+	all := append([]*Cache(nil), caches.all...)
+	caches.mu.Unlock()
+	stats := make([]CacheStats, len(all))
+	for i, c := range all {
+		stats[i] = c.Stats()
+	}
+	return stats
+}
+
+// fragments is the process-wide cache of rendered page fragments.
+var fragments = NewCache("fragments", DefaultFragmentCacheSize, 0)
+
+// SetFragmentCacheSize sets the capacity in bytes of the fragment cache used
+// by CacheFragment, evicting fragments as necessary.  A capacity of zero or
+// less disables fragment caching.
+func SetFragmentCacheSize(n int64) {
+	fragments.SetMaxBytes(n)
+}
+
+// CacheFragment writes a page fragment to a Writer, rendering the fragment
+// only if no rendering for the same id and key was cached within the past ttl
+// time.  id distinguishes fragments within a page, and key (formatted with
+// fmt.Sprint) distinguishes renderings of a single fragment.  Concurrent
+// requests for a fragment that is not cached wait for a single rendering
+// instead of each rendering the fragment.  Metadata sent by render are not
+// cached and are therefore not replayed when the rendering is reused.
+// gosp2go generates calls to CacheFragment from <?go:cache ?> markup.
+func CacheFragment(w Writer, id string, key interface{}, ttl time.Duration, render func(Writer)) {
+	k := id + "\x00" + fmt.Sprint(key)
+	v, _ := fragments.getOrLoad(k, ttl, func() (interface{}, int64, error) {
+		var buf bytes.Buffer
+		render(&buf)
+		return buf.Bytes(), 0, nil
+	})
+	_, _ = w.Write(v.([]byte))
+}
@@ -81,6 +81,60 @@ func LogDebugMessage(ch Metadata, m string) {
 	}
 }
 
+// SendEarlyHints asks the Web server to send the client a 103 (Early Hints)
+// interim response containing the given Link header values, such as
+// `</style.css>; rel=preload; as=style`.  The client can then begin fetching
+// those resources while the page is still being generated.  Early hints
+// requested after FlushHeaders are ignored.
+func SendEarlyHints(ch Metadata, links ...string) {
+	if len(links) == 0 {
+		return
+	}
+	ch <- KeyValue{Key: "early-hints", Value: strings.Join(links, ", ")}
+}
+
+// FlushHeaders asks the Web server to send the HTTP status and header fields
+// specified so far to the client immediately instead of waiting for the page
+// to complete.  Afterwards, the HTTP status, MIME type, and header fields can
+// no longer be changed, and the page is not compressed.  A file subsequently
+// passed to SendFile is sent without validators and regardless of any
+// conditional-request headers.
+func FlushHeaders(ch Metadata) {
+	ch <- KeyValue{Key: "flush-headers"}
+}
+
+// SendFile asks the Web server to send the named file to the client in place
+// of the page's own output, which is then discarded.  The Web server, not the
+// Gosp server, reads the file, so this is an efficient way to serve large
+// downloads after, say, an authorization check.  As with Open, only files that
+// lie within or below the current directory can be sent.
+func SendFile(ch Metadata, name string) error {
+	cwd, err := os.Getwd()
+	if err != nil {
+		return err
+	}
+	in, err := LiesInOrBelow(name, cwd)
+	if err != nil {
+		return err
+	}
+	if !in {
+		return os.ErrPermission
+	}
+	abs, err := realPath(name)
+	if err != nil {
+		return err
+	}
+	fi, err := os.Stat(abs)
+	if err != nil {
+		return err
+	}
+	if !fi.Mode().IsRegular() {
+		return fmt.Errorf("%s is not a regular file", name)
+	}
+	ch <- KeyValue{Key: "send-file", Value: abs}
+	return nil
+}
+
 // ReportPanic alerts the Web server that the Gosp server encountered an
 // unexpected error.  It should be called from a deferred function in
 // GospGeneratePage.
@@ -108,6 +162,24 @@ func Fprintf(w Writer, format string, a ...interface{}) (n int, err error) {
 	return fmt.Fprintf(w, format, a...)
 }
 
+// A StaticWriter is a Writer that can make use of page text that was
+// compressed when the page was built.
+type StaticWriter interface {
+	Writer
+	WriteStatic(text, deflated string) (n int, err error)
+}
+
+// WriteStatic writes literal page text to a Writer.  deflated is the same text
+// compressed by gosp2go as a sequence of raw DEFLATE blocks ending with a sync
+// flush, which a StaticWriter can splice into compressed output instead of
+// compressing the text again.  Other Writers receive only the text.
+func WriteStatic(w Writer, text, deflated string) (n int, err error) {
+	if sw, ok := w.(StaticWriter); ok {
+		return sw.WriteStatic(text, deflated)
+	}
+	return io.WriteString(w, text)
+}
+
 // evalPartialSymlinks is like filepath.EvalSymlinks but can handle
 // nonexistent files.
 func evalPartialSymlinks(fn string) (string, error) {
@@ -0,0 +1,161 @@
+// This file implements bounded pools of expensive resources, such as database
+// or HTTP clients, that pages can share across requests.
+
+package gosp
+
+import (
+	"sync"
+	"sync/atomic"
+)
+
+// A Pool is a concurrency-safe, bounded set of reusable resources.  Resources
+// are created lazily, only when a caller needs one and none is idle, and at
+// most a fixed number exist at once.  A Pool is typically declared in
+// <?go:top ?> markup so it persists across requests.
+type Pool struct {
+	gets    uint64 // Number of resources handed out
+	waits   uint64 // Number of Gets that had to wait for a resource
+	created uint64 // Number of resources created
+	errors  uint64 // Number of failed attempts to create a resource
+
+	name    string                      // Name under which the pool reports statistics
+	max     int                         // Maximum number of resources or 0 for no limit
+	newRes  func() (interface{}, error) // Function that creates a resource
+	closeFn func(interface{})           // Function that destroys a resource or nil
+	tokens  chan struct{}               // Semaphore that limits the number of resources
+	mu      sync.Mutex                  // Protects idle and open
+	idle    []interface{}               // Resources not currently in use
+	open    int                         // Number of resources in existence
+}
+
+// PoolStats summarizes a Pool's contents and usage.
+type PoolStats struct {
+	Name    string // Name of the pool
+	Open    int    // Number of resources in existence
+	Idle    int    // Number of resources not currently in use
+	Max     int    // Maximum number of resources or 0 for no limit
+	Gets    uint64 // Number of resources handed out
+	Waits   uint64 // Number of Gets that had to wait for a resource
+	Created uint64 // Number of resources created
+	Errors  uint64 // Number of failed attempts to create a resource
+}
+
+// pools lists every Pool in the process so their statistics can be reported.
+var pools struct {
+	mu  sync.Mutex
+	all []*Pool
+}
+
+// NewPool returns a new Pool that reports statistics under a given name and
+// holds at most max resources (or any number if max is 0).  newRes creates a
+// resource.  closeFn, if non-nil, destroys a resource that is discarded.  No
+// resources are created until they are first needed.
+func NewPool(name string, max int, newRes func() (interface{}, error), closeFn func(interface{})) *Pool {
+	p := &Pool{
+		name:    name,
+		max:     max,
+		newRes:  newRes,
+		closeFn: closeFn,
+	}
+	if max > 0 {
+		p.tokens = make(chan struct{}, max)
+	}
+	pools.mu.Lock()
+	pools.all = append(pools.all, p)
+	pools.mu.Unlock()
+	return p
+}
+
+// release frees a resource's slot in the pool.
+func (p *Pool) release() {
+	if p.tokens != nil {
+		<-p.tokens
+	}
+}
+
+// Get returns an idle resource or, if none is idle, a newly created one.  If
+// the pool already holds its maximum number of resources, Get waits for one to
+// be returned.  Every resource obtained from Get must eventually be passed to
+// either Put or Discard.
+func (p *Pool) Get() (interface{}, error) {
+	if p.tokens != nil {
+		select {
+		case p.tokens <- struct{}{}:
+		default:
+			atomic.AddUint64(&p.waits, 1)
+			p.tokens <- struct{}{}
+		}
+	}
+	p.mu.Lock()
+	if n := len(p.idle); n > 0 {
+		r := p.idle[n-1]
+		p.idle[n-1] = nil
+		p.idle = p.idle[:n-1]
+		p.mu.Unlock()
+		atomic.AddUint64(&p.gets, 1)
+		return r, nil
+	}
+	p.open++
+	p.mu.Unlock()
+	r, err := p.newRes()
+	if err != nil {
+		p.mu.Lock()
+		p.open--
+		p.mu.Unlock()
+		p.release()
+		atomic.AddUint64(&p.errors, 1)
+		return nil, err
+	}
+	atomic.AddUint64(&p.created, 1)
+	atomic.AddUint64(&p.gets, 1)
+	return r, nil
+}
+
+// Put returns a resource obtained from Get to the pool for reuse.
+func (p *Pool) Put(r interface{}) {
+	p.mu.Lock()
+	p.idle = append(p.idle, r)
+	p.mu.Unlock()
+	p.release()
+}
+
+// Discard destroys a resource obtained from Get instead of returning it to the
+// pool, for example because it is broken.
+func (p *Pool) Discard(r interface{}) {
+	if p.closeFn != nil {
+		p.closeFn(r)
+	}
+	p.mu.Lock()
+	p.open--
+	p.mu.Unlock()
+	p.release()
+}
+
+// Stats returns a summary of the pool's contents and usage.
+func (p *Pool) Stats() PoolStats {
+	p.mu.Lock()
+	open, idle := p.open, len(p.idle)
+	p.mu.Unlock()
+	return PoolStats{
+		Name:    p.name,
+		Open:    open,
+		Idle:    idle,
+		Max:     p.max,
+		Gets:    atomic.LoadUint64(&p.gets),
+		Waits:   atomic.LoadUint64(&p.waits),
+		Created: atomic.LoadUint64(&p.created),
+		Errors:  atomic.LoadUint64(&p.errors),
+	}
+}
+
+// AllPoolStats returns the statistics of every Pool in the process.
+func AllPoolStats() []PoolStats {
+	pools.mu.Lock()
+	all := append([]*Pool(nil), pools.all...)
+	pools.mu.Unlock()
+	stats := make([]PoolStats, len(all))
+	for i, p := range all {
+		stats[i] = p.Stats()
+	}
+	return stats
+}
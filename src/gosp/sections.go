@@ -0,0 +1,140 @@
+// This file lets independent sections of a page render concurrently while
+// their output appears in document order.
+
+package gosp
+
+import (
+	"bytes"
+	"sync"
+)
+
+// maxPooledSection is the largest section buffer, in bytes, that is returned
+// to sectionBuffers for reuse.
+const maxPooledSection = 1 << 20
+
+// sectionBuffers pools the buffers into which sections render.
+var sectionBuffers = sync.Pool{
+	New: func() interface{} {
+		return new(bytes.Buffer)
+	},
+}
+
+// A segment is a contiguous portion of a page's output that cannot yet be
+// written because it is preceded by a section that is still rendering.
+type segment struct {
+	buf    *bytes.Buffer // Buffered output
+	inline bool          // true=written by the page itself; false=written by a section
+	done   bool          // true=no more output will be added to buf
+}
+
+// Sections is a Writer that lets portions of a page render concurrently.
+// Output written directly to a Sections and output rendered by each section
+// it starts is written to the underlying Writer in the order in which it
+// appears in the page, with each portion written as soon as everything
+// preceding it is complete.  gosp2go generates uses of Sections from
+// <?go:section ?> markup.
+type Sections struct {
+	out      Writer         // Underlying Writer
+	wg       sync.WaitGroup // Sections still rendering
+	mu       sync.Mutex     // Protects all of the following
+	pending  []*segment     // Segments not yet written to out, in document order
+	panicked interface{}    // Value of the first panic raised by a section or nil
+}
+
+// NewSections returns a Sections that writes to a given Writer.
+func NewSections(w Writer) *Sections {
+	return &Sections{out: w}
+}
+
+// buffer returns the buffer to which the page's own output should be
+// appended or nil if the output can be written immediately.  The caller must
+// hold the lock.
+func (s *Sections) buffer() *bytes.Buffer {
+	if len(s.pending) == 0 {
+		return nil
+	}
+	last := s.pending[len(s.pending)-1]
+	if !last.inline {
+		last = &segment{buf: sectionBuffers.Get().(*bytes.Buffer), inline: true, done: true}
+		s.pending = append(s.pending, last)
+	}
+	return last.buf
+}
+
+// Write writes page output, buffering it if any preceding section is still
+// rendering.
+func (s *Sections) Write(p []byte) (int, error) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if buf := s.buffer(); buf != nil {
+		return buf.Write(p)
+	}
+	return s.out.Write(p)
+}
+
+// WriteStatic writes literal page text, buffering it if any preceding section
+// is still rendering.  Text that can be written immediately retains its
+// precompressed form.
+func (s *Sections) WriteStatic(text, deflated string) (int, error) {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if buf := s.buffer(); buf != nil {
+		return buf.WriteString(text)
+	}
+	return WriteStatic(s.out, text, deflated)
+}
+
+// flush writes to the underlying Writer every pending segment not preceded by
+// an incomplete section.  The caller must hold the lock.
+func (s *Sections) flush() {
+	for len(s.pending) > 0 && s.pending[0].done {
+		buf := s.pending[0].buf
+		_, _ = s.out.Write(buf.Bytes())
+		if buf.Cap() <= maxPooledSection {
+			buf.Reset()
+			sectionBuffers.Put(buf)
+		}
+		s.pending[0] = nil
+		s.pending = s.pending[1:]
+	}
+}
+
+// Go starts rendering a section in a new goroutine.  The section's output
+// appears in the page at the point at which Go was called.  render must not
+// write to any Writer other than the one it is passed.
+func (s *Sections) Go(render func(Writer)) {
+	seg := &segment{buf: sectionBuffers.Get().(*bytes.Buffer)}
+	s.mu.Lock()
+	s.pending = append(s.pending, seg)
+	s.mu.Unlock()
+	s.wg.Add(1)
+	go func() {
+		defer s.wg.Done()
+		defer func() {
+			r := recover()
+			s.mu.Lock()
+			if r != nil && s.panicked == nil {
+				s.panicked = r
+			}
+			seg.done = true
+			s.flush()
+			s.mu.Unlock()
+		}()
+		render(seg.buf)
+	}()
+}
+
+// Wait waits for all sections to finish rendering and writes all remaining
+// output.  If any section panicked, Wait panics with the same value so the
+// failure can be reported for the page as a whole.
+func (s *Sections) Wait() {
+	s.wg.Wait()
+	s.mu.Lock()
+	s.flush()
+	r := s.panicked
+	s.panicked = nil
+	s.mu.Unlock()
+	if r != nil {
+		panic(r)
+	}
+}
@@ -26,3 +26,25 @@ func GospGeneratePage(gospReq *gosp.RequestData, gospOut gosp.Writer, gospMeta g
 
 	// Express the Gosp page in Go.
 `
+
+// sectionsBegin is included at the start of GospGeneratePage's body when the
+// page contains concurrently rendered sections.
+var sectionsBegin = `gospSections := gosp.NewSections(gospOut)
+gospOut = gospSections
+defer gospSections.Wait()
+`
+
+// partialHeader is included at the top of every Go file generated from a
+// separately compiled partial.
+var partialHeader = `// This file was generated by gosp2go.
+
+package partial
+
+import "gosp"
+`
+
+// partialBegin begins the function that was converted from a partial to Go.
+var partialBegin = `// Render represents a Go Server Pages partial, converted to Go.  It is
+// called by every page that includes the partial.
+func Render(gospReq *gosp.RequestData, gospOut gosp.Writer, gospMeta gosp.Metadata) {
+`
@@ -0,0 +1,174 @@
+// This file implements a build server that compiles Go Server Pages on behalf
+// of the Apache module, running a bounded number of compilations at once and
+// sharing the result of identical compilations that are in progress.
+
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"net"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// A BuildRequest asks a build server to run gosp2go.
+type BuildRequest struct {
+	Args []string // gosp2go command-line arguments, excluding the program name
+	Env  []string // Environment variables of the form "key=value" to add to the build server's own
+}
+
+// A build represents one run of gosp2go, whose result may be awaited by any
+// number of requests.
+type build struct {
+	done   chan struct{} // Closed when the build completes
+	output []byte        // Combined standard output and standard error
+	err    error         // Error running gosp2go or nil if it succeeded
+}
+
+// A buildServer runs builds on behalf of clients.
+type buildServer struct {
+	exe      string            // gosp2go executable
+	jobs     chan struct{}     // Semaphore that limits the number of concurrent builds
+	mu       sync.Mutex        // Protects inFlight and active
+	inFlight map[string]*build // Builds in progress, keyed by their arguments and environment
+	active   time.Time         // Time at which the build server was last active
+}
+
+// start returns the build corresponding to a BuildRequest, starting a new build
+// unless an identical one is already in progress.
+func (bs *buildServer) start(req BuildRequest) *build {
+	key := strings.Join(req.Args, "\x00") + "\x00\x00" + strings.Join(req.Env, "\x00")
+	bs.mu.Lock()
+	defer bs.mu.Unlock()
+	bs.active = time.Now()
+	if b, ok := bs.inFlight[key]; ok {
+		return b
+	}
+	b := &build{done: make(chan struct{})}
+	bs.inFlight[key] = b
+	go func() {
+		bs.jobs <- struct{}{}
+		cmd := exec.Command(bs.exe, req.Args...)
+		cmd.Env = append(os.Environ(), req.Env...)
+		b.output, b.err = cmd.CombinedOutput()
+		<-bs.jobs
+		bs.mu.Lock()
+		delete(bs.inFlight, key)
+		bs.active = time.Now()
+		bs.mu.Unlock()
+		close(b.done)
+	}()
+	return b
+}
+
+// idleSince returns the time since which the build server has been idle, or
+// the current time if it is busy.
+func (bs *buildServer) idleSince() time.Time {
+	bs.mu.Lock()
+	defer bs.mu.Unlock()
+	if len(bs.inFlight) > 0 {
+		return time.Now()
+	}
+	return bs.active
+}
+
+// serve handles a single client connection.  It reads one BuildRequest, waits
+// for the corresponding build to complete, and replies with the build's
+// output followed by a final line of either "gosp-ok" or "gosp-error
+// <message>".
+func (bs *buildServer) serve(conn net.Conn) {
+	defer conn.Close()
+	_ = conn.SetReadDeadline(time.Now().Add(10 * time.Second))
+	var req BuildRequest
+	err := json.NewDecoder(bufio.NewReader(conn)).Decode(&req)
+	if err != nil {
+		fmt.Fprintf(conn, "gosp-error %v\n", err)
+		return
+	}
+	if len(req.Args) == 0 {
+		fmt.Fprintln(conn, "gosp-error empty build request")
+		return
+	}
+	b := bs.start(req)
+	<-b.done
+	out := b.output
+	if len(out) > 0 && out[len(out)-1] != '\n' {
+		out = append(out, '\n')
+	}
+	_, _ = conn.Write(out)
+	if b.err != nil {
+		fmt.Fprintf(conn, "gosp-error %s failed (%v)\n", filepath.Base(bs.exe), b.err)
+	} else {
+		fmt.Fprintln(conn, "gosp-ok")
+	}
+}
+
+// ServeBuilds runs gosp2go as a build server listening on a Unix-domain
+// socket.  It runs at most p.BuildJobs builds at once and exits after
+// p.BuildIdle time with no builds requested or running.
+func ServeBuilds(p *Parameters) error {
+	// Ensure we're the only build server using the named Unix-domain
+	// socket.  If two Apache processes launch a build server at the same
+	// time, the loser exits and leaves the socket to the winner.
+	sock, err := filepath.Abs(p.BuildServer)
+	if err != nil {
+		return err
+	}
+	lock, err := os.OpenFile(sock+".lock", os.O_RDWR|os.O_CREATE, 0644)
+	if err != nil {
+		return err
+	}
+	defer lock.Close()
+	err = syscall.Flock(int(lock.Fd()), syscall.LOCK_EX|syscall.LOCK_NB)
+	if err == syscall.EWOULDBLOCK {
+		os.Exit(0)
+	}
+	if err != nil {
+		return err
+	}
+
+	// Listen on the named Unix-domain socket.
+	_ = os.Remove(sock) // It's not an error if the socket doesn't exist.
+	ln, err := net.Listen("unix", sock)
+	if err != nil {
+		return err
+	}
+	exe, err := os.Executable()
+	if err != nil {
+		return err
+	}
+	bs := &buildServer{
+		exe:      exe,
+		jobs:     make(chan struct{}, p.BuildJobs),
+		inFlight: make(map[string]*build),
+		active:   time.Now(),
+	}
+
+	// Exit automatically after BuildIdle time of no activity.
+	if p.BuildIdle > 0 {
+		go func() {
+			for range time.Tick(p.BuildIdle / 10) {
+				if time.Since(bs.idleSince()) >= p.BuildIdle {
+					_ = os.Remove(sock)
+					os.Exit(0)
+				}
+			}
+		}()
+	}
+
+	// Handle each connection in a separate goroutine.
+	for {
+		conn, err := ln.Accept()
+		if err != nil {
+			return err
+		}
+		go bs.serve(conn)
+	}
+}
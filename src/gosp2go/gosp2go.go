@@ -2,6 +2,8 @@
 package main
 
 import (
+	"bytes"
+	"compress/flate"
 	"fmt"
 	"gosp"
 	"io"
@@ -13,6 +15,7 @@ import (
 	"regexp"
 	"runtime"
 	"strings"
+	"time"
 )
 
 // MaxIncludeDepth is the deepest we allow the file-inclusion tree to grow.
@@ -21,16 +24,23 @@ const MaxIncludeDepth = 10
 // notify is used to output error messages.
 var notify *log.Logger
 
-// includeRe matches a file-inclusion directive.
-var includeRe = regexp.MustCompile(`<\?go:include\s+(.*?)\s+\?>`)
+// includeRe matches a file-inclusion or partial directive.
+var includeRe = regexp.MustCompile(`<\?go:(include|partial)\s+(.*?)\s+\?>`)
+
+// directiveRe matches any Gosp directive other than file inclusion.
+var directiveRe = regexp.MustCompile(`<\?go:(top|block|expr|cache|endcache|section|endsection|partial)(?:\s+((?:.|\n)*?)|)\?>([\t ]*\n?)`)
 
 // ProcessGospIncludes recursively processes <?go:include ... ?> blocks.  Only
 // files lying within or below the including file's directory can be included.
-// The function aborts on error.
+// <?go:partial ... ?> blocks are processed likewise unless p.PartialsDir is
+// set, in which case ProcessGospIncludes merely rewrites the partial's
+// filename as an absolute path for GospToGo to compile separately.  The
+// function aborts on error.
 func ProcessGospIncludes(p *Parameters, s []byte) []byte {
 	return includeRe.ReplaceAllFunc(s, func(inc []byte) []byte {
 		// Check that the parent is allowed to include the child.
-		fn := string(includeRe.FindSubmatch(inc)[1])
+		sm := includeRe.FindSubmatch(inc)
+		fn := string(sm[2])
 		in, err := gosp.LiesInOrBelow(fn, p.DirStack[len(p.DirStack)-1])
 		if err != nil {
 			notify.Fatal(err)
@@ -40,6 +50,15 @@ func ProcessGospIncludes(p *Parameters, s []byte) []byte {
 				fn, p.DirStack[len(p.DirStack)-1])
 		}
 
+		// Defer separately compiled partials to GospToGo.
+		if string(sm[1]) == "partial" && p.PartialsDir != "" {
+			abs, err := filepath.Abs(fn)
+			if err != nil {
+				notify.Fatal(err)
+			}
+			return []byte("<?go:partial " + abs + " ?>")
+		}
+
 		// Open the child file and read its entire contents.
 		f, err := os.Open(fn)
 		if err != nil {
@@ -61,31 +80,105 @@ func ProcessGospIncludes(p *Parameters, s []byte) []byte {
 	})
 }
 
-// GospToGo converts a string representing a Go server page to a Go program.
-func GospToGo(p *Parameters, s string) string {
+// deflateText compresses page text as a sequence of raw DEFLATE blocks ending
+// with a sync flush so gosp-server can splice it into a compressed response.
+// It returns the empty string if compression doesn't make the text smaller.
+func deflateText(text []byte) string {
+	var buf bytes.Buffer
+	fw, err := flate.NewWriter(&buf, flate.BestCompression)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	_, err = fw.Write(text)
+	if err == nil {
+		err = fw.Flush()
+	}
+	if err != nil {
+		notify.Fatal(err)
+	}
+	if buf.Len() >= len(text) {
+		return ""
+	}
+	return buf.String()
+}
+
+// textToGo returns a Go statement that outputs a segment of page text.  Text
+// of at least p.Precompress bytes is accompanied by a precompressed copy.
+func textToGo(p *Parameters, text []byte) string {
+	if p.Precompress > 0 && len(text) >= p.Precompress {
+		if deflated := deflateText(text); deflated != "" {
+			return fmt.Sprintf("gosp.WriteStatic(gospOut, %q, %q)\n", text, deflated)
+		}
+	}
+	return fmt.Sprintf(`gosp.Fprintf(gospOut, "%%s", %q)`+"\n", text)
+}
+
+// cacheToGo returns the Go code that begins a cached fragment.  code is the
+// contents of the fragment's go:cache markup, a TTL followed by a Go
+// expression that serves as the cache key.  id, which is empty for a page and
+// names the partial for a partial, and n together uniquely identify the
+// fragment within the page.
+func cacheToGo(code, id string, n int) string {
+	code = strings.TrimSpace(code)
+	fields := strings.Fields(code)
+	if len(fields) < 2 {
+		notify.Fatalf("go:cache requires a TTL and a key, not %q", code)
+	}
+	ttl, err := time.ParseDuration(fields[0])
+	if err != nil {
+		notify.Fatal(err)
+	}
+	if ttl <= 0 {
+		notify.Fatalf("go:cache requires a positive TTL, not %s", fields[0])
+	}
+	key := strings.TrimSpace(code[len(fields[0]):])
+	return fmt.Sprintf("gosp.CacheFragment(gospOut, \"%sfragment %d\", %s, %d, func(gospOut gosp.Writer) {\n",
+		id, n, key, int64(ttl))
+}
+
+// A goPage holds the pieces of Go code converted from a Go Server Page or
+// partial.
+type goPage struct {
+	imports   []string // Imports of separately compiled partials
+	top       []string // Top-level Go code
+	body      []string // Main body Go code
+	nSections int      // Number of go:section sections encountered
+}
+
+// convertGosp converts a Go Server Page or partial, with file inclusions
+// already processed, to pieces of Go code.  id is passed to cacheToGo.
+func convertGosp(p *Parameters, b []byte, id string) goPage {
 	// Parse each Gosp directive in turn.
-	top := make([]string, 0, 1)   // Top-level Go code
-	body := make([]string, 0, 16) // Main body Go code
-	re := regexp.MustCompile(`<\?go:(top|block|expr)\s+((?:.|\n)*?)\?>([\t ]*\n?)`)
-	b := ProcessGospIncludes(p, []byte(s))
+	top := make([]string, 0, 1)         // Top-level Go code
+	body := make([]string, 0, 16)       // Main body Go code
+	var imports []string                // Imports of separately compiled partials
+	partials := make(map[string]string) // Map from partial import path to package alias
+	nCaches := 0                        // Number of go:cache fragments encountered
+	openCaches := 0                     // Number of go:cache fragments not yet closed
+	nSections := 0                      // Number of go:section sections encountered
+	inSection := false                  // true=within a go:section section
+	re := directiveRe
 	for {
 		// Find the indexes of the first Gosp directive.
 		idxs := re.FindSubmatchIndex(b)
 		if idxs == nil {
 			// No more directives.  Process any page text.
 			if len(b) > 0 {
-				body = append(body, fmt.Sprintf(`gosp.Fprintf(gospOut, "%%s", %q)`+"\n", b))
+				body = append(body, textToGo(p, b))
 			}
 			break
 		}
 		i0, i1, i2, i3, i4, i5 := idxs[2], idxs[3], idxs[4], idxs[5], idxs[6], idxs[7]
 		dir := string(b[i0:i1])    // Directive
-		code := string(b[i2:i3])   // Inner Go code
+		code := ""                 // Inner Go code
 		tSpace := string(b[i4:i5]) // Trailing white space
+		if i2 >= 0 {
+			code = string(b[i2:i3])
+		}
 
 		// Extract any page text preceding the Gosp code.
 		if i0 > 5 {
-			body = append(body, fmt.Sprintf(`gosp.Fprintf(gospOut, "%%s", %q)`+"\n", b[:i0-5]))
+			body = append(body, textToGo(p, b[:i0-5]))
 		}
 
 		// Extract Go code into either top or body.
@@ -109,6 +202,59 @@ func GospToGo(p *Parameters, s string) string {
 			// retain all trailing white space.
 			body = append(body, fmt.Sprintf(`gosp.Fprintf(gospOut, "%%v%%s", %s, %q)`+"\n",
 				strings.TrimSpace(code), tSpace))
+		case "cache":
+			// The beginning of a cached fragment.
+			nCaches++
+			openCaches++
+			body = append(body, cacheToGo(code, id, nCaches))
+		case "endcache":
+			// The end of a cached fragment.
+			if strings.TrimSpace(code) != "" {
+				notify.Fatalf("go:endcache does not accept arguments (%q)", code)
+			}
+			if openCaches == 0 {
+				notify.Fatal("go:endcache without a matching go:cache")
+			}
+			openCaches--
+			body = append(body, "})\n")
+		case "section":
+			// The beginning of a concurrently rendered section.
+			if strings.TrimSpace(code) != "" {
+				notify.Fatalf("go:section does not accept arguments (%q)", code)
+			}
+			if inSection {
+				notify.Fatal("go:section sections cannot be nested")
+			}
+			if openCaches > 0 {
+				notify.Fatal("go:section cannot appear within a go:cache fragment")
+			}
+			nSections++
+			inSection = true
+			body = append(body, "gospSections.Go(func(gospOut gosp.Writer) {\n")
+		case "endsection":
+			// The end of a concurrently rendered section.
+			if strings.TrimSpace(code) != "" {
+				notify.Fatalf("go:endsection does not accept arguments (%q)", code)
+			}
+			if !inSection {
+				notify.Fatal("go:endsection without a matching go:section")
+			}
+			inSection = false
+			body = append(body, "})\n")
+		case "partial":
+			// A call to a separately compiled partial.  As with
+			// go:include, we retain all trailing white space.
+			imp := BuildPartial(p, strings.TrimSpace(code))
+			alias, ok := partials[imp]
+			if !ok {
+				alias = fmt.Sprintf("gospPartial%d", len(partials)+1)
+				partials[imp] = alias
+				imports = append(imports, fmt.Sprintf("import %s %q\n", alias, imp))
+			}
+			body = append(body, fmt.Sprintf("%s.Render(gospReq, gospOut, gospMeta)\n", alias))
+			if tSpace != "" {
+				body = append(body, textToGo(p, []byte(tSpace)))
+			}
 		default:
 			panic("Internal error parsing a Gosp directive")
 		}
@@ -117,26 +263,107 @@ func GospToGo(p *Parameters, s string) string {
 		b = b[idxs[1]:]
 	}
 
+	// Ensure every cached fragment was closed.
+	if openCaches > 0 {
+		notify.Fatalf("%d go:cache fragment(s) lack a go:endcache", openCaches)
+	}
+	if inSection {
+		notify.Fatal("a go:section section lacks a go:endsection")
+	}
+
 	// Ensure we haven't violated the max-top constraint.
 	if uint(len(top)) > p.MaxTop {
 		notify.Fatalf("Too many go:top blocks (%d versus a maximum of %d)",
 			len(top), p.MaxTop)
 	}
 
-	// Concatenate the accumulated strings into a Go program.
-	all := make([]string, 0, len(top)+len(body)+10)
+	return goPage{
+		imports:   imports,
+		top:       top,
+		body:      body,
+		nSections: nSections,
+	}
+}
+
+// join concatenates the pieces of a goPage into a Go program, given the
+// program's header and the beginning of its rendering function.
+func (g goPage) join(header, bodyBegin string) string {
+	all := make([]string, 0, len(g.imports)+len(g.top)+len(g.body)+10)
 	all = append(all, header)
-	all = append(all, top...)
+	all = append(all, g.imports...)
+	all = append(all, g.top...)
 	all = append(all, "\n")
 	all = append(all, bodyBegin)
-	all = append(all, body...)
+	if g.nSections > 0 {
+		all = append(all, sectionsBegin)
+	}
+	all = append(all, g.body...)
 	all = append(all, "}\n")
 	return strings.Join(all, "")
 }
 
+// GospToGo converts a string representing a Go server page to a Go program.
+func GospToGo(p *Parameters, s string) string {
+	b := ProcessGospIncludes(p, []byte(s))
+	return convertGosp(p, b, "").join(header, bodyBegin)
+}
+
+// WriteStaticPage writes a Go Server Page that contains no Go code, after file
+// inclusion, to p.StaticOutput in place of a plugin and removes any plugin
+// previously built from the page.  If the page does contain Go code,
+// WriteStaticPage instead removes any previously written p.StaticOutput.  It
+// returns true if it wrote the page and aborts on error.
+func WriteStaticPage(p *Parameters, s []byte) bool {
+	// Discard any stale static page if the page contains Go code.
+	b := ProcessGospIncludes(p, s)
+	if directiveRe.Match(b) {
+		err := os.Remove(p.StaticOutput)
+		if err != nil && !os.IsNotExist(err) {
+			notify.Fatal(err)
+		}
+		return false
+	}
+
+	// Atomically replace the static page so the Web server never serves
+	// a partially written file.
+	WriteFileAtomically(p.StaticOutput, b)
+
+	// Remove the plugin so it can't be mistaken for the current page.
+	err := os.Remove(p.OutFileName)
+	if err != nil && !os.IsNotExist(err) {
+		notify.Fatal(err)
+	}
+	return true
+}
+
+// goDirective returns a go.mod "go" directive naming the running version of
+// Go.  It aborts on error.
+func goDirective() string {
+	var maj, min int
+	n, err := fmt.Sscanf(runtime.Version(), "go%d.%d", &maj, &min)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	if n != 2 {
+		notify.Fatalf("failed to parse the Go version string %q", runtime.Version())
+	}
+	return fmt.Sprintf("go %d.%d", maj, min)
+}
+
 // Build compiles the generated Go code to a given plugin filename.  It aborts
 // on error.
 func Build(p *Parameters, goStr, plugFn string) {
+	// Locate the profile, if any, before we change directories.
+	pgoFn := ""
+	if p.PGOProfile != "" {
+		if _, err := os.Stat(p.PGOProfile); err == nil {
+			pgoFn, err = filepath.Abs(p.PGOProfile)
+			if err != nil {
+				notify.Fatal(err)
+			}
+		}
+	}
+
 	// Create a temporary directory and switch to it.
 	goDn := MakeTempGo(goStr)
 	defer os.RemoveAll(goDn)
@@ -157,18 +384,13 @@ func Build(p *Parameters, goStr, plugFn string) {
 	}
 	fmt.Fprintln(mod, "module github.com/spakin/gosp2go-plugin")
 	fmt.Fprintln(mod, "")
-	var maj, min int
-	n, err := fmt.Sscanf(runtime.Version(), "go%d.%d", &maj, &min)
-	if err != nil {
-		notify.Fatal(err)
-	}
-	if n != 2 {
-		notify.Fatalf("failed to parse the Go version string %q", runtime.Version())
-	}
-	fmt.Fprintf(mod, "go %d.%d\n\n", maj, min)
+	fmt.Fprintf(mod, "%s\n\n", goDirective())
 	for _, mr := range p.ModRepls {
 		fmt.Fprintf(mod, "replace %s => %q\n", mr.Module, mr.Path)
 	}
+	if p.PartialsDir != "" {
+		fmt.Fprintf(mod, "replace %s => %q\n", partialsModule, p.PartialsDir)
+	}
 	err = mod.Close()
 	if err != nil {
 		notify.Fatal(err)
@@ -185,8 +407,16 @@ func Build(p *Parameters, goStr, plugFn string) {
 		notify.Fatalf("Failed to run %v: %v", cmd.Args, err)
 	}
 
-	// Compile main.go into a plugin.
-	cmd = exec.Command(p.GoCmd, "build", "--buildmode=plugin", "-o", plugFn, "main.go")
+	// Compile main.go into a plugin.  Profile-guided optimization is
+	// applied only to the page itself.  (The -pgo option would also
+	// rebuild the gosp package and the standard library, which prevents
+	// gosp-server from loading the resulting plugin.)
+	args := []string{"build", "--buildmode=plugin", "-o", plugFn}
+	if pgoFn != "" {
+		args = append(args, "-gcflags=command-line-arguments=-pgoprofile="+pgoFn)
+	}
+	args = append(args, "main.go")
+	cmd = exec.Command(p.GoCmd, args...)
 	cmd.Stdout = os.Stderr
 	cmd.Stderr = os.Stderr
 	err = cmd.Run()
@@ -221,6 +451,9 @@ func main() {
 	var err error
 	notify = log.New(os.Stderr, os.Args[0]+": ", 0)
 	p := ParseCommandLine()
+	if p.BuildServer != "" {
+		notify.Fatal(ServeBuilds(p))
+	}
 
 	// Open the input file.
 	inFile := SmartOpen(p.InFileName, false)
@@ -246,6 +479,9 @@ func main() {
 	if err != nil {
 		notify.Fatal(err)
 	}
+	if p.StaticOutput != "" && WriteStaticPage(p, in) {
+		return
+	}
 	goStr := GospToGo(p, string(in))
 	err = p.ValidateImports(goStr)
 	if err != nil {
@@ -7,8 +7,11 @@ import (
 	"flag"
 	"fmt"
 	"os"
+	"path/filepath"
+	"runtime"
 	"sort"
 	"strings"
+	"time"
 )
 
 // Version defines the Go Server Pages version number.  This should be
@@ -27,6 +30,13 @@ type Parameters struct {
 	AllowedImports ImportSet             // Set of packages the Go code is allowe to import
 	GospServerArgs []string              // Additional arguments to pass to gosp-server
 	ModRepls       ModuleReplacementList // List of module replacements to write to generated go.mod files
+	PGOProfile     string                // CPU profile with which to perform profile-guided optimization
+	BuildServer    string                // Unix socket (filename) on which to accept build requests
+	BuildJobs      int                   // Maximum number of concurrent builds a build server runs
+	BuildIdle      time.Duration         // Idle time after which a build server exits
+	Precompress    int                   // Minimum length of page text to precompress or 0 for none
+	StaticOutput   string                // File to which to write a page containing no Go code in place of a plugin
+	PartialsDir    string                // Directory in which to compile go:partial files separately or "" to include them in place
 }
 
 // An ImportSet represents a set of package names.  The Boolean value is always
@@ -138,6 +148,36 @@ The following options are accepted:
   --replace MODULE,PATH
                Indicate a module replacement to write to go.mod
 
+  --pgo FILE   Apply profile-guided optimization using the CPU profile
+               in FILE; ignored if FILE does not exist
+
+  --precompress=NUM
+               Precompress each segment of literal page text of at least
+               NUM bytes so gosp-server can splice it into compressed
+               responses; 0 disables precompression [default: 2048]
+
+  --static-output=FILE
+               With --build, if the page contains no Go code after file
+               inclusion, write the page to FILE as is and remove the
+               plugin instead of building it; otherwise, remove FILE
+
+  --partials-dir=DIR
+               Compile each <?go:partial ... ?> file into a Go package
+               in directory DIR, shared by all pages that include it,
+               instead of pasting it into the page
+
+  --build-server=SOCKET
+               Run as a build server that accepts compilation requests on
+               Unix socket SOCKET (used by the Apache module)
+
+  --build-jobs=NUM
+               Let the build server run at most NUM compilations at once
+               [default: the number of CPUs]
+
+  --build-idle=DURATION
+               Exit the build server after DURATION of no compilations
+               [default: 5m0s]
+
   --version    Output the gosp2go version number and exit
 
   --help       Output gosp2go usage information and exit
@@ -157,6 +197,10 @@ func checkParams(p *Parameters) {
 		fmt.Fprintf(flag.CommandLine.Output(), "%s: An output filename must be specified when --build is used.\n\n", os.Args[0])
 		flag.Usage()
 	}
+	if p.StaticOutput != "" && !p.Build {
+		fmt.Fprintf(flag.CommandLine.Output(), "%s: --static-output requires --build.\n\n", os.Args[0])
+		flag.Usage()
+	}
 }
 
 // assignGospServerArgs prepares to pass any remaining arguments to gosp-server.
@@ -206,6 +250,13 @@ func ParseCommandLine() *Parameters {
 	flag.Var(&p.AllowedImports, "allowed", "Comma-separated list of allowed Go imports")
 	flag.Var(&p.AllowedImports, "a", "Abbreviation of --allowed")
 	flag.Var(&p.ModRepls, "replace", `Module replacement to write to go.mod, expressed as "<module>,<path>"`)
+	flag.StringVar(&p.PGOProfile, "pgo", "", "CPU profile with which to perform profile-guided optimization")
+	flag.IntVar(&p.Precompress, "precompress", 2048, "Minimum length of page text to precompress or 0 for none")
+	flag.StringVar(&p.StaticOutput, "static-output", "", "File to which to write a page containing no Go code in place of a plugin")
+	flag.StringVar(&p.PartialsDir, "partials-dir", "", "Directory in which to compile go:partial files into shared Go packages")
+	flag.StringVar(&p.BuildServer, "build-server", "", "Unix socket on which to accept build requests")
+	flag.IntVar(&p.BuildJobs, "build-jobs", runtime.NumCPU(), "Maximum number of concurrent builds")
+	flag.DurationVar(&p.BuildIdle, "build-idle", 5*time.Minute, "Idle time after which the build server exits")
 	flag.Parse()
 	assignGospServerArgs(&p)
 
@@ -225,7 +276,29 @@ func ParseCommandLine() *Parameters {
 		delete(p.AllowedImports, "PLACEHOLDER_ALL")
 	}
 
+	// A build server needs no other parameters.
+	if p.BuildServer != "" {
+		if p.BuildJobs < 1 {
+			fmt.Fprintf(flag.CommandLine.Output(), "%s: --build-jobs must be at least 1.\n\n", os.Args[0])
+			flag.Usage()
+		}
+		return &p
+	}
+
 	// Check the parameters for self-consistency.
 	checkParams(&p)
+
+	// Because we change directories as we process file inclusions, make
+	// the static-output filename and partials directory absolute.
+	for _, fn := range []*string{&p.StaticOutput, &p.PartialsDir} {
+		if *fn == "" {
+			continue
+		}
+		abs, err := filepath.Abs(*fn)
+		if err != nil {
+			notify.Fatal(err)
+		}
+		*fn = abs
+	}
 	return &p
 }
@@ -0,0 +1,62 @@
+// This file compiles Go Server Pages partials into Go packages that can be
+// shared by all of the pages that include them.
+
+package main
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+)
+
+// partialsModule is the module path under which separately compiled partials
+// are imported.
+const partialsModule = "gosp-partials"
+
+// BuildPartial converts the partial in a given file to a Go package in
+// p.PartialsDir and returns the package's import path.  The package is named
+// after a hash of its code so every page that includes the same partial
+// imports the same, unchanging package, which the Go build cache then compiles
+// only once.  BuildPartial aborts on error.
+func BuildPartial(p *Parameters, fn string) string {
+	// Convert the partial to Go from the partial's own directory.
+	all, err := ioutil.ReadFile(fn)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	p.PushDirectoryOf(fn)
+	b := ProcessGospIncludes(p, all)
+	goStr := convertGosp(p, b, "partial "+fn+" ").join(partialHeader, partialBegin)
+	p.PopDirectory()
+	err = p.ValidateImports(goStr)
+	if err != nil {
+		notify.Fatal(err)
+	}
+
+	// Ensure the partials directory holds a Go module.
+	err = os.MkdirAll(p.PartialsDir, 0755)
+	if err != nil {
+		notify.Fatal(err)
+	}
+	modFn := filepath.Join(p.PartialsDir, "go.mod")
+	mod := []byte(fmt.Sprintf("module %s\n\n%s\n", partialsModule, goDirective()))
+	if old, err := ioutil.ReadFile(modFn); err != nil || !bytes.Equal(old, mod) {
+		WriteFileAtomically(modFn, mod)
+	}
+
+	// Write the partial's package unless an identical one already exists.
+	sum := sha256.Sum256([]byte(goStr))
+	pkg := fmt.Sprintf("p%x", sum[:12])
+	pkgFn := filepath.Join(p.PartialsDir, pkg, "partial.go")
+	if _, err := os.Stat(pkgFn); os.IsNotExist(err) {
+		err = os.MkdirAll(filepath.Dir(pkgFn), 0755)
+		if err != nil {
+			notify.Fatal(err)
+		}
+		WriteFileAtomically(pkgFn, []byte(goStr))
+	}
+	return partialsModule + "/" + pkg
+}
@@ -10,6 +10,7 @@ import (
 	"io/ioutil"
 	"os"
 	"path/filepath"
+	"strings"
 )
 
 // MakeTempGo writes a string of Go code to main.go in a temporary directory
@@ -35,6 +36,30 @@ func MakeTempGo(goStr string) string {
 	return goDir
 }
 
+// WriteFileAtomically replaces the contents of a file with the given data in
+// such a way that concurrent readers see either the old contents or the new
+// contents but never a mix.  It aborts on error.
+func WriteFileAtomically(fn string, data []byte) {
+	tmp, err := ioutil.TempFile(filepath.Dir(fn), ".gosp-tmp-")
+	if err != nil {
+		notify.Fatal(err)
+	}
+	_, err = tmp.Write(data)
+	if err == nil {
+		err = tmp.Chmod(0644)
+	}
+	if err == nil {
+		err = tmp.Close()
+	}
+	if err == nil {
+		err = os.Rename(tmp.Name(), fn)
+	}
+	if err != nil {
+		_ = os.Remove(tmp.Name())
+		notify.Fatal(err)
+	}
+}
+
 // PushDirectoryOf switches to the parent directory of a given file.  It aborts
 // on error.
 func (p *Parameters) PushDirectoryOf(fn string) {
@@ -122,6 +147,9 @@ func (p *Parameters) ValidateImports(code string) error {
 		if imp == "gosp" {
 			continue // The gosp package is implicitly allowed.
 		}
+		if strings.HasPrefix(imp, partialsModule+"/") {
+			continue // So are partials, whose imports were validated separately.
+		}
 		if !p.AllowedImports[imp] {
 			// Not found -- issue a helpful error message.
 			return fmt.Errorf("%q is not in the list of approved packages for %s (%q)",
@@ -0,0 +1,548 @@
+/************************************************
+ * Micro-benchmarks for the Gosp Apache module's *
+ * request-encoding and response-handling code   *
+ *                                               *
+ * By Scott Pakin <scott+gosp@pakin.org>         *
+ ************************************************/
+
+/* This program exercises the module's hot paths without a running httpd.  It
+ * compiles the module's communication code directly into the benchmark (so
+ * static functions are accessible), replaces the handful of httpd functions
+ * that code calls with minimal stand-ins, and substitutes a thread on the far
+ * end of a socketpair for the Gosp server. */
+
+#include <malloc.h>
+#include <time.h>
+#include "../utils.c"
+#include "../comm.c"
+#include "apr_thread_proc.h"
+
+/* Define the module structure the module's code consults for its
+ * configuration.  Only module_index is used. */
+module AP_MODULE_DECLARE_DATA gosp_module;
+
+/* Minimum time in nanoseconds for which to run each benchmark */
+#define BENCH_MIN_NS 500000000LL
+
+/* Fields to return from the stand-in for ap_parse_form_data() */
+static int num_post_fields = 0;
+static apr_size_t post_field_size = 0;
+
+/* ---------------------------------------------------------------------- */
+
+/* Stand-ins for httpd functions called by the module's code.  None of these
+ * needs to do real work; they merely let the code under test run. */
+
+void ap_log_error_(const char *file, int line, int module_index, int level,
+                   apr_status_t status, const server_rec *s, const char *fmt, ...)
+{
+}
+
+void ap_log_rerror_(const char *file, int line, int module_index, int level,
+                    apr_status_t status, const request_rec *r, const char *fmt, ...)
+{
+}
+
+const char *ap_get_remote_host(conn_rec *conn, void *dir_config, int type, int *str_is_ip)
+{
+  return "127.0.0.1";
+}
+
+const char *ap_get_server_name_for_url(request_rec *r)
+{
+  return "localhost";
+}
+
+apr_port_t ap_get_server_port(const request_rec *r)
+{
+  return 80;
+}
+
+const char *ap_run_http_scheme(const request_rec *r)
+{
+  return "http";
+}
+
+apr_port_t ap_run_default_port(const request_rec *r)
+{
+  return 80;
+}
+
+int ap_rwrite(const void *buf, int nbyte, request_rec *r)
+{
+  return nbyte;
+}
+
+int ap_rflush(request_rec *r)
+{
+  return 0;
+}
+
+void ap_send_interim_response(request_rec *r, int send_headers)
+{
+}
+
+void ap_set_content_type(request_rec *r, const char *ct)
+{
+  r->content_type = ct;
+}
+
+void ap_set_content_length(request_rec *r, apr_off_t length)
+{
+}
+
+void ap_set_etag(request_rec *r)
+{
+}
+
+void ap_set_last_modified(request_rec *r)
+{
+}
+
+void ap_update_mtime(request_rec *r, apr_time_t dependency_mtime)
+{
+}
+
+int ap_meets_conditions(request_rec *r)
+{
+  return OK;
+}
+
+apr_status_t ap_pass_brigade(ap_filter_t *filter, apr_bucket_brigade *bucket)
+{
+  return APR_SUCCESS;
+}
+
+request_rec *ap_sub_req_lookup_file(const char *new_file, const request_rec *r,
+                                    ap_filter_t *next_filter)
+{
+  return (request_rec *) r;
+}
+
+void ap_destroy_sub_req(request_rec *r)
+{
+}
+
+void ap_die(int type, request_rec *r)
+{
+}
+
+void ap_finalize_request_protocol(request_rec *r)
+{
+}
+
+void ap_process_request_after_handler(request_rec *r)
+{
+}
+
+apr_status_t ap_mpm_resume_suspended(conn_rec *c)
+{
+  return APR_SUCCESS;
+}
+
+apr_status_t ap_mpm_register_timed_callback(apr_time_t t, ap_mpm_callback_fn_t *cbfn, void *baton)
+{
+  return APR_ENOTIMPL;
+}
+
+apr_status_t ap_mpm_register_socket_callback_timeout(apr_socket_t **s, apr_pool_t *p, int for_read,
+                                                     ap_mpm_callback_fn_t *cbfn,
+                                                     ap_mpm_callback_fn_t *tofn,
+                                                     void *baton, apr_time_t timeout)
+{
+  return APR_ENOTIMPL;
+}
+
+apr_status_t ap_mpm_unregister_socket_callback(apr_socket_t **s, apr_pool_t *p)
+{
+  return APR_ENOTIMPL;
+}
+
+/* Return num_post_fields fields of post_field_size bytes apiece. */
+int ap_parse_form_data(request_rec *r, ap_filter_t *f, apr_array_header_t **ptr,
+                       apr_size_t num, apr_size_t size)
+{
+  char *value;      /* Value of every field */
+  int i;
+
+  if (num_post_fields == 0) {
+    *ptr = NULL;
+    return OK;
+  }
+  value = apr_palloc(r->pool, post_field_size);
+  memset(value, 'x', post_field_size);
+  *ptr = apr_array_make(r->pool, num_post_fields, sizeof(ap_form_pair_t));
+  for (i = 0; i < num_post_fields; i++) {
+    ap_form_pair_t *pair = (ap_form_pair_t *) apr_array_push(*ptr);
+    pair->name = apr_psprintf(r->pool, "field%d", i);
+    pair->value = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    apr_brigade_write(pair->value, NULL, NULL, value, post_field_size);
+  }
+  return OK;
+}
+
+/* Stand-ins for the module's statistics code, which is not under test */
+void scoreboard_end_request(request_rec *r, int http_status) {}
+void scoreboard_first_byte(request_rec *r) {}
+void scoreboard_note_server(request_rec *r, int pid) {}
+void scoreboard_phase_begin(request_rec *r) {}
+void scoreboard_phase_end(request_rec *r, gosp_phase_t phase) {}
+void timing_note_server(request_rec *r, const char *value) {}
+void timing_set_header(request_rec *r) {}
+int timing_wanted(request_rec *r) { return 0; }
+
+/* ---------------------------------------------------------------------- */
+
+/* Define the work a fake Gosp server performs on one connection. */
+typedef struct {
+  int fd;                      /* Server end of a socketpair */
+  int drain;                   /* 1=read the request before responding; 0=don't */
+  const char *response;        /* Response to send */
+  apr_size_t resp_len;         /* Number of bytes in response */
+} fake_server_job_t;
+
+/* Pipe over which to pass jobs to the fake Gosp server */
+static int fake_server_pipe[2];
+
+/* Serve jobs until the pipe is closed.  Each job reads a request (if
+ * requested), writes a canned response, and closes the connection. */
+static void *APR_THREAD_FUNC fake_server(apr_thread_t *thread, void *arg)
+{
+  fake_server_job_t job;       /* Current job */
+  char buf[65536];             /* Buffer for draining requests */
+
+  while (read(fake_server_pipe[0], &job, sizeof(job)) == sizeof(job)) {
+    apr_size_t sent;           /* Number of bytes of response sent so far */
+
+    if (job.drain)
+      while (read(job.fd, buf, sizeof(buf)) > 0)
+        ;
+    for (sent = 0; sent < job.resp_len; ) {
+      ssize_t n = write(job.fd, job.response + sent, job.resp_len - sent);
+      if (n <= 0)
+        break;
+      sent += n;
+    }
+    close(job.fd);
+  }
+  return NULL;
+}
+
+/* Connect to the fake Gosp server.  Return an APR socket. */
+static apr_socket_t *fake_server_connect(apr_pool_t *pool, int drain,
+                                         const char *response, apr_size_t resp_len)
+{
+  int fds[2];                  /* Client and server ends of a socketpair */
+  fake_server_job_t job;       /* Job to give the fake server */
+  apr_socket_t *sock = NULL;   /* Client end as an APR socket */
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  job.fd = fds[1];
+  job.drain = drain;
+  job.response = response;
+  job.resp_len = resp_len;
+  if (write(fake_server_pipe[1], &job, sizeof(job)) != sizeof(job)) {
+    perror("write");
+    exit(1);
+  }
+  apr_os_sock_put(&sock, &fds[0], pool);
+  return sock;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* Define the shape of a synthetic request. */
+typedef struct {
+  const char *name;            /* Workload name */
+  int num_headers;             /* Number of request headers */
+  int num_env;                 /* Number of environment variables */
+  int num_args;                /* Number of GET arguments */
+  int num_post_fields;         /* Number of POST fields */
+  apr_size_t post_field_size;  /* Size in bytes of each POST field */
+  apr_size_t data_size;        /* Size in bytes of the page data in the response */
+} workload_t;
+
+/* Define all of our workloads. */
+static const workload_t workloads[] =
+  {
+   {"typical",        20,  30,  3,  0,     0,       8192},
+   {"many-headers",  200,  30,  3,  0,     0,       8192},
+   {"many-args",      20,  30, 200, 0,     0,       8192},
+   {"large-post",     20,  30,  3, 64, 16384,       8192},
+   {"large-response", 20,  30,  3,  0,     0, 4*1048576},
+   { NULL }
+  };
+
+/* Define the state shared by every iteration of a benchmark. */
+typedef struct {
+  const workload_t *work;      /* Workload to run */
+  server_rec *server;          /* Fake server */
+  conn_rec *connection;        /* Fake connection */
+  void **config;               /* Configuration vector */
+  char *json_input;            /* String to escape */
+  char *response;              /* Canned Gosp-server response */
+  apr_size_t resp_len;         /* Number of bytes in response */
+} bench_state_t;
+
+/* Create a request_rec corresponding to the given workload. */
+static request_rec *create_request(apr_pool_t *pool, bench_state_t *state)
+{
+  static struct ap_logconf logconf = {NULL, APLOG_WARNING};  /* Logging configuration */
+  const workload_t *work = state->work;   /* Workload to run */
+  request_rec *r;              /* Request to return */
+  char *args;                  /* GET arguments */
+  int i;
+
+  r = apr_pcalloc(pool, sizeof(request_rec));
+  r->pool = pool;
+  r->server = state->server;
+  r->connection = state->connection;
+  r->log = &logconf;
+  r->per_dir_config = (ap_conf_vector_t *) state->config;
+  r->request_config = (ap_conf_vector_t *) apr_pcalloc(pool, sizeof(void *));
+  r->method = "GET";
+  r->uri = "/bench/page.html";
+  r->filename = "/var/www/html/bench/page.html";
+  r->path_info = "";
+  r->the_request = "GET /bench/page.html HTTP/1.1";
+  r->useragent_ip = "127.0.0.1";
+  r->request_time = apr_time_now();
+  r->status = HTTP_OK;
+  r->headers_in = apr_table_make(pool, work->num_headers);
+  r->headers_out = apr_table_make(pool, 10);
+  r->subprocess_env = apr_table_make(pool, work->num_env);
+  for (i = 0; i < work->num_headers; i++)
+    apr_table_setn(r->headers_in,
+                   apr_psprintf(pool, "X-Bench-Header-%d", i),
+                   "Mozilla/5.0 (X11; Linux x86_64) \"quoted\" value");
+  for (i = 0; i < work->num_env; i++)
+    apr_table_setn(r->subprocess_env,
+                   apr_psprintf(pool, "BENCH_VAR_%d", i),
+                   "/usr/local/bin:/usr/bin:/bin");
+  args = "";
+  for (i = 0; i < work->num_args; i++)
+    args = apr_psprintf(pool, "%s%sarg%d=value%d", args, i == 0 ? "" : "&", i, i);
+  r->args = work->num_args > 0 ? args : NULL;
+  num_post_fields = work->num_post_fields;
+  post_field_size = work->post_field_size;
+  return r;
+}
+
+/* Benchmark buffer_append_json() on a header-sized string. */
+static void bench_append_json(request_rec *r, bench_state_t *state)
+{
+  gosp_buffer_t *buf = buffer_create(r->pool, REQUEST_BUFFER_SIZE);
+  buffer_append_json(buf, state->json_input, strlen(state->json_input));
+}
+
+/* Benchmark encode_get_args(). */
+static void bench_encode_get_args(request_rec *r, bench_state_t *state)
+{
+  gosp_buffer_t *buf = buffer_create(r->pool, REQUEST_BUFFER_SIZE);
+  encode_get_args(r, buf);
+}
+
+/* Benchmark encoding a request without sending it. */
+static void bench_encode_request(request_rec *r, bench_state_t *state)
+{
+  gosp_buffer_t *buf = buffer_create(r->pool, REQUEST_BUFFER_SIZE);
+  (void) encode_request(r, buf);
+}
+
+/* Benchmark encoding a request and sending it to the fake Gosp server. */
+static void bench_send_request(request_rec *r, bench_state_t *state)
+{
+  apr_socket_t *sock = fake_server_connect(r->pool, 1, "", 0);
+  (void) send_request(r, sock);
+  apr_socket_close(sock);
+}
+
+/* Benchmark receiving a response from the fake Gosp server. */
+static void bench_receive_response(request_rec *r, bench_state_t *state)
+{
+  apr_socket_t *sock;          /* Connection to the fake Gosp server */
+  char *response;              /* Response received */
+  size_t resp_len;             /* Length of response */
+
+  sock = fake_server_connect(r->pool, 0, state->response, state->resp_len);
+  (void) receive_response(r, sock, &response, &resp_len, NULL);
+  apr_socket_close(sock);
+}
+
+/* Benchmark processing a response that has already been received. */
+static void bench_process_response(request_rec *r, bench_state_t *state)
+{
+  gosp_buffer_t *buf;          /* Copy of the response */
+  response_state_t resp;       /* State of response processing */
+
+  buf = buffer_create(r->pool, state->resp_len + 1);
+  buffer_append(buf, state->response, state->resp_len);
+  init_response_state(&resp);
+  (void) process_response(r, buf, NULL, &resp);
+}
+
+/* Return the current time in nanoseconds. */
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Return the number of bytes currently allocated from the C library. */
+static size_t malloc_in_use(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+#else
+  struct mallinfo mi = mallinfo();
+#endif
+  return (size_t)mi.uordblks + (size_t)mi.hblkhd;
+}
+
+/* Run a single iteration in a fresh request pool, as httpd would. */
+static void run_once(apr_pool_t *parent, apr_allocator_t *alloc, bench_state_t *state,
+                     void (*fn)(request_rec *, bench_state_t *))
+{
+  apr_pool_t *pool;            /* Per-request pool */
+
+  apr_pool_create_ex(&pool, parent, NULL, alloc);
+  fn(create_request(pool, state), state);
+  apr_pool_destroy(pool);
+}
+
+/* Run a benchmark repeatedly and report nanoseconds and bytes of pool memory
+ * per operation.  The time includes creating and destroying the request pool
+ * and request_rec, which httpd also does once per request. */
+static void run_benchmark(apr_pool_t *parent, bench_state_t *state, const char *name,
+                          void (*fn)(request_rec *, bench_state_t *))
+{
+  long long iters;             /* Number of iterations to perform */
+  long long begin;             /* Starting time in nanoseconds */
+  long long elapsed = 0;       /* Elapsed time in nanoseconds */
+  long long i;
+  apr_allocator_t *alloc;      /* Fresh allocator for measuring memory */
+  apr_pool_t *pool;            /* Pool backed by alloc */
+  size_t mem_before;           /* Bytes allocated before an operation */
+  size_t mem_used;             /* Bytes allocated by an operation */
+
+  /* Measure memory usage with a fresh allocator so every byte the request
+   * pool uses comes from malloc() instead of the allocator's free list. */
+  apr_allocator_create(&alloc);
+  mem_before = malloc_in_use();
+  apr_pool_create_ex(&pool, NULL, NULL, alloc);
+  fn(create_request(pool, state), state);
+  mem_used = malloc_in_use() - mem_before;
+  apr_pool_destroy(pool);
+  apr_allocator_destroy(alloc);
+
+  /* Double the number of iterations until the benchmark runs long enough to
+   * time reliably. */
+  for (iters = 1; elapsed < BENCH_MIN_NS; iters *= 2) {
+    begin = now_ns();
+    for (i = 0; i < iters; i++)
+      run_once(parent, NULL, state, fn);
+    elapsed = now_ns() - begin;
+  }
+  iters /= 2;
+  printf("%-16s %-18s %12lld %12.0f ns/op %12lu B/op\n",
+         state->work->name, name, iters, (double)elapsed/(double)iters,
+         (unsigned long) mem_used);
+}
+
+/* Prepare the state for a given workload. */
+static void prepare_state(apr_pool_t *pool, bench_state_t *state, const workload_t *work)
+{
+  static const char *metadata =
+    "mime-type text/html; charset=utf-8\n"
+    "http-status 200\n"
+    "header-field true Cache-Control no-cache\n"
+    "header-field false Set-Cookie session=abc123; Path=/\n"
+    "end-header\n";
+  apr_size_t meta_len = strlen(metadata);   /* Length of the metadata */
+  apr_size_t i;
+
+  /* Construct a string to escape. */
+  state->work = work;
+  state->json_input = apr_palloc(pool, 1025);
+  for (i = 0; i < 1024; i++)
+    state->json_input[i] = i%37 == 0 ? '"' : 'a' + i%26;
+  state->json_input[1024] = '\0';
+
+  /* Construct a response. */
+  state->resp_len = meta_len + work->data_size;
+  state->response = apr_palloc(pool, state->resp_len + 1);
+  memcpy(state->response, metadata, meta_len);
+  for (i = 0; i < work->data_size; i++)
+    state->response[meta_len + i] = i%80 == 79 ? '\n' : 'a' + i%26;
+  state->response[state->resp_len] = '\0';
+}
+
+int main(int argc, const char *argv[])
+{
+  apr_pool_t *pool;            /* Pool for long-lived data */
+  apr_thread_t *thread;        /* Fake Gosp server */
+  apr_status_t status;         /* Status of an APR call */
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  gosp_context_config_t *cconfig;  /* Context configuration */
+  bench_state_t state;         /* State to pass to each benchmark */
+  const workload_t *work;      /* Current workload */
+  const char *only = argc > 1 ? argv[1] : NULL;   /* Name of the only workload to run */
+
+  /* Initialize APR. */
+  apr_initialize();
+  apr_pool_create(&pool, NULL);
+
+  /* Create a fake server, connection, and configuration. */
+  gosp_module.module_index = 0;
+  sconfig = apr_pcalloc(pool, sizeof(gosp_server_config_t));
+  cconfig = apr_pcalloc(pool, sizeof(gosp_context_config_t));
+  cconfig->coalesce = -1;
+  cconfig->async = -1;
+  cconfig->server_timing = -1;
+  cconfig->profile_guided = -1;
+  memset(&state, 0, sizeof(state));
+  state.config = apr_pcalloc(pool, sizeof(void *));
+  state.config[0] = cconfig;
+  state.server = apr_pcalloc(pool, sizeof(server_rec));
+  state.server->module_config = apr_pcalloc(pool, sizeof(void *));
+  ((void **) state.server->module_config)[0] = sconfig;
+  state.server->server_admin = "webmaster@localhost";
+  state.connection = apr_pcalloc(pool, sizeof(conn_rec));
+  state.connection->pool = pool;
+  state.connection->base_server = state.server;
+  state.connection->bucket_alloc = apr_bucket_alloc_create(pool);
+
+  /* Launch the fake Gosp server. */
+  if (pipe(fake_server_pipe) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  status = apr_thread_create(&thread, NULL, fake_server, NULL, pool);
+  if (status != APR_SUCCESS) {
+    fprintf(stderr, "Failed to create the fake Gosp server thread\n");
+    return 1;
+  }
+
+  /* Run each benchmark on each workload. */
+  printf("%-16s %-18s %12s %18s %17s\n",
+         "Workload", "Function", "Iterations", "Time", "Memory");
+  for (work = workloads; work->name != NULL; work++) {
+    if (only != NULL && strcmp(only, work->name) != 0)
+      continue;
+    prepare_state(pool, &state, work);
+    run_benchmark(pool, &state, "buffer_append_json", bench_append_json);
+    run_benchmark(pool, &state, "encode_get_args", bench_encode_get_args);
+    run_benchmark(pool, &state, "encode_request", bench_encode_request);
+    run_benchmark(pool, &state, "send_request", bench_send_request);
+    run_benchmark(pool, &state, "receive_response", bench_receive_response);
+    run_benchmark(pool, &state, "process_response", bench_process_response);
+  }
+  close(fake_server_pipe[1]);
+  apr_terminate();
+  return 0;
+}
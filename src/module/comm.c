@@ -5,9 +5,22 @@
  ******************************************/
 
 #include "gosp.h"
+#include "apr_atomic.h"
+#include "apr_mmap.h"
+
+/* Exchange page requests with Gosp servers through shared memory only on
+ * Linux, whose futexes wake a waiting process when its peer posts data. */
+#if defined(__linux__) && APR_HAS_MMAP
+# define GOSP_SHM_RING
+# include <errno.h>
+# include <signal.h>
+# include <sys/syscall.h>
+# include <linux/futex.h>
+#endif
 
 /* Send a string to the socket.  Log a message and return GOSP_STATUS_FAIL on
- * error. */
+ * error.  This is used for small control requests; page requests are instead
+ * encoded into a buffer with APPEND_STRING and sent all at once. */
 #define SEND_STRING(...)                                                \
   do {                                                                  \
     const char *str = apr_psprintf(r->pool, __VA_ARGS__);               \
@@ -21,6 +34,40 @@
   }                                                                     \
   while (0)
 
+/* Append a formatted string to the request buffer buf. */
+#define APPEND_STRING(...) buffer_printf(buf, __VA_ARGS__)
+
+/* Initial size of the buffer into which we encode a page request */
+#define REQUEST_BUFFER_SIZE 8192
+
+/* Initial size of the buffer into which we receive a response */
+#define RESPONSE_BUFFER_SIZE 16384
+
+/* HTTP status code for an early-hints interim response, which not all
+ * versions of Apache define */
+#define GOSP_EARLY_HINTS 103
+
+/* Flags with which to receive a file descriptor from a Gosp server.  Where
+ * available, have the kernel mark the descriptor close-on-exec atomically so
+ * the gosp2go and gosp-server processes we launch don't inherit it. */
+#ifdef MSG_CMSG_CLOEXEC
+# define RECV_FD_FLAGS MSG_CMSG_CLOEXEC
+#else
+# define RECV_FD_FLAGS 0
+#endif
+
+/* Define the state of processing a response from the Gosp server, whose
+ * metadata may be processed incrementally as they arrive. */
+typedef struct {
+  apr_size_t processed;        /* Number of bytes of the response already processed */
+  int header_done;             /* 1=saw "end-header"; 0=didn't */
+  int headers_sent;            /* 1=the HTTP headers were already sent to the client; 0=they weren't */
+  apr_off_t body_fd_len;       /* Length of the data in the body file or -1 if the data are inline */
+  const char *send_file;       /* File to send in place of the data */
+  int mime_type_set;           /* 1=Gosp server specified a MIME type; 0=it didn't */
+  const char *file_type;       /* MIME type associated with send_file */
+} response_state_t;
+
 /* Connect to a Unix-domain stream socket.  Return GOSP_STATUS_FAIL if we fail
  * to create any local data structures.  Return GOSP_STATUS_NEED_ACTION if we
  * fail to connect to the socket.  Return GOSP_STATUS_OK on success. */
@@ -50,34 +97,33 @@ gosp_status_t connect_socket(request_rec *r, const char *sock_name, apr_socket_t
   return GOSP_STATUS_OK;
 }
 
-/* Escape a string for JSON. */
-static char *escape_for_json(request_rec *r, const char *str)
+/* Append a "key": "value" member to a buffer, preceded by indentation and
+ * followed by a separator. */
+static void append_json_member(gosp_buffer_t *buf, const char *indent,
+                               const char *key, apr_size_t key_len,
+                               const char *value, apr_size_t value_len,
+                               const char *sep)
 {
-  char *quoted;    /* Quoted version of str */
-  const char *sp;  /* Pointer into str */
-  char *qp;        /* Pointer into quoted */
-
-  if (str == NULL)
-    return apr_pstrdup(r->pool, "");
-  quoted = apr_palloc(r->pool, strlen(str)*2 + 1);  /* Worst-case allocation */
-  for (qp = quoted, sp = str; *sp != '\0'; qp++, sp++)
-    switch (*sp) {
-    case '\\':
-    case '"':
-      *qp++ = '\\';
-      *qp = *sp;
-      break;
+  buffer_append(buf, indent, strlen(indent));
+  buffer_append(buf, "\"", 1);
+  buffer_append_json(buf, key, key_len);
+  buffer_append(buf, "\": \"", 4);
+  buffer_append_json(buf, value, value_len);
+  buffer_append(buf, "\"", 1);
+  buffer_append(buf, sep, strlen(sep));
+}
 
-    default:
-      *qp = *sp;
-      break;
-    }
-  *qp = '\0';
-  return quoted;
+/* Append a "key": "value" member for a UserData field to a buffer. */
+static void append_user_data(gosp_buffer_t *buf, const char *key,
+                             const char *value, const char *sep)
+{
+  if (value == NULL)
+    value = "";
+  append_json_member(buf, "    ", key, strlen(key), value, strlen(value), sep);
 }
 
-/* Send POST data as a JSON object. */
-static gosp_status_t send_post_data(request_rec *r, apr_socket_t *sock)
+/* Encode POST data as a JSON object. */
+static gosp_status_t encode_post_data(request_rec *r, gosp_buffer_t *buf)
 {
   apr_array_header_t *array = NULL;   /* Array of key:value pairs */
   int first = 1;              /* 1=first key:value pair; 0=subsequent pair */
@@ -91,7 +137,7 @@ static gosp_status_t send_post_data(request_rec *r, apr_socket_t *sock)
     return GOSP_STATUS_OK;    /* No POST data */
 
   /* Walk the array key:value entry by key:value entry. */
-  SEND_STRING("  \"PostData\": {");
+  APPEND_STRING("  \"PostData\": {");
   while (array && !apr_is_empty_array(array)) {
     apr_off_t blen;    /* Length of the brigade used for the value */
     apr_size_t slen;   /* Length of the value itself */
@@ -109,11 +155,11 @@ static gosp_status_t send_post_data(request_rec *r, apr_socket_t *sock)
     if (first)
       first = 0;
     else
-      SEND_STRING("\n,");
-    SEND_STRING("    \"%s\": \"%s\"",
-                escape_for_json(r, pair->name), escape_for_json(r, value));
+      APPEND_STRING("\n,");
+    append_json_member(buf, "    ", pair->name, strlen(pair->name),
+                       value, slen, "");
   }
-  SEND_STRING("\n  },\n");
+  APPEND_STRING("\n  },\n");
   return GOSP_STATUS_OK;
 }
 
@@ -121,125 +167,99 @@ static gosp_status_t send_post_data(request_rec *r, apr_socket_t *sock)
 typedef struct {
   request_rec *request;   /* Current request */
   int first;              /* 1=first item in table; 0=subsequent item */
-  apr_socket_t *socket;   /* Gosp socket to send strings to */
+  gosp_buffer_t *buffer;  /* Buffer to append strings to */
 } table_item_data_t;
 
-/* Send a {key, value} pair with JSON encoding into a socket. */
-static int send_table_item(void *rec, const char *key, const char *value)
+/* Encode a {key, value} pair with JSON encoding into a buffer. */
+static int encode_table_item(void *rec, const char *key, const char *value)
 {
-  const char *str;            /* String to send */
-  apr_size_t exp_len;         /* Number of bytes we had expected to send */
-  apr_size_t len;             /* Number of bytes sent */
-  apr_status_t status;        /* Status of an APR call */
-
   /* Extract a few fields from our data structure. */
   table_item_data_t *data = (table_item_data_t *)rec;
-  request_rec *r = data->request;
-  apr_socket_t *sock = data->socket;
+  gosp_buffer_t *buf = data->buffer;
 
-  /* Send the key and value as JSON code. */
+  /* Append the key and value as JSON code. */
   if (data->first)
     data->first = 0;
-  else {
-    len = 2;
-    status = apr_socket_send(sock, ",\n", &len);
-    if (status != APR_SUCCESS || len != 2)
-      REPORT_REQUEST_ERROR(0, APLOG_ERR, status,
-                           "Failed to send 2 bytes to the Gosp server");
-  }
-  str = apr_psprintf(r->pool, "      \"%s\": \"%s\"",
-                     escape_for_json(r, key), escape_for_json(r, value));
-  len = exp_len = (apr_size_t) strlen(str);
-  status = apr_socket_send(sock, str, &len);
-  if (status != APR_SUCCESS || len != exp_len)
-    REPORT_REQUEST_ERROR(0, APLOG_ERR, status,
-                         "Failed to send %ld bytes to the Gosp server", exp_len);
+  else
+    buffer_append(buf, ",\n", 2);
+  if (value == NULL)
+    value = "";
+  append_json_member(buf, "      ", key, strlen(key), value, strlen(value), "");
   return 1;
 }
 
-/* Send an entire table into a socket as JSON-encoded {key, value} pairs. */
-static int send_table(request_rec *r, apr_socket_t *sock,
-                      const char *field_name, apr_table_t *table)
+/* Encode an entire table into a buffer as JSON-encoded {key, value} pairs. */
+static void encode_table(request_rec *r, gosp_buffer_t *buf,
+                         const char *field_name, apr_table_t *table)
 {
   table_item_data_t item_data;  /* Data to pass to each table item */
-  apr_status_t status;          /* Status of an APR call */
 
   /* Initialize the table walk. */
   item_data.request = r;
-  item_data.socket = sock;
+  item_data.buffer = buf;
   item_data.first = 1;
 
-  /* Walk the table, sending each {key, value} pair in turn. */
-  SEND_STRING("    \"%s\": {", field_name);
-  if (apr_table_do(send_table_item, (void *) &item_data, table, NULL) == FALSE)
-    return GOSP_STATUS_FAIL;
-  SEND_STRING("\n    },\n");
-  return GOSP_STATUS_OK;
+  /* Walk the table, appending each {key, value} pair in turn. */
+  APPEND_STRING("    \"%s\": {", field_name);
+  (void) apr_table_do(encode_table_item, (void *) &item_data, table, NULL);
+  APPEND_STRING("\n    },\n");
 }
 
-/* Parse the GET arguments into a table.  Return NULL on failure. */
-static apr_table_t *parse_get_args(request_rec *r)
+/* Split the GET arguments into {key, value} pairs and encode them into a
+ * buffer as a JSON object.  Keys and values are escaped directly from the
+ * query string, with no intermediate copies.  If a key appears more than once,
+ * the Gosp server keeps the last value. */
+static void encode_get_args(request_rec *r, gosp_buffer_t *buf)
 {
-  apr_table_t *tbl;   /* Table of {key, value} mappings */
-  char *query;        /* GET query */
-  char *kvstr;        /* A single "key=value" string */
-  char *amplast;      /* apr_strtok() state associated with kvstr */
-  char *key;          /* A single key */
-  char *value;        /* A single value */
-  char *eqlast;       /* apr_strtok() state associated with key */
-
-  /* Prepare our input string and output table. */
-  query = apr_pstrdup(r->pool, r->args);
-  tbl = apr_table_make(r->pool, 10);  /* 10 is arbitrary. */
-
-  /* Parse the query arguments. */
-  if (r->args == NULL)
-    return tbl;
-  while (1) {
-    /* Split the query into zero or more "&"-separated strings. */
-    kvstr = apr_strtok(query, "&", &amplast);
-    if (kvstr == NULL)
-      break;
-    query = NULL;
-
-    /* Parse the query as "key=value".  Either key or value or both can be
-     * empty. */
-    if (kvstr[0] == '=') {
-      /* Weird case, but we ought to check for it. */
-      key = "";
-      value = apr_strtok(kvstr, "=", &eqlast);
-    }
-    else {
-      key = apr_strtok(kvstr, "=", &eqlast);
-      if (key == NULL)
+  const char *kv;     /* Start of a single "key=value" string */
+  const char *amp;    /* End of the "key=value" string */
+  const char *eq;     /* Position of the "=" within the "key=value" string */
+  const char *end;    /* End of the entire query */
+  int first = 1;      /* 1=first key:value pair; 0=subsequent pair */
+
+  APPEND_STRING("    \"GetData\": {");
+  if (r->args != NULL) {
+    end = r->args + strlen(r->args);
+    for (kv = r->args; kv < end; kv = amp + 1) {
+      /* Split the query into zero or more "&"-separated strings. */
+      amp = memchr(kv, '&', (size_t) (end - kv));
+      if (amp == NULL)
+        amp = end;
+      if (amp == kv)
         continue;
-      value = eqlast;
-    }
-    if (value == NULL)
-      value = "";
 
-    /* Store the {key, value} pair in the table. */
-    apr_table_set(tbl, key, value);
+      /* Parse the string as "key=value".  Either key or value or both can be
+       * empty. */
+      eq = memchr(kv, '=', (size_t) (amp - kv));
+      if (first)
+        first = 0;
+      else
+        buffer_append(buf, ",\n", 2);
+      if (eq == NULL)
+        append_json_member(buf, "      ", kv, (apr_size_t) (amp - kv), "", 0, "");
+      else
+        append_json_member(buf, "      ", kv, (apr_size_t) (eq - kv),
+                           eq + 1, (apr_size_t) (amp - eq - 1), "");
+    }
   }
-  return tbl;
+  APPEND_STRING("\n    },\n");
 }
 
-/* Send HTTP connection information to a socket.  The connection information
- * must be kept up-to-date with the GospRequest struct in boilerplate.go. */
-gosp_status_t send_request(request_rec *r, apr_socket_t *sock)
+/* Encode HTTP connection information into a buffer.  The connection
+ * information must be kept up-to-date with the GospRequest struct in
+ * boilerplate.go. */
+static gosp_status_t encode_request(request_rec *r, gosp_buffer_t *buf)
 {
-  apr_status_t status;          /* Status of an APR call */
   const char *rhost;            /* Name of remote host */
   const char *lhost;            /* Name of local host as used in the request */
   int port;                     /* Port number to which the request was issued */
   const char *url;              /* Complete URL requested */
-  apr_table_t *get_data;        /* Parsed GET query */
+  gosp_context_config_t *cconfig;   /* Context configuration */
 
   /* Prepare some data we'll need below. */
   rhost = ap_get_remote_host(r->connection, r->per_dir_config, REMOTE_NAME, NULL);
   lhost = ap_get_server_name_for_url(r);
   port = ap_get_server_port(r);
-  get_data = parse_get_args(r);
 
   /* For the Gosp page's convenience, combine the various URL components into a
    * complete URL. */
@@ -250,36 +270,111 @@ gosp_status_t send_request(request_rec *r, apr_socket_t *sock)
   if (r->args != NULL && r->args[0] != '\0')
     url = apr_psprintf(r->pool, "%s?%s", url, r->args);
 
-  /* Send the request as JSON-encoded data. */
-  SEND_STRING("{\n");
-  SEND_STRING("  \"UserData\": {\n");
-  SEND_STRING("    \"Scheme\": \"%s\",\n", escape_for_json(r, ap_http_scheme(r)));
-  SEND_STRING("    \"LocalHostname\": \"%s\",\n", escape_for_json(r, lhost));
-  SEND_STRING("    \"Port\": %d,\n", port);
-  SEND_STRING("    \"Uri\": \"%s\",\n", escape_for_json(r, r->uri));
-  SEND_STRING("    \"PathInfo\": \"%s\",\n", escape_for_json(r, r->path_info));
-  SEND_STRING("    \"QueryArgs\": \"%s\",\n", escape_for_json(r, r->args));
-  SEND_STRING("    \"Url\": \"%s\",\n", escape_for_json(r, url));
-  SEND_STRING("    \"Method\": \"%s\",\n", escape_for_json(r, r->method));
-  SEND_STRING("    \"RequestLine\": \"%s\",\n", escape_for_json(r, r->the_request));
-  SEND_STRING("    \"RequestTime\": %" PRId64 ",\n", r->request_time*1000);
-  SEND_STRING("    \"RemoteHostname\": \"%s\",\n", escape_for_json(r, rhost));
-  SEND_STRING("    \"RemoteIp\": \"%s\",\n", escape_for_json(r, r->useragent_ip));
-  SEND_STRING("    \"Filename\": \"%s\",\n", escape_for_json(r, r->filename));
-  if (send_post_data(r, sock) != GOSP_STATUS_OK)
-    return GOSP_STATUS_FAIL;
-  if (send_table(r, sock, "GetData", get_data) != GOSP_STATUS_OK)
-    return GOSP_STATUS_FAIL;
-  if (send_table(r, sock, "HeaderData", r->headers_in) != GOSP_STATUS_OK)
+  /* Encode the request as JSON data. */
+  APPEND_STRING("{\n");
+  APPEND_STRING("  \"UserData\": {\n");
+  append_user_data(buf, "Scheme", ap_http_scheme(r), ",\n");
+  append_user_data(buf, "LocalHostname", lhost, ",\n");
+  APPEND_STRING("    \"Port\": %d,\n", port);
+  append_user_data(buf, "Uri", r->uri, ",\n");
+  append_user_data(buf, "PathInfo", r->path_info, ",\n");
+  append_user_data(buf, "QueryArgs", r->args, ",\n");
+  append_user_data(buf, "Url", url, ",\n");
+  append_user_data(buf, "Method", r->method, ",\n");
+  append_user_data(buf, "RequestLine", r->the_request, ",\n");
+  APPEND_STRING("    \"RequestTime\": %" PRId64 ",\n", r->request_time*1000);
+  append_user_data(buf, "RemoteHostname", rhost, ",\n");
+  append_user_data(buf, "RemoteIp", r->useragent_ip, ",\n");
+  append_user_data(buf, "Filename", r->filename, ",\n");
+  if (encode_post_data(r, buf) != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
-  if (send_table(r, sock, "Environment", r->subprocess_env) != GOSP_STATUS_OK)
-    return GOSP_STATUS_FAIL;
-  SEND_STRING("    \"AdminEmail\": \"%s\"\n", escape_for_json(r, r->server->server_admin));
-  SEND_STRING("  }\n");
-  SEND_STRING("}\n");
+  encode_get_args(r, buf);
+  encode_table(r, buf, "HeaderData", r->headers_in);
+  encode_table(r, buf, "Environment", r->subprocess_env);
+  append_user_data(buf, "AdminEmail", r->server->server_admin, "\n");
+  APPEND_STRING("  }");
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  if (cconfig->body_fd_threshold != NULL)
+    APPEND_STRING(",\n  \"BodyFDThreshold\": %" APR_INT64_T_FMT,
+                  apr_atoi64(cconfig->body_fd_threshold));
+  if (timing_wanted(r))
+    APPEND_STRING(",\n  \"WantTiming\": true");
+  if (cconfig->compress == 1)
+    APPEND_STRING(",\n  \"Compress\": true");
+  APPEND_STRING("\n}\n");
+  return GOSP_STATUS_OK;
+}
+
+/* Append an encoded page request to the request-capture file if the request
+ * is sampled.  Requests are written with a single system call to an
+ * append-only file so concurrent Apache processes don't interleave them. */
+void capture_request(request_rec *r, const gosp_buffer_t *buf)
+{
+  static apr_uint32_t num_seen = 0;   /* Number of requests considered for capture */
+  gosp_server_config_t *sconfig;      /* Server configuration */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  if (sconfig->capture_file == NULL)
+    return;
+  if (apr_atomic_inc32(&num_seen) % sconfig->capture_every != 0)
+    return;
+  (void) apr_file_write_full(sconfig->capture_file, buf->data, buf->len, NULL);
+}
+
+/* Send the contents of a buffer to a socket, typically with a single system
+ * call. */
+static gosp_status_t send_buffer(request_rec *r, apr_socket_t *sock, const gosp_buffer_t *buf)
+{
+  apr_size_t sent;              /* Number of bytes sent so far */
+  apr_status_t status;          /* Status of an APR call */
+
+  for (sent = 0; sent < buf->len; ) {
+    apr_size_t len = buf->len - sent;   /* Number of bytes to send/just sent */
+
+    status = apr_socket_send(sock, buf->data + sent, &len);
+    if (status != APR_SUCCESS)
+      REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                           "Failed to send %lu bytes to the Gosp server",
+                           (unsigned long)(buf->len - sent));
+    sent += len;
+  }
   return GOSP_STATUS_OK;
 }
 
+/* Encode HTTP connection information into a buffer and capture it if it's
+ * sampled.  The buffer is cached in the request's pool, so a request that is
+ * retried after a Gosp server is rebuilt or relaunched reuses it instead of
+ * re-reading an already consumed POST body and capturing the request twice.
+ * Return NULL on error. */
+static gosp_buffer_t *encode_page_request(request_rec *r)
+{
+  static const char *key = "gosp_encoded_request";   /* Pool key for the cached buffer */
+  void *cached;                 /* Previously encoded request, if any */
+  gosp_buffer_t *buf;           /* Encoded request */
+
+  if (apr_pool_userdata_get(&cached, key, r->pool) == APR_SUCCESS && cached != NULL)
+    return (gosp_buffer_t *) cached;
+  buf = buffer_create(r->pool, REQUEST_BUFFER_SIZE);
+  if (encode_request(r, buf) != GOSP_STATUS_OK)
+    return NULL;
+  capture_request(r, buf);
+  (void) apr_pool_userdata_setn(buf, key, NULL, r->pool);
+  return buf;
+}
+
+/* Send HTTP connection information to a socket.  To minimize the number of
+ * system calls, the entire request is encoded into a single buffer before
+ * being sent. */
+gosp_status_t send_request(request_rec *r, apr_socket_t *sock)
+{
+  gosp_buffer_t *buf;           /* Encoded request */
+
+  buf = encode_page_request(r);
+  if (buf == NULL)
+    return GOSP_STATUS_FAIL;
+  return send_buffer(r, sock, buf);
+}
+
 /* See if a Gosp server is still alive by asking it for its process ID.  Return
  * GOSP_STATUS_OK if it's alive, GOSP_STATUS_FAIL if it's not or if we can't
  * tell. */
@@ -306,7 +401,7 @@ gosp_status_t server_is_responsive(request_rec *r, const char *sock_name)
   SEND_STRING("}\n");
 
   /* Receive a process ID in response. */
-  gstatus = receive_response(r, sock, &response, &resp_len);
+  gstatus = receive_response(r, sock, &response, &resp_len, NULL);
   if (gstatus != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
   if (strncmp(response, "gosp-pid ", 9) != 0)
@@ -314,6 +409,7 @@ gosp_status_t server_is_responsive(request_rec *r, const char *sock_name)
   pid = atoi(response + 9);
   if (pid <= 0)
     return GOSP_STATUS_FAIL;
+  scoreboard_note_server(r, pid);
   return GOSP_STATUS_OK;
 }
 
@@ -342,7 +438,7 @@ gosp_status_t send_termination_request(request_rec *r, const char *sock_name)
   SEND_STRING("}\n");
 
   /* Receive a process ID in response. */
-  gstatus = receive_response(r, sock, &response, &resp_len);
+  gstatus = receive_response(r, sock, &response, &resp_len, NULL);
   if (gstatus != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
   if (strncmp(response, "gosp-pid ", 9) != 0)
@@ -373,6 +469,190 @@ gosp_status_t send_termination_request(request_rec *r, const char *sock_name)
   return GOSP_STATUS_OK;
 }
 
+/* Append a NULL-terminated list of strings to a buffer as a JSON list. */
+static void append_json_string_list(gosp_buffer_t *buf, const char *const *list)
+{
+  const char *const *str;     /* Pointer into list */
+
+  buffer_append(buf, "[", 1);
+  for (str = list; *str != NULL; str++) {
+    if (str != list)
+      buffer_append(buf, ", ", 2);
+    buffer_append(buf, "\"", 1);
+    buffer_append_json(buf, *str, strlen(*str));
+    buffer_append(buf, "\"", 1);
+  }
+  buffer_append(buf, "]", 1);
+}
+
+/* Ask a zygote to launch a Gosp server with the given NULL-terminated list
+ * of command-line arguments, excluding the program name.  Return
+ * GOSP_STATUS_NEED_ACTION if the zygote is not running or not responding,
+ * GOSP_STATUS_FAIL if it failed to launch the Gosp server, and GOSP_STATUS_OK
+ * if the Gosp server is now listening for requests. */
+gosp_status_t send_spawn_request(request_rec *r, const char *zygote_name, const char *const *args)
+{
+  char *response;             /* Response string */
+  size_t resp_len;            /* Length of response string */
+  gosp_buffer_t *buf;         /* Encoded request */
+  apr_socket_t *sock;         /* Socket with which to communicate with the zygote */
+  gosp_status_t gstatus;      /* Status of an internal Gosp call */
+
+  /* Connect to the zygote. */
+  ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, r,
+               "Asking the zygote listening on socket %s to launch a Gosp server",
+               zygote_name);
+  gstatus = connect_socket(r, zygote_name, &sock);
+  if (gstatus != GOSP_STATUS_OK)
+    return GOSP_STATUS_NEED_ACTION;
+
+  /* Send the command line as a JSON list of strings. */
+  buf = buffer_create(r->pool, 1024);
+  APPEND_STRING("{\"Spawn\": ");
+  append_json_string_list(buf, args);
+  APPEND_STRING("}\n");
+  if (send_buffer(r, sock, buf) != GOSP_STATUS_OK)
+    return GOSP_STATUS_NEED_ACTION;
+
+  /* Receive either a process ID or an error message in response. */
+  gstatus = receive_response(r, sock, &response, &resp_len, NULL);
+  (void) apr_socket_close(sock);
+  if (gstatus != GOSP_STATUS_OK)
+    return GOSP_STATUS_NEED_ACTION;
+  if (resp_len > 0 && response[resp_len - 1] == '\n')
+    response[resp_len - 1] = '\0';
+  if (strncmp(response, "gosp-pid ", 9) == 0 && atoi(response + 9) > 0)
+    return GOSP_STATUS_OK;
+  if (strncmp(response, "gosp-error ", 11) == 0)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                         "%s", response + 11);
+  REPORT_REQUEST_ERROR(GOSP_STATUS_NEED_ACTION, APLOG_ERR, APR_SUCCESS,
+                       "Received unexpected response \"%s\" from the zygote listening on socket %s",
+                       response, zygote_name);
+}
+
+/* Connect to the zygote listening on a given socket and, if message is
+ * non-NULL, send it the message and wait for it to close the connection.
+ * Unlike the other functions in this file, notify_zygote() needs no request
+ * and so can be used during server startup and shutdown.  Return
+ * GOSP_STATUS_NEED_ACTION if the zygote is not running. */
+gosp_status_t notify_zygote(server_rec *s, apr_pool_t *pool, const char *zygote_name, const char *message)
+{
+  apr_sockaddr_t *sa;         /* Socket address corresponding to zygote_name */
+  apr_socket_t *sock;         /* Socket with which to communicate with the zygote */
+  char scratch[256];          /* Buffer for discarding the zygote's response */
+  apr_size_t len;             /* Number of bytes sent or received */
+  apr_status_t status;        /* Status of an APR call */
+
+  /* Connect to the zygote. */
+  status = apr_sockaddr_info_get(&sa, zygote_name, APR_UNIX, 0, 0, pool);
+  if (status != APR_SUCCESS)
+    REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                        "Failed to construct a Unix-domain socket address from %s", zygote_name);
+  status = apr_socket_create(&sock, APR_UNIX, SOCK_STREAM, APR_PROTO_TCP, pool);
+  if (status != APR_SUCCESS)
+    REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                        "Failed to create socket %s", zygote_name);
+  status = apr_socket_connect(sock, sa);
+  if (status != APR_SUCCESS) {
+    (void) apr_socket_close(sock);
+    return GOSP_STATUS_NEED_ACTION;
+  }
+  if (message == NULL) {
+    (void) apr_socket_close(sock);
+    return GOSP_STATUS_OK;
+  }
+
+  /* Send the message and read until the zygote closes the connection.  Give
+   * up if the zygote takes an unreasonably long time. */
+  (void) apr_socket_timeout_set(sock, 30*GOSP_SECONDS);
+  len = strlen(message);
+  status = apr_socket_send(sock, message, &len);
+  if (status != APR_SUCCESS) {
+    (void) apr_socket_close(sock);
+    REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                        "Failed to send a message to socket %s", zygote_name);
+  }
+  do {
+    len = sizeof(scratch);
+    status = apr_socket_recv(sock, scratch, &len);
+  }
+  while (status == APR_SUCCESS);
+  (void) apr_socket_close(sock);
+  return GOSP_STATUS_OK;
+}
+
+/* Ask the build server listening on a given socket to run gosp2go with a
+ * given NULL-terminated list of arguments, excluding the program name, and a
+ * NULL-terminated list of additional environment variables.  On success,
+ * return the connected socket, from which the caller should read the result
+ * with receive_build_response().  Return GOSP_STATUS_NEED_ACTION if the build
+ * server couldn't be reached. */
+gosp_status_t send_build_request(request_rec *r, const char *builder_name,
+                                 const char *const *args, const char *const *env,
+                                 apr_socket_t **sock)
+{
+  gosp_buffer_t *buf;         /* Encoded request */
+
+  /* Connect to the build server. */
+  ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, r,
+               "Asking the build server listening on socket %s to compile %s",
+               builder_name, r->filename);
+  if (connect_socket(r, builder_name, sock) != GOSP_STATUS_OK)
+    return GOSP_STATUS_NEED_ACTION;
+
+  /* Send the arguments and environment as JSON lists of strings. */
+  buf = buffer_create(r->pool, 1024);
+  APPEND_STRING("{\"Args\": ");
+  append_json_string_list(buf, args);
+  APPEND_STRING(", \"Env\": ");
+  append_json_string_list(buf, env);
+  APPEND_STRING("}\n");
+  if (send_buffer(r, *sock, buf) != GOSP_STATUS_OK) {
+    (void) apr_socket_close(*sock);
+    return GOSP_STATUS_NEED_ACTION;
+  }
+  return GOSP_STATUS_OK;
+}
+
+/* Wait for a build server to finish the build requested by
+ * send_build_request() and close the socket.  Log the compiler's output and
+ * return GOSP_STATUS_OK if the build succeeded or GOSP_STATUS_FAIL if not. */
+gosp_status_t receive_build_response(request_rec *r, apr_socket_t *sock)
+{
+  char *response;             /* Response string */
+  size_t resp_len;            /* Length of response string */
+  char *last;                 /* Final line of the response */
+  gosp_status_t gstatus;      /* Status of an internal Gosp call */
+
+  /* Read the entire response. */
+  gstatus = receive_response(r, sock, &response, &resp_len, NULL);
+  (void) apr_socket_close(sock);
+  if (gstatus != GOSP_STATUS_OK)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                         "Failed to receive a response from the build server");
+
+  /* Split the response into the compiler's output and a final status
+   * line. */
+  while (resp_len > 0 && response[resp_len - 1] == '\n')
+    response[--resp_len] = '\0';
+  last = strrchr(response, '\n');
+  if (last == NULL)
+    last = response;
+  else
+    *last++ = '\0';
+  if (last != response)
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
+                  "%s", response);
+  if (strcmp(last, "gosp-ok") == 0)
+    return GOSP_STATUS_OK;
+  if (strncmp(last, "gosp-error ", 11) == 0)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                         "%s", last + 11);
+  REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                       "Received unexpected response \"%s\" from the build server", last);
+}
+
 /* Parse and process an HTTP header field assignment. */
 static gosp_status_t process_field_assignment(request_rec *r, char *line)
 {
@@ -408,89 +688,422 @@ static gosp_status_t process_field_assignment(request_rec *r, char *line)
   return GOSP_STATUS_OK;
 }
 
-/* Split a response string into metadata and data.  Process the metadata.
- * Output the data.  Return GOSP_STATUS_OK if this procedure succeeded (even if
- * it corresponds to a Gosp-server error condition) or GOSP_STATUS_FAIL if
- * not. */
-static gosp_status_t process_response(request_rec *r, char *response, size_t resp_len)
+/* Send the contents of a file to the client as a file bucket, which lets the
+ * core output filter use sendfile() when possible. */
+static gosp_status_t send_file_bucket(request_rec *r, apr_file_t *file, apr_off_t len)
 {
-  char *last;      /* Internal apr_strtok() state */
-  char *line;      /* One line of metadata */
-  int n_to_write;  /* Number of bytes of data we expect to write */
-  int nwritten;    /* Number of bytes of data actuall written */
+  apr_bucket_brigade *bb;     /* Brigade to pass down the filter chain */
+  apr_status_t status;        /* Status of an APR call */
 
-  /* Process each line of metadata until we see "end-header". */
-  for (line = apr_strtok(response, "\n", &last);
-       line != NULL;
-       line = apr_strtok(NULL, "\n", &last)) {
-    /* End of metadata: exit loop. */
-    if (strcmp(line, "end-header") == 0)
-      break;
+  ap_set_content_length(r, len);
+  bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+  apr_brigade_insert_file(bb, file, 0, len, r->pool);
+  APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+  status = ap_pass_brigade(r->output_filters, bb);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to send %" APR_OFF_T_FMT " bytes of page data", len);
+  return GOSP_STATUS_OK;
+}
 
-    /* HTTP status: set in the request_rec. */
-    if (strncmp(line, "http-status ", 12) == 0) {
-      r->status = atoi(line + 12);
-      if (r->status < 100)
-        return GOSP_STATUS_FAIL;
-      continue;
-    }
+/* Open a file from the local filesystem for sending to the client and acquire
+ * its metadata.  Return GOSP_STATUS_OK on success and GOSP_STATUS_FAIL
+ * otherwise. */
+static gosp_status_t open_file_to_send(request_rec *r, const char *fname,
+                                       apr_file_t **file, apr_finfo_t *finfo)
+{
+  apr_status_t status;        /* Status of an APR call */
 
-    /* MIME type: set in the request_rec. */
-    if (strncmp(line, "mime-type ", 10) == 0) {
-      r->content_type = line + 10;
-      continue;
-    }
+  status = apr_file_open(file, fname,
+                         APR_FOPEN_READ|APR_FOPEN_BINARY|APR_FOPEN_SENDFILE_ENABLED,
+                         APR_FPROT_OS_DEFAULT, r->pool);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to open %s", fname);
+  status = apr_file_info_get(finfo, APR_FINFO_NORM, *file);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to query %s", fname);
+  return GOSP_STATUS_OK;
+}
 
-    /* Header field: set in the request_rec. */
-    if (strncmp(line, "header-field ", 13) == 0) {
-      if (process_field_assignment(r, line) != GOSP_STATUS_OK)
-        return GOSP_STATUS_FAIL;
-      continue;
+/* Send a file from the local filesystem to the client, honoring conditional
+ * requests.  (Range requests are handled by Apache's byterange filter.)
+ * Return GOSP_STATUS_OK if the file was sent or the client's copy is current
+ * and GOSP_STATUS_FAIL otherwise. */
+gosp_status_t send_static_file(request_rec *r, const char *fname)
+{
+  apr_file_t *file;           /* File to send */
+  apr_finfo_t finfo;          /* File information for fname */
+  int cond;                   /* Result of evaluating conditional-request headers */
+
+  /* Open the file and acquire its metadata. */
+  if (open_file_to_send(r, fname, &file, &finfo) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+
+  /* Set the validators then see if the client already has the file. */
+  r->finfo = finfo;
+  ap_update_mtime(r, finfo.mtime);
+  ap_set_last_modified(r);
+  ap_set_etag(r);
+  cond = ap_meets_conditions(r);
+  if (cond != OK) {
+    r->status = cond;
+    return GOSP_STATUS_OK;
+  }
+
+  /* Send the file itself. */
+  return send_file_bucket(r, file, finfo.size);
+}
+
+/* Parse and validate a request from the Gosp server to send a file in place
+ * of the page data.  Return the file's name or NULL on error.  Also return
+ * the MIME type Apache associates with the file. */
+static const char *process_send_file(request_rec *r, const char *line, const char **file_type)
+{
+  const char *fname;          /* File to send */
+  char *page_dir;             /* Directory containing the Gosp page */
+  request_rec *rr;            /* Subrequest used to determine the file's MIME type */
+
+  /* As a sanity check, ensure the file lies within or below the page's
+   * directory.  The Gosp server should already have checked this. */
+  fname = line + 10;
+  page_dir = dirname(apr_pstrdup(r->pool, r->filename));
+  if (lies_in_or_below(r, fname, page_dir) != 1)
+    REPORT_REQUEST_ERROR(NULL, APLOG_ERR, APR_SUCCESS,
+                         "Refusing to send %s, which does not lie within %s",
+                         fname, page_dir);
+
+  /* Let Apache determine the file's MIME type in case the page doesn't
+   * specify one. */
+  rr = ap_sub_req_lookup_file(fname, r, NULL);
+  *file_type = rr->content_type == NULL ? NULL : apr_pstrdup(r->pool, rr->content_type);
+  ap_destroy_sub_req(rr);
+  return fname;
+}
+
+/* Relay a list of Link header values from the Gosp server to the client as
+ * a 103 (Early Hints) interim response so the client can begin fetching
+ * subresources while the page is still being generated. */
+static void send_early_hints(request_rec *r, const char *links)
+{
+  apr_table_t *headers_out;   /* Headers of the final response */
+  int status;                 /* Status of the final response */
+  const char *status_line;    /* Status line of the final response */
+
+  /* ap_send_interim_response() sends and then clears r->headers_out, so
+   * temporarily substitute a table containing only the hints. */
+  headers_out = r->headers_out;
+  status = r->status;
+  status_line = r->status_line;
+  r->headers_out = apr_table_make(r->pool, 1);
+  apr_table_setn(r->headers_out, "Link", links);
+  r->status = GOSP_EARLY_HINTS;
+  r->status_line = "103 Early Hints";
+  ap_send_interim_response(r, 1);
+  r->headers_out = headers_out;
+  r->status = status;
+  r->status_line = status_line;
+}
+
+/* Process a single line of metadata from the Gosp server. */
+static gosp_status_t process_metadata_line(request_rec *r, char *line, response_state_t *state)
+{
+  /* HTTP status: set in the request_rec unless it's too late to change. */
+  if (strncmp(line, "http-status ", 12) == 0) {
+    if (state->headers_sent) {
+      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, APR_SUCCESS, r,
+                    "Ignoring HTTP status %s, which arrived after the headers were sent",
+                    line + 12);
+      return GOSP_STATUS_OK;
     }
+    r->status = atoi(line + 12);
+    if (r->status < 100)
+      return GOSP_STATUS_FAIL;
+    return GOSP_STATUS_OK;
+  }
 
-    /* Error message: output it. */
-    if (strncmp(line, "error-message ", 14) == 0) {
-      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
-                    "%s", line + 14);
-      continue;
+  /* MIME type: set in the request_rec unless it's too late to change. */
+  if (strncmp(line, "mime-type ", 10) == 0) {
+    if (state->headers_sent) {
+      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, APR_SUCCESS, r,
+                    "Ignoring MIME type %s, which arrived after the headers were sent",
+                    line + 10);
+      return GOSP_STATUS_OK;
     }
+    r->content_type = line + 10;
+    state->mime_type_set = 1;
+    return GOSP_STATUS_OK;
+  }
 
-    /* Debug message: output it. */
-    if (strncmp(line, "debug-message ", 14) == 0) {
-      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, APR_SUCCESS, r,
-                    "%s", line + 14);
-      continue;
+  /* Header field: set in the request_rec. */
+  if (strncmp(line, "header-field ", 13) == 0)
+    return process_field_assignment(r, line);
+
+  /* Error message: output it. */
+  if (strncmp(line, "error-message ", 14) == 0) {
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
+                  "%s", line + 14);
+    return GOSP_STATUS_OK;
+  }
+
+  /* Debug message: output it. */
+  if (strncmp(line, "debug-message ", 14) == 0) {
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, APR_SUCCESS, r,
+                  "%s", line + 14);
+    return GOSP_STATUS_OK;
+  }
+
+  /* Body passed as a file descriptor: note its length.  The descriptor
+   * itself follows the metadata. */
+  if (strncmp(line, "body-fd ", 8) == 0) {
+    state->body_fd_len = (apr_off_t) apr_atoi64(line + 8);
+    if (state->body_fd_len < 0)
+      REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                           "Failed to parse \"%s\"", line);
+    return GOSP_STATUS_OK;
+  }
+
+  /* File to send in place of the page data: validate it. */
+  if (strncmp(line, "send-file ", 10) == 0) {
+    state->send_file = process_send_file(r, line, &state->file_type);
+    if (state->send_file == NULL)
+      return GOSP_STATUS_FAIL;
+    return GOSP_STATUS_OK;
+  }
+
+  /* Timing information: record it. */
+  if (strncmp(line, "server-timing ", 14) == 0) {
+    timing_note_server(r, line + 14);
+    return GOSP_STATUS_OK;
+  }
+
+  /* Early hints: relay them immediately unless the final response has
+   * already begun. */
+  if (strncmp(line, "early-hints ", 12) == 0) {
+    if (!state->headers_sent)
+      send_early_hints(r, line + 12);
+    return GOSP_STATUS_OK;
+  }
+
+  /* Request to commit the headers: send them to the client now, before the
+   * page data are available. */
+  if (strcmp(line, "flush-headers") == 0) {
+    if (!state->headers_sent && r->status == HTTP_OK) {
+      timing_set_header(r);
+      ap_rflush(r);
+      state->headers_sent = 1;
     }
+    return GOSP_STATUS_OK;
+  }
 
-    /* Heartbeat: ignore. */
-    if (strcmp(line, "keep-alive") == 0)
-      continue;
+  /* Heartbeat: ignore. */
+  if (strcmp(line, "keep-alive") == 0)
+    return GOSP_STATUS_OK;
 
-    /* Anything else: throw an error. */
-    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
-                         "Received unexpected metadata command \"%s\"", line);
+  /* Anything else: throw an error. */
+  REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                       "Received unexpected metadata command \"%s\"", line);
+}
+
+/* Process each complete line of metadata received so far that hasn't already
+ * been processed, stopping at "end-header".  This lets metadata such as
+ * early hints take effect while the Gosp server is still generating the
+ * page. */
+static gosp_status_t process_metadata(request_rec *r, const gosp_buffer_t *buf,
+                                      response_state_t *state)
+{
+  const char *begin;          /* Beginning of the current line */
+  const char *eol;            /* End of the current line */
+  char *line;                 /* Copy of the current line */
+
+  while (!state->header_done) {
+    begin = buf->data + state->processed;
+    eol = memchr(begin, '\n', buf->len - state->processed);
+    if (eol == NULL)
+      break;
+    line = apr_pstrmemdup(r->pool, begin, eol - begin);
+    state->processed += eol - begin + 1;
+    if (strcmp(line, "end-header") == 0)
+      state->header_done = 1;
+    else if (process_metadata_line(r, line, state) != GOSP_STATUS_OK)
+      return GOSP_STATUS_FAIL;
   }
+  return GOSP_STATUS_OK;
+}
+
+/* Prepare to process a response from the Gosp server. */
+static void init_response_state(response_state_t *state)
+{
+  memset(state, 0, sizeof(response_state_t));
+  state->body_fd_len = -1;
+}
+
+/* Finish processing a complete response from the Gosp server.  Process any
+ * remaining metadata, then output the data, either from the response itself
+ * or, if the Gosp server passed us a file descriptor, from body_file.  Return
+ * GOSP_STATUS_OK if this procedure succeeded (even if it corresponds to a
+ * Gosp-server error condition) or GOSP_STATUS_FAIL if not. */
+static gosp_status_t process_response(request_rec *r, const gosp_buffer_t *buf,
+                                      apr_file_t *body_file, response_state_t *state)
+{
+  int n_to_write;  /* Number of bytes of data we expect to write */
+  int nwritten;    /* Number of bytes of data actuall written */
+
+  /* Process whatever metadata we haven't already processed. */
+  if (process_metadata(r, buf, state) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
 
   /* Write the rest of the response as data. */
+  if (!state->headers_sent)
+    timing_set_header(r);
   if (r->status != HTTP_OK)
     return GOSP_STATUS_OK;
-  if (line == NULL)
+  if (!state->header_done)
     return GOSP_STATUS_OK;
-  n_to_write = (int)resp_len - (int)(last - response + 1) + 1;
-  nwritten = ap_rwrite(line + 11, n_to_write, r);
+  if (state->send_file != NULL) {
+    if (state->headers_sent) {
+      /* The response is already committed, so it's too late to set a MIME
+       * type or validators or to answer a conditional request. */
+      apr_file_t *file;       /* File to send */
+      apr_finfo_t finfo;      /* File information for the file to send */
+
+      if (open_file_to_send(r, state->send_file, &file, &finfo) != GOSP_STATUS_OK)
+        return GOSP_STATUS_FAIL;
+      return send_file_bucket(r, file, finfo.size);
+    }
+    if (!state->mime_type_set && state->file_type != NULL)
+      ap_set_content_type(r, state->file_type);
+    return send_static_file(r, state->send_file);
+  }
+  if (state->body_fd_len >= 0) {
+    if (body_file == NULL)
+      REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, APR_SUCCESS,
+                           "Failed to receive a file descriptor for the page body");
+    return send_file_bucket(r, body_file, state->body_fd_len);
+  }
+  n_to_write = (int)(buf->len - state->processed);
+  nwritten = ap_rwrite(buf->data + state->processed, n_to_write, r);
   if (nwritten != n_to_write)
     return GOSP_STATUS_FAIL;
   return GOSP_STATUS_OK;
 }
 
-/* Receive a response from the Gosp server and return it.  Return
+/* Close a file received from the Gosp server when its pool is cleaned up. */
+static apr_status_t close_body_file(void *data)
+{
+  return apr_file_close((apr_file_t *) data);
+}
+
+/* Read one chunk of data from a socket like apr_socket_recv() but
+ * additionally accept a file descriptor passed via SCM_RIGHTS.  If a
+ * descriptor arrives, wrap it in an apr_file_t and store it in *body_file. */
+static apr_status_t recv_with_fd(request_rec *r, apr_socket_t *sock, char *buf,
+                                 apr_size_t *len, apr_file_t **body_file)
+{
+  apr_os_sock_t fd;           /* Underlying socket descriptor */
+  struct msghdr msg;          /* Message to receive */
+  struct iovec iov;           /* Buffer for the message's ordinary data */
+  union {
+    struct cmsghdr align;     /* Force proper alignment */
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;                  /* Buffer for the message's ancillary data */
+  struct cmsghdr *cmsg;       /* One item of ancillary data */
+  ssize_t nread;              /* Number of bytes read */
+  apr_status_t status;        /* Status of an APR call */
+
+  /* Acquire the OS-level socket. */
+  status = apr_os_sock_get(&fd, sock);
+  if (status != APR_SUCCESS)
+    return status;
+
+  /* Read a message, waiting (subject to the socket's timeout) if none is
+   * available yet. */
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = *len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    nread = recvmsg(fd, &msg, RECV_FD_FLAGS);
+    if (nread >= 0)
+      break;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      *len = 0;
+      return APR_FROM_OS_ERROR(errno);
+    }
+    status = apr_socket_wait(sock, APR_WAIT_READ);
+    if (status != APR_SUCCESS) {
+      *len = 0;
+      return status;
+    }
+  }
+
+  /* Wrap any descriptor we received in an apr_file_t. */
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      apr_os_file_t body_fd;
+      memcpy(&body_fd, CMSG_DATA(cmsg), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+      (void) fcntl(body_fd, F_SETFD, FD_CLOEXEC);
+#endif
+      if (*body_file != NULL) {
+        close(body_fd);   /* We expect only one descriptor. */
+        continue;
+      }
+      status = apr_os_file_put(body_file, &body_fd,
+                               APR_FOPEN_READ|APR_FOPEN_SENDFILE_ENABLED, r->pool);
+      if (status != APR_SUCCESS) {
+        close(body_fd);
+        return status;
+      }
+      apr_pool_cleanup_register(r->pool, *body_file, close_body_file,
+                                apr_pool_cleanup_null);
+    }
+
+  /* Return the number of bytes read. */
+  *len = (apr_size_t) nread;
+  return nread == 0 ? APR_EOF : APR_SUCCESS;
+}
+
+/* Read one chunk of a response from the Gosp server into the free space at
+ * the end of a buffer, doubling the buffer's size as necessary.  If body_file
+ * is non-NULL, also accept a file descriptor containing the page data.
+ * Return the status of the read. */
+static apr_status_t receive_chunk(request_rec *r, apr_socket_t *sock, gosp_buffer_t *buf,
+                                  apr_file_t **body_file)
+{
+  apr_size_t len;             /* Number of bytes to read/just read */
+  apr_size_t prev_len;        /* Number of bytes in the buffer before the read */
+  apr_status_t status;        /* Status of an APR call */
+
+  prev_len = buf->len;
+  if (buf->cap - buf->len - 1 < RESPONSE_BUFFER_SIZE/2)
+    buffer_reserve(buf, buf->cap);
+  len = buf->cap - buf->len - 1;
+  if (body_file == NULL)
+    status = apr_socket_recv(sock, buf->data + buf->len, &len);
+  else
+    status = recv_with_fd(r, sock, buf->data + buf->len, &len, body_file);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  if (prev_len == 0 && buf->len > 0)
+    scoreboard_first_byte(r);
+  return status;
+}
+
+/* Receive a response from the Gosp server into a buffer.  If body_file is
+ * non-NULL, also accept a file descriptor containing the page data.  If state
+ * is non-NULL, process page metadata as it arrives.  Return
  * GOSP_STATUS_NEED_ACTION if the server timed out and ought to be killed and
  * relaunched. */
-gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **response, size_t *resp_len)
+static gosp_status_t receive_into_buffer(request_rec *r, apr_socket_t *sock, gosp_buffer_t *buf,
+                                         apr_file_t **body_file, response_state_t *state)
 {
-  char *chunk;                /* One chunk of data read from the socket */
-  const size_t chunk_size = 1000000;   /* Amount of data to read at once */
-  struct iovec iov[2];        /* Pairs of chunks to merge */
   apr_status_t status;        /* Status of an APR call */
 
   /* Prepare to read from the socket. */
@@ -498,17 +1111,12 @@ gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **respon
   if (status != APR_SUCCESS)
     REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
                          "Failed to set a socket timeout");
-  chunk = apr_palloc(r->pool, chunk_size);
-  iov[0].iov_base = "";
-  iov[0].iov_len = 0;
-  iov[1].iov_base = chunk;
+  if (body_file != NULL)
+    *body_file = NULL;
 
   /* Read until the socket is closed. */
   while (status != APR_EOF) {
-    apr_size_t len = chunk_size;  /* Number of bytes to read/just read */
-
-    /* Read one chunk of data. */
-    status = apr_socket_recv(sock, chunk, &len);
+    status = receive_chunk(r, sock, buf, body_file);
     switch (status) {
     case APR_EOF:
     case APR_SUCCESS:
@@ -526,19 +1134,424 @@ gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **respon
                            "Failed to receive data from the Gosp server");
       break;
     }
-
-    /* Append the new chunk onto the aggregate response. */
-    iov[1].iov_len = (size_t) len;
-    iov[0].iov_base = apr_pstrcatv(r->pool, iov, 2, &len);
-    iov[0].iov_len = (size_t) len;
+    if (state != NULL && process_metadata(r, buf, state) != GOSP_STATUS_OK)
+      return GOSP_STATUS_FAIL;
   }
+  return GOSP_STATUS_OK;
+}
+
+/* Receive a response from the Gosp server and return it.  If body_file is
+ * non-NULL, also accept a file descriptor containing the page data.  Return
+ * GOSP_STATUS_NEED_ACTION if the server timed out and ought to be killed and
+ * relaunched. */
+gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **response, size_t *resp_len,
+                               apr_file_t **body_file)
+{
+  gosp_buffer_t *buf;         /* Aggregate response */
+  gosp_status_t gstatus;      /* Status of an internal Gosp call */
+
+  /* Read until the socket is closed. */
+  buf = buffer_create(r->pool, RESPONSE_BUFFER_SIZE);
+  gstatus = receive_into_buffer(r, sock, buf, body_file, NULL);
+  if (gstatus != GOSP_STATUS_OK)
+    return gstatus;
 
   /* Return the string and its length. */
-  *response = iov[0].iov_base;
-  *resp_len = iov[0].iov_len;
+  *response = buf->data;
+  *resp_len = buf->len;
   return GOSP_STATUS_OK;
 }
 
+/* Return the name of the file backing the shared-memory ring of the Gosp
+ * server listening on a given socket. */
+const char *ring_file_name(apr_pool_t *pool, const char *sock_name)
+{
+  apr_size_t len = strlen(sock_name);   /* Length of the socket name without ".sock" */
+
+  if (len > 5 && strcmp(sock_name + len - 5, ".sock") == 0)
+    len -= 5;
+  return apr_pstrcat(pool, apr_pstrmemdup(pool, sock_name, len), ".ring", NULL);
+}
+
+#ifdef GOSP_SHM_RING
+
+/* Define the layout of the shared-memory ring through which a Gosp server
+ * launched with -ring accepts page requests.  This must be kept consistent
+ * with ring.go. */
+#define RING_MAGIC 0x52505347          /* "GSPR" in little-endian byte order */
+#define RING_VERSION 1                 /* Version of the ring layout */
+#define RING_HEADER_SIZE 64            /* Bytes reserved for the ring's header */
+#define RING_SLOT_HEADER_SIZE 64       /* Bytes reserved for each slot's header */
+
+/* Longest time to sleep before checking that the Gosp server is still alive */
+#define RING_CHECK_INTERVAL APR_USEC_PER_SEC
+
+/* Number of times to check for a response before sleeping, which lets small
+ * pages complete without a system call.  Spinning helps only when the Gosp
+ * server can run on another CPU at the same time. */
+#define RING_SPIN_LIMIT 2000
+
+/* Define the header at the start of a ring. */
+typedef struct {
+  apr_uint32_t magic;                    /* RING_MAGIC */
+  apr_uint32_t version;                  /* RING_VERSION */
+  apr_uint32_t num_slots;                /* Number of request slots */
+  apr_uint32_t slot_size;                /* Number of data bytes per slot */
+  apr_uint32_t server_pid;               /* Process ID of the Gosp server */
+  volatile apr_uint32_t doorbell;        /* Counter we increment after posting a request */
+  volatile apr_uint32_t server_waiting;  /* 1=the Gosp server is sleeping on the doorbell; 0=it isn't */
+  volatile apr_uint32_t next_slot;       /* Counter that spreads out slot allocations */
+} ring_header_t;
+
+/* Define the header at the start of each slot.  The slot's data follow at
+ * offset RING_SLOT_HEADER_SIZE. */
+typedef struct {
+  volatile apr_uint32_t state;           /* One of the ring_slot_state_t values */
+  volatile apr_uint32_t len;             /* Number of valid bytes in the slot's data */
+  volatile apr_uint32_t client_pid;      /* Process ID of the Apache process that claimed the slot */
+} ring_slot_t;
+
+/* Enumerate the states a slot can be in.  We claim a free slot, write a
+ * request, and mark it REQUEST.  The Gosp server marks it BUSY, writes the
+ * response one slot-full at a time, marking each CHUNK until we've consumed
+ * it, and marks the final piece DONE.  We then mark the slot FREE.  If we give
+ * up on a request, we mark the slot ABANDONED_REQUEST (not yet seen by the
+ * server) or ABANDONED (seen by the server), and the server frees it. */
+typedef enum {
+  RING_FREE,
+  RING_CLAIMED,
+  RING_REQUEST,
+  RING_BUSY,
+  RING_CHUNK,
+  RING_DONE,
+  RING_ABANDONED_REQUEST,
+  RING_ABANDONED
+} ring_slot_state_t;
+
+/* Define this process's mapping of a Gosp server's ring. */
+typedef struct {
+  apr_pool_t *pool;              /* Pool holding the mapping, which is unmapped when the pool is destroyed */
+  ring_header_t *header;         /* Start of the mapped ring */
+  apr_ino_t inode;               /* Inode of the file backing the ring */
+  apr_dev_t device;              /* Device containing the file backing the ring */
+  volatile apr_uint32_t refs;    /* Number of requests using the mapping, plus one while it's cached */
+} ring_map_t;
+
+static apr_pool_t *ring_pool = NULL;   /* Pool holding ring_maps */
+static apr_hash_t *ring_maps = NULL;   /* Map from a ring's filename to its ring_map_t */
+static int ring_spin_limit = 0;        /* Number of times to check for a response before sleeping */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *ring_mutex = NULL;  /* Lock protecting ring_maps */
+#endif
+
+/* Prepare a child process to exchange page requests with Gosp servers through
+ * shared-memory rings. */
+void ring_child_init(apr_pool_t *pool)
+{
+  if (apr_pool_create(&ring_pool, pool) != APR_SUCCESS)
+    return;
+#if APR_HAS_THREADS
+  if (apr_thread_mutex_create(&ring_mutex, APR_THREAD_MUTEX_DEFAULT, ring_pool) != APR_SUCCESS)
+    return;
+#endif
+  ring_maps = apr_hash_make(ring_pool);
+  if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+    ring_spin_limit = RING_SPIN_LIMIT;
+}
+
+/* Sleep until another process wakes addr, *addr no longer equals val, or the
+ * timeout expires. */
+static void futex_wait(volatile apr_uint32_t *addr, apr_uint32_t val, apr_interval_time_t timeout)
+{
+  struct timespec ts;            /* Timeout as a timespec */
+
+  ts.tv_sec = apr_time_sec(timeout);
+  ts.tv_nsec = apr_time_usec(timeout)*1000;
+  (void) syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+/* Wake one process sleeping on addr. */
+static void futex_wake(volatile apr_uint32_t *addr)
+{
+  (void) syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Return a given slot of a ring. */
+static ring_slot_t *ring_slot(const ring_header_t *header, apr_uint32_t i)
+{
+  return (ring_slot_t *) ((char *) header + RING_HEADER_SIZE
+                          + (apr_size_t) i*(RING_SLOT_HEADER_SIZE + header->slot_size));
+}
+
+/* Return a slot's data area. */
+#define RING_SLOT_DATA(SLOT) ((char *) (SLOT) + RING_SLOT_HEADER_SIZE)
+
+/* Map a Gosp server's ring into memory.  Return NULL if the ring can't be
+ * mapped or is malformed. */
+static ring_map_t *map_ring(request_rec *r, const char *ring_name, const apr_finfo_t *finfo)
+{
+  apr_pool_t *pool;              /* Pool holding the mapping */
+  apr_file_t *file;              /* File backing the ring */
+  apr_mmap_t *mm;                /* Mapping of the file */
+  ring_header_t *header;         /* Start of the mapped ring */
+  ring_map_t *map;               /* Mapping to return */
+  apr_status_t status;           /* Status of an APR call */
+
+  /* Map the file.  The pool is unrelated to the request's because the
+   * mapping outlives the request. */
+  status = apr_pool_create(&pool, NULL);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(NULL, APLOG_ERR, status, "Failed to create a pool");
+  status = apr_file_open(&file, ring_name, APR_FOPEN_READ|APR_FOPEN_WRITE, APR_OS_DEFAULT, pool);
+  if (status == APR_SUCCESS) {
+    status = apr_mmap_create(&mm, file, 0, (apr_size_t) finfo->size,
+                             APR_MMAP_READ|APR_MMAP_WRITE, pool);
+    (void) apr_file_close(file);
+  }
+  if (status != APR_SUCCESS) {
+    apr_pool_destroy(pool);
+    REPORT_REQUEST_ERROR(NULL, APLOG_WARNING, status,
+                         "Failed to map shared-memory ring %s", ring_name);
+  }
+
+  /* Ensure the ring is one we understand and lies entirely within the
+   * file. */
+  header = (ring_header_t *) mm->mm;
+  if ((apr_off_t) sizeof(ring_header_t) > finfo->size
+      || header->magic != RING_MAGIC || header->version != RING_VERSION
+      || header->num_slots == 0
+      || RING_HEADER_SIZE + (apr_off_t) header->num_slots*(RING_SLOT_HEADER_SIZE + (apr_off_t) header->slot_size) > finfo->size) {
+    apr_pool_destroy(pool);
+    REPORT_REQUEST_ERROR(NULL, APLOG_WARNING, APR_SUCCESS,
+                         "Ignoring malformed shared-memory ring %s", ring_name);
+  }
+  map = (ring_map_t *) apr_pcalloc(pool, sizeof(ring_map_t));
+  map->pool = pool;
+  map->header = header;
+  map->inode = finfo->inode;
+  map->device = finfo->device;
+  map->refs = 1;   /* The cache's reference */
+  return map;
+}
+
+/* Stop using a ring, unmapping it once no one else is using it. */
+static void release_ring(ring_map_t *map)
+{
+  if (apr_atomic_dec32(&map->refs) == 0)
+    apr_pool_destroy(map->pool);
+}
+
+/* Return this process's mapping of the ring of the Gosp server listening on
+ * a given socket, mapping the ring if necessary.  Return NULL if the server
+ * has no ring, for example because it isn't running.  The caller must pass
+ * the result to release_ring(). */
+static ring_map_t *acquire_ring(request_rec *r, const char *sock_name)
+{
+  const char *ring_name;         /* Name of the file backing the ring */
+  apr_finfo_t finfo;             /* File information for the ring */
+  ring_map_t *map;               /* Mapping of the ring */
+
+  if (ring_maps == NULL)
+    return NULL;
+  ring_name = ring_file_name(r->pool, sock_name);
+  if (apr_stat(&finfo, ring_name, APR_FINFO_INODE|APR_FINFO_DEV|APR_FINFO_SIZE, r->pool) != APR_SUCCESS)
+    return NULL;
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(ring_mutex);
+#endif
+  map = apr_hash_get(ring_maps, ring_name, APR_HASH_KEY_STRING);
+  if (map != NULL && (map->inode != finfo.inode || map->device != finfo.device)) {
+    /* The Gosp server was relaunched.  Forget its predecessor's ring. */
+    apr_hash_set(ring_maps, ring_name, APR_HASH_KEY_STRING, NULL);
+    release_ring(map);
+    map = NULL;
+  }
+  if (map == NULL) {
+    map = map_ring(r, ring_name, &finfo);
+    if (map != NULL)
+      apr_hash_set(ring_maps, apr_pstrdup(map->pool, ring_name), APR_HASH_KEY_STRING, map);
+  }
+  if (map != NULL)
+    apr_atomic_inc32(&map->refs);
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(ring_mutex);
+#endif
+  return map;
+}
+
+/* Give up on the request in a slot, leaving the Gosp server to free the slot
+ * if it has seen the request. */
+static void abandon_slot(ring_slot_t *slot)
+{
+  apr_uint32_t state;            /* Current state of the slot */
+
+  while (1) {
+    state = apr_atomic_read32(&slot->state);
+    switch (state) {
+    case RING_REQUEST:
+      if (apr_atomic_cas32(&slot->state, RING_ABANDONED_REQUEST, state) == state)
+        return;
+      break;
+
+    case RING_BUSY:
+    case RING_CHUNK:
+      if (apr_atomic_cas32(&slot->state, RING_ABANDONED, state) == state) {
+        futex_wake(&slot->state);
+        return;
+      }
+      break;
+
+    default:
+      /* The server has finished with the slot. */
+      apr_atomic_set32(&slot->state, RING_FREE);
+      return;
+    }
+  }
+}
+
+/* Send a page request to a Gosp server through its shared-memory ring and
+ * process the response.  Return GOSP_STATUS_NEED_ACTION if the
+ * request should go through the socket instead because the server has no
+ * ring, the ring is full, the request doesn't fit in a slot, or the server
+ * exited before seeing the request. */
+static gosp_status_t ring_request_response(request_rec *r, const char *sock_name)
+{
+  ring_map_t *map;               /* Mapping of the Gosp server's ring */
+  const gosp_buffer_t *req;      /* Encoded request */
+  ring_header_t *header;         /* Start of the mapped ring */
+  ring_slot_t *slot = NULL;      /* Slot holding our request */
+  gosp_buffer_t *buf;            /* Response from the Gosp server */
+  response_state_t state;        /* State of processing the response */
+  apr_uint32_t slot_state;       /* State of our slot */
+  apr_uint32_t first;            /* First slot to try to claim */
+  apr_uint32_t len;              /* Number of bytes of response in the slot */
+  apr_uint32_t i;
+  apr_time_t now;                /* Current time */
+  apr_time_t deadline;           /* Time at which we give up waiting for more data */
+  int spins = 0;                 /* Number of times we checked for data without sleeping */
+  gosp_status_t gstatus = GOSP_STATUS_FAIL;  /* Status to return */
+
+  /* Map the ring and encode the request only once we know the server has a
+   * ring. */
+  map = acquire_ring(r, sock_name);
+  if (map == NULL)
+    return GOSP_STATUS_NEED_ACTION;
+  req = encode_page_request(r);
+  if (req == NULL) {
+    release_ring(map);
+    return GOSP_STATUS_FAIL;
+  }
+
+  /* Claim a free slot, starting from a different slot for each request so
+   * concurrent threads rarely contend for the same one. */
+  header = map->header;
+  if (req->len <= header->slot_size) {
+    first = apr_atomic_inc32(&header->next_slot);
+    for (i = 0; i < header->num_slots && slot == NULL; i++) {
+      slot = ring_slot(header, (first + i)%header->num_slots);
+      if (apr_atomic_cas32(&slot->state, RING_CLAIMED, RING_FREE) != RING_FREE)
+        slot = NULL;
+    }
+  }
+  if (slot == NULL) {
+    release_ring(map);
+    return GOSP_STATUS_NEED_ACTION;
+  }
+  scoreboard_phase_end(r, GOSP_PHASE_CONNECT);
+
+  /* Post the request and ring the doorbell, waking the Gosp server if it's
+   * asleep. */
+  memcpy(RING_SLOT_DATA(slot), req->data, req->len);
+  slot->len = (apr_uint32_t) req->len;
+  slot->client_pid = (apr_uint32_t) getpid();
+  (void) apr_atomic_xchg32(&slot->state, RING_REQUEST);
+  apr_atomic_inc32(&header->doorbell);
+  if (apr_atomic_read32(&header->server_waiting) != 0)
+    futex_wake(&header->doorbell);
+  scoreboard_phase_end(r, GOSP_PHASE_SEND);
+
+  /* Receive the response one slot-full at a time, processing metadata as it
+   * arrives. */
+  buf = buffer_create(r->pool, RESPONSE_BUFFER_SIZE);
+  init_response_state(&state);
+  deadline = apr_time_now() + GOSP_RESPONSE_TIMEOUT;
+  while (1) {
+    slot_state = apr_atomic_read32(&slot->state);
+    if (slot_state == RING_CHUNK || slot_state == RING_DONE) {
+      /* Append the data to the response. */
+      len = slot->len;
+      if (len > header->slot_size)
+        len = header->slot_size;
+      if (buf->len == 0 && len > 0)
+        scoreboard_first_byte(r);
+      buffer_append(buf, RING_SLOT_DATA(slot), len);
+      if (slot_state == RING_DONE) {
+        apr_atomic_set32(&slot->state, RING_FREE);
+        slot = NULL;
+        gstatus = GOSP_STATUS_OK;
+        break;
+      }
+
+      /* Let the server write the next piece. */
+      (void) apr_atomic_cas32(&slot->state, RING_BUSY, RING_CHUNK);
+      futex_wake(&slot->state);
+      if (process_metadata(r, buf, &state) != GOSP_STATUS_OK)
+        break;
+      deadline = apr_time_now() + GOSP_RESPONSE_TIMEOUT;
+      spins = 0;
+      continue;
+    }
+    if (spins++ < ring_spin_limit)
+      continue;
+
+    /* Give up if we time out or the server exits.  A request the server
+     * never saw can be resent through the socket. */
+    now = apr_time_now();
+    if (now >= deadline) {
+      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
+                    "Timed out waiting for data from the Gosp server");
+      break;
+    }
+    if (kill((pid_t) header->server_pid, 0) != 0 && errno == ESRCH) {
+      if (slot_state == RING_REQUEST)
+        gstatus = GOSP_STATUS_NEED_ACTION;
+      else
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
+                      "The Gosp server exited while generating the page");
+      break;
+    }
+    futex_wait(&slot->state, slot_state,
+               deadline - now < RING_CHECK_INTERVAL ? deadline - now : RING_CHECK_INTERVAL);
+  }
+  if (slot != NULL)
+    abandon_slot(slot);
+  release_ring(map);
+  if (gstatus != GOSP_STATUS_OK)
+    return gstatus;
+
+  /* Process the complete response. */
+  scoreboard_phase_end(r, GOSP_PHASE_RECEIVE);
+  gstatus = process_response(r, buf, NULL, &state);
+  scoreboard_phase_end(r, GOSP_PHASE_WRITE);
+  return gstatus;
+}
+
+#else
+
+/* Shared-memory rings are unsupported on this platform. */
+void ring_child_init(apr_pool_t *pool)
+{
+}
+
+/* Shared-memory rings are unsupported on this platform, so always send
+ * requests through the socket. */
+static gosp_status_t ring_request_response(request_rec *r, const char *sock_name)
+{
+  return GOSP_STATUS_NEED_ACTION;
+}
+
+#endif
+
 /* Send a request to the Gosp server and process its response.  If the server
  * is not currently running, return GOSP_STATUS_NEED_ACTION.  This function is
  * intended to represent the common case in processing HTTP requests to Gosp
@@ -546,28 +1559,236 @@ gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **respon
 gosp_status_t simple_request_response(request_rec *r, const char *sock_name)
 {
   apr_socket_t *sock;         /* The Unix-domain socket proper */
-  char *response;             /* Response string */
-  size_t resp_len;            /* Length of response string */
+  gosp_buffer_t *buf;         /* Response from the Gosp server */
+  response_state_t state;     /* State of processing the response */
+  apr_file_t *body_file;      /* File containing the page data, if passed as a descriptor */
+  gosp_context_config_t *cconfig;   /* Context configuration */
   apr_status_t status;        /* Status of an APR call */
   gosp_status_t gstatus;      /* Status of an internal Gosp call */
 
-  /* Connect to the process that handles the requested Go Server Page. */
+  /* If so directed, try the Gosp server's shared-memory ring first. */
   ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, APR_SUCCESS, r,
                "Asking the Gosp server listening on socket %s to handle URI %s",
                sock_name, r->uri);
+  scoreboard_phase_begin(r);
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  if (cconfig->shared_memory == 1) {
+    gstatus = ring_request_response(r, sock_name);
+    if (gstatus != GOSP_STATUS_NEED_ACTION)
+      return gstatus;
+  }
+
+  /* Connect to the process that handles the requested Go Server Page. */
   gstatus = connect_socket(r, sock_name, &sock);
   if (gstatus != GOSP_STATUS_OK)
     return gstatus;
+  scoreboard_phase_end(r, GOSP_PHASE_CONNECT);
 
-  /* Send the Gosp server a request and process its response. */
+  /* Send the Gosp server a request and process its response.  Accept the
+   * page data as a file descriptor only if we asked for that. */
   gstatus = send_request(r, sock);
   if (gstatus != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
-  gstatus = receive_response(r, sock, &response, &resp_len);
+  scoreboard_phase_end(r, GOSP_PHASE_SEND);
+  body_file = NULL;
+  buf = buffer_create(r->pool, RESPONSE_BUFFER_SIZE);
+  init_response_state(&state);
+  gstatus = receive_into_buffer(r, sock, buf,
+                                cconfig->body_fd_threshold == NULL ? NULL : &body_file,
+                                &state);
   if (gstatus != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
+  scoreboard_phase_end(r, GOSP_PHASE_RECEIVE);
   status = apr_socket_close(sock);
   if (status != APR_SUCCESS)
     return GOSP_STATUS_FAIL;
-  return process_response(r, response, resp_len);
+  gstatus = process_response(r, buf, body_file, &state);
+  scoreboard_phase_end(r, GOSP_PHASE_WRITE);
+  return gstatus;
+}
+
+/* Define the state of a request that is suspended while awaiting a response
+ * from the Gosp server. */
+typedef struct {
+  request_rec *request;       /* Suspended request */
+  apr_socket_t *sock;         /* Socket connected to the Gosp server */
+  apr_socket_t *socks[2];     /* NULL-terminated list of sockets on which the MPM should wait */
+  int wake_on_data;           /* 1=the MPM wakes us when the socket is readable; 0=we poll */
+  apr_pool_t *poll_pool;      /* Pool from which the MPM allocates its socket-callback data, cleared between registrations */
+  gosp_buffer_t *buf;         /* Response received so far */
+  apr_file_t *body_file;      /* File containing the page data, if passed as a descriptor */
+  response_state_t response;  /* State of processing the response */
+  int accept_fd;              /* 1=accept a file descriptor from the Gosp server; 0=don't */
+  apr_interval_time_t delay;  /* Time until we next poll the socket */
+  apr_time_t deadline;        /* Time at which we give up waiting for more data */
+} async_state_t;
+
+/* Complete a suspended request with a given HTTP status and let the MPM
+ * resume processing the connection. */
+static void async_finish(request_rec *r, int http_status)
+{
+  if (http_status == OK)
+    ap_finalize_request_protocol(r);
+  else
+    ap_die(http_status, r);
+  scoreboard_end_request(r, http_status);
+  ap_mpm_resume_suspended(r->connection);
+  ap_process_request_after_handler(r);
+}
+
+/* Read whatever a suspended request's Gosp server has sent so far. */
+static void async_poll(void *baton);
+
+/* Ask the MPM to call async_poll when the Gosp server sends more data or when
+ * the request's deadline passes.  If the MPM can't watch sockets, fall back
+ * to calling async_poll after the current polling delay. */
+static apr_status_t async_schedule(async_state_t *state)
+{
+  apr_interval_time_t timeout;  /* Time remaining until the deadline */
+  apr_status_t status;        /* Status of an APR call */
+
+  if (state->wake_on_data) {
+    timeout = state->deadline - apr_time_now();
+    if (timeout < 1)
+      timeout = 1;
+    status = ap_mpm_register_socket_callback_timeout(state->socks, state->poll_pool, 1,
+                                                     async_poll, async_poll, state, timeout);
+    if (!APR_STATUS_IS_ENOTIMPL(status))
+      return status;
+    state->wake_on_data = 0;
+  }
+  return ap_mpm_register_timed_callback(state->delay, async_poll, state);
+}
+
+/* Read whatever a suspended request's Gosp server has sent so far.  Process
+ * the response once the server closes the socket; otherwise, reschedule
+ * ourself, backing off exponentially while the server is silent if we have to
+ * poll. */
+static void async_poll(void *baton)
+{
+  async_state_t *state = (async_state_t *) baton;   /* Request state */
+  request_rec *r = state->request;  /* Suspended request */
+  apr_size_t prev_len;        /* Length of the response before this poll */
+  apr_time_t now;             /* Current time */
+  apr_status_t status;        /* Status of an APR call */
+  int http_status;            /* HTTP status with which to complete the request */
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(r->invoke_mtx);
+#endif
+  if (state->wake_on_data) {
+    (void) ap_mpm_unregister_socket_callback(state->socks, state->poll_pool);
+    apr_pool_clear(state->poll_pool);
+  }
+
+  /* Read everything that is currently available. */
+  prev_len = state->buf->len;
+  do
+    status = receive_chunk(r, state->sock, state->buf,
+                           state->accept_fd ? &state->body_file : NULL);
+  while (status == APR_SUCCESS);
+  http_status = HTTP_INTERNAL_SERVER_ERROR;
+  if (process_metadata(r, state->buf, &state->response) != GOSP_STATUS_OK)
+    /* Invalid metadata */
+    (void) apr_socket_close(state->sock);
+  else if (status == APR_EOF) {
+    /* The response is complete.  Process it. */
+    scoreboard_phase_end(r, GOSP_PHASE_RECEIVE);
+    (void) apr_socket_close(state->sock);
+    if (process_response(r, state->buf, state->body_file, &state->response) == GOSP_STATUS_OK)
+      http_status = r->status == HTTP_OK ? OK : r->status;
+    scoreboard_phase_end(r, GOSP_PHASE_WRITE);
+  }
+  else if (status != APR_TIMEUP && !APR_STATUS_IS_EAGAIN(status)) {
+    /* Error */
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                  "Failed to receive data from the Gosp server");
+    (void) apr_socket_close(state->sock);
+  }
+  else {
+    /* No more data are available yet.  Check again later. */
+    now = apr_time_now();
+    if (state->buf->len > prev_len) {
+      state->delay = GOSP_ASYNC_MIN_POLL;
+      state->deadline = now + GOSP_RESPONSE_TIMEOUT;
+    }
+    else
+      state->delay = state->delay*2 > GOSP_ASYNC_MAX_POLL ? GOSP_ASYNC_MAX_POLL : state->delay*2;
+    if (now >= state->deadline)
+      ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, APR_SUCCESS, r,
+                    "Timed out waiting for data from the Gosp server");
+    else {
+      status = async_schedule(state);
+      if (status == APR_SUCCESS) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(r->invoke_mtx);
+#endif
+        return;
+      }
+      ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                    "Failed to reschedule a suspended Gosp request");
+    }
+    (void) apr_socket_close(state->sock);
+  }
+
+  /* Complete the request. */
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(r->invoke_mtx);
+#endif
+  async_finish(r, http_status);
+}
+
+/* Send a request to the Gosp server and suspend the HTTP request while the
+ * server generates the page so the worker thread can service other
+ * connections.  Return GOSP_STATUS_OK if the request was suspended (and the
+ * handler should return SUSPENDED), GOSP_STATUS_NEED_ACTION if the server is
+ * not currently running, or GOSP_STATUS_FAIL on error.  This function
+ * requires an MPM that supports asynchronous processing, such as event. */
+gosp_status_t async_request_response(request_rec *r, const char *sock_name)
+{
+  async_state_t *state;       /* State of the suspended request */
+  gosp_context_config_t *cconfig;   /* Context configuration */
+  apr_status_t status;        /* Status of an APR call */
+  gosp_status_t gstatus;      /* Status of an internal Gosp call */
+
+  /* Connect to the process that handles the requested Go Server Page. */
+  ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, APR_SUCCESS, r,
+               "Asynchronously asking the Gosp server listening on socket %s to handle URI %s",
+               sock_name, r->uri);
+  state = (async_state_t *) apr_pcalloc(r->pool, sizeof(async_state_t));
+  state->request = r;
+  scoreboard_phase_begin(r);
+  gstatus = connect_socket(r, sock_name, &state->sock);
+  if (gstatus != GOSP_STATUS_OK)
+    return gstatus;
+  scoreboard_phase_end(r, GOSP_PHASE_CONNECT);
+
+  /* Send the Gosp server a request. */
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  gstatus = send_request(r, state->sock);
+  if (gstatus != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+  scoreboard_phase_end(r, GOSP_PHASE_SEND);
+
+  /* Make the socket non-blocking and schedule the first poll. */
+  status = apr_socket_timeout_set(state->sock, 0);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to make the socket non-blocking");
+  state->buf = buffer_create(r->pool, RESPONSE_BUFFER_SIZE);
+  state->accept_fd = cconfig->body_fd_threshold != NULL;
+  init_response_state(&state->response);
+  state->socks[0] = state->sock;
+  status = apr_pool_create(&state->poll_pool, r->pool);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to create a pool for polling the Gosp server");
+  state->wake_on_data = 1;
+  state->delay = GOSP_ASYNC_MIN_POLL;
+  state->deadline = apr_time_now() + GOSP_RESPONSE_TIMEOUT;
+  status = async_schedule(state);
+  if (status != APR_SUCCESS)
+    REPORT_REQUEST_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                         "Failed to suspend the request");
+  return GOSP_STATUS_OK;
 }
@@ -8,8 +8,11 @@
 #define _GOSP_H
 
 /* Include all required header files here. */
+#include <fcntl.h>
 #include <libgen.h>
+#include <stdio.h>
 #include <stdarg.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -19,7 +22,9 @@
 #include "http_core.h"
 #include "http_log.h"
 #include "http_protocol.h"
+#include "http_request.h"
 #include "ap_config.h"
+#include "ap_mpm.h"
 #include "apr_env.h"
 #include "apr_file_info.h"
 #include "apr_global_mutex.h"
@@ -61,6 +66,7 @@
 #define GOSP_STATUS_OK          0    /* Function succeeded */
 #define GOSP_STATUS_NEED_ACTION 1    /* Function failed but may succeed if the caller takes some action and retries */
 #define GOSP_STATUS_FAIL        2    /* Function experienced a presumably permanent failure */
+#define GOSP_STATUS_LOCK_LOST   3    /* Like GOSP_STATUS_FAIL, but the caller no longer holds the global lock */
 
 /* Define a number of wait-time values (all in microseconds). */
 #define GOSP_SECONDS 1000000
@@ -68,6 +74,9 @@
 #define GOSP_LOCK_WAIT_TIME    (10*GOSP_SECONDS)  /* Time to wait to acquire a lock */
 #define GOSP_LAUNCH_WAIT_TIME   (3*GOSP_SECONDS)  /* Time to wait for a Gosp server to launch */
 #define GOSP_EXIT_WAIT_TIME     (1*GOSP_SECONDS)  /* Time to wait for a Gosp server to exit */
+#define GOSP_ASYNC_MIN_POLL  1000                 /* Initial interval at which to poll a suspended request's socket if the MPM can't watch it */
+#define GOSP_ASYNC_MAX_POLL 50000                 /* Maximum interval at which to poll a suspended request's socket if the MPM can't watch it */
+#define GOSP_PREWARM_INTERVAL  (60*GOSP_SECONDS)  /* Minimum time between a process's checks that pre-warmed pages are running */
 
 /* Define the maximum size of a POST request that we'll allow. */
 #ifndef GOSP_MAX_POST_SIZE
@@ -84,6 +93,12 @@ typedef struct {
   apr_gid_t group_id;          /* Group ID when server answers requests */
   apr_global_mutex_t *mutex;   /* Global lock to serialize operations*/
   const char *lock_name;       /* Name of a file to back the mutex, if needed */
+  const char *trace_log_name;  /* Name of a file to which to append request traces */
+  apr_file_t *trace_log;       /* Open trace_log_name or NULL if none */
+  const char *capture_name;    /* Name of a file to which to append sampled page requests */
+  apr_uint32_t capture_every;  /* Capture one out of every capture_every page requests */
+  apr_file_t *capture_file;    /* Open capture_name or NULL if none */
+  apr_array_header_t *prewarm; /* URL paths of pages whose Gosp servers to keep running or NULL if none */
 } gosp_server_config_t;
 
 /* Declare a type for our per-context configuration options. */
@@ -94,14 +109,55 @@ typedef struct {
   const char *go_path;         /* Value to assign to GOPATH when compiling Gosp pages */
   const char *go_mod_cache;    /* Value to assign to GOMODCACHE when compiling Gosp pages */
   const char *max_idle;        /* Maximum idle time before a Gosp server automatically exits */
+  const char *adaptive_idle;   /* Maximum idle time a Gosp server can learn from its page's request history */
   const char *max_top;         /* Maximum number of top-level blocks allowed per Gosp page */
   const char *allowed_imports; /* Comma-separated list of packages that can be imported */
   apr_hash_t *mod_repls;       /* Replacements to include in a Go module file */
+  int coalesce;                /* 1=coalesce identical concurrent GET requests; 0=don't; -1=unspecified */
+  const char *coalesce_vary;   /* Comma-separated list of request headers that distinguish coalesced requests */
+  const char *body_fd_threshold; /* Minimum page size in bytes to receive as a file descriptor */
+  int async;                   /* 1=release the worker thread while awaiting a page; 0=don't; -1=unspecified */
+  int server_timing;           /* 1=report phase timings in a Server-Timing header; 0=don't; -1=unspecified */
+  int profile_guided;          /* 1=profile pages in production and optimize plugins accordingly; 0=don't; -1=unspecified */
+  int zygote;                  /* 1=launch Gosp servers from pre-initialized processes; 0=don't; -1=unspecified */
+  int supervise;               /* 1=let a supervisor restart crashed or unresponsive Gosp servers; 0=don't; -1=unspecified */
+  const char *go_max_procs;    /* Value to assign to GOMAXPROCS when running Gosp servers */
+  const char *go_mem_limit;    /* Value to assign to GOMEMLIMIT when running Gosp servers */
+  const char *go_gc;           /* Value to assign to GOGC when running Gosp servers */
+  const char *cgroup;          /* cgroup (v2) directory beneath which to place each page's Gosp server */
+  const char *cpu_weight;      /* CPU weight to assign to each page's cgroup */
+  const char *memory_max;      /* Memory limit to assign to each page's cgroup */
+  int build_server;            /* 1=compile pages using a shared build server; 0=don't; -1=unspecified */
+  int compress;                /* 1=have Gosp servers gzip-compress page bodies; 0=don't; -1=unspecified */
+  const char *fragment_cache;  /* Capacity in bytes of each Gosp server's cache of go:cache fragments */
+  int shared_memory;           /* 1=exchange small pages with Gosp servers through shared memory; 0=don't; -1=unspecified */
 } gosp_context_config_t;
 
+/* Declare a growable, NUL-terminated buffer of bytes allocated from a pool. */
+typedef struct {
+  apr_pool_t *pool;            /* Pool from which to allocate storage */
+  char *data;                  /* Buffer contents */
+  apr_size_t len;              /* Number of bytes of data, excluding the trailing NUL */
+  apr_size_t cap;              /* Number of bytes allocated */
+} gosp_buffer_t;
+
+/* Enumerate the phases of a request whose latency we record. */
+typedef enum {
+  GOSP_PHASE_CHECK,            /* Checking if the page needs to be recompiled */
+  GOSP_PHASE_CONNECT,          /* Connecting to the Gosp server */
+  GOSP_PHASE_SEND,             /* Sending the request to the Gosp server */
+  GOSP_PHASE_GENERATE,         /* Waiting for the first byte of the response */
+  GOSP_PHASE_RECEIVE,          /* Receiving the rest of the response */
+  GOSP_PHASE_WRITE,            /* Processing the response and writing it to the client */
+  GOSP_PHASE_TOTAL,            /* Entire request, including any compilation and launching */
+  GOSP_PHASE_COUNT             /* Number of phases; not itself a phase */
+} gosp_phase_t;
+
 /* Define access permissions for any files and directories we create. */
 #define GOSP_FILE_PERMS                                 \
   APR_FPROT_UREAD|APR_FPROT_UWRITE|APR_FPROT_GREAD|APR_FPROT_WREAD
+#define GOSP_PRIVATE_FILE_PERMS                         \
+  APR_FPROT_UREAD|APR_FPROT_UWRITE
 #define GOSP_DIR_PERMS                                  \
   APR_FPROT_UREAD|APR_FPROT_UWRITE|APR_FPROT_UEXECUTE | \
   APR_FPROT_GREAD|APR_FPROT_GEXECUTE |                  \
@@ -133,18 +189,51 @@ do {                                                                        \
 extern module AP_MODULE_DECLARE_DATA gosp_module;
 extern gosp_status_t acquire_global_lock(server_rec *s);
 extern const char **append_string(apr_pool_t *p, const char *const *list, const char *str);
-extern gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name);
+extern gosp_status_t async_request_response(request_rec *r, const char *sock_name);
+extern void buffer_append(gosp_buffer_t *buf, const char *data, apr_size_t len);
+extern void buffer_append_json(gosp_buffer_t *buf, const char *data, apr_size_t len);
+extern gosp_buffer_t *buffer_create(apr_pool_t *pool, apr_size_t cap);
+extern void buffer_printf(gosp_buffer_t *buf, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+extern void buffer_reserve(gosp_buffer_t *buf, apr_size_t extra);
+extern void capture_request(request_rec *r, const gosp_buffer_t *buf);
+extern gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name,
+                                         const char *static_name);
 extern char *concatenate_filepaths(server_rec *s, apr_pool_t *pool, ...);
 extern gosp_status_t connect_socket(request_rec *r, const char *sock_name, apr_socket_t **sock);
 extern gosp_status_t create_directories_for(server_rec *s, apr_pool_t *pool, const char *fname, int is_dir);
+extern int gosp_status_handler(request_rec *r);
 extern int is_newer_than(request_rec *r, const char *first, const char *second);
 extern gosp_status_t kill_gosp_server(request_rec *r, const char *sock_name);
+extern int lies_in_or_below(request_rec *r, const char *child, const char *parent);
 extern gosp_status_t launch_gosp_server(request_rec *r, const char *plugin_name, const char *sock_name);
-extern gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **response, size_t *resp_len);
+extern gosp_status_t launch_supervisor(server_rec *s, apr_pool_t *pool, const char *gosp_server);
+extern gosp_status_t notify_zygote(server_rec *s, apr_pool_t *pool, const char *zygote_name, const char *message);
+extern gosp_status_t receive_build_response(request_rec *r, apr_socket_t *sock);
+extern gosp_status_t receive_response(request_rec *r, apr_socket_t *sock, char **response, size_t *resp_len, apr_file_t **body_file);
 extern gosp_status_t release_global_lock(server_rec *s);
+extern void ring_child_init(apr_pool_t *pool);
+extern const char *ring_file_name(apr_pool_t *pool, const char *sock_name);
+extern void scoreboard_begin_request(request_rec *r);
+extern gosp_status_t scoreboard_create(server_rec *s, apr_pool_t *pconf);
+extern void scoreboard_end_request(request_rec *r, int http_status);
+extern void scoreboard_first_byte(request_rec *r);
+extern void scoreboard_note_compile(request_rec *r, apr_interval_time_t duration, int success);
+extern void scoreboard_note_kill(request_rec *r);
+extern void scoreboard_note_launch(request_rec *r);
+extern void scoreboard_note_server(request_rec *r, int pid);
+extern void scoreboard_phase_begin(request_rec *r);
+extern void scoreboard_phase_end(request_rec *r, gosp_phase_t phase);
+extern gosp_status_t send_build_request(request_rec *r, const char *builder_name, const char *const *args, const char *const *env, apr_socket_t **sock);
 extern gosp_status_t send_request(request_rec *r, apr_socket_t *sock);
+extern gosp_status_t send_spawn_request(request_rec *r, const char *zygote_name, const char *const *args);
+extern gosp_status_t send_static_file(request_rec *r, const char *fname);
 extern gosp_status_t send_termination_request(request_rec *r, const char *sock_name);
 extern gosp_status_t server_is_responsive(request_rec *r, const char *sock_name);
 extern gosp_status_t simple_request_response(request_rec *r, const char *sock_name);
+extern void timing_note_server(request_rec *r, const char *value);
+extern void timing_set_header(request_rec *r);
+extern int timing_wanted(request_rec *r);
+extern const char *zygote_socket_name(server_rec *s, apr_pool_t *pool, const char *gosp_server, int supervise);
 
 #endif
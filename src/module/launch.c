@@ -5,6 +5,7 @@
  **********************************************/
 
 #include "gosp.h"
+#include "apr_lib.h"
 
 /* Invoke an APR call as part of process launch.  On failure, log an error
  * message and return GOSP_STATUS_FAIL. */
@@ -51,8 +52,29 @@ static void log_command_line(request_rec *r, const char **args)
   ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, APR_SUCCESS, r, "%s", msg);
 }
 
-/* Launch a process and wait for it to complete. */
-static gosp_status_t launch_and_wait(request_rec *r, const char **args, int detach)
+/* Append the context's GOPATH and GOMODCACHE settings to a NULL-terminated
+ * list of environment variables and return the new list. */
+static const char **append_go_environment(request_rec *r, const char **envp)
+{
+  gosp_context_config_t *cconfig;   /* Context configuration */
+
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  if (cconfig->go_path == NULL)
+    envp = append_string(r->pool, envp,
+                         apr_pstrcat(r->pool, "GOPATH=", DEFAULT_GO_PATH, NULL));
+  else
+    envp = append_string(r->pool, envp,
+                         apr_pstrcat(r->pool, "GOPATH=", cconfig->go_path, NULL));
+  if (cconfig->go_mod_cache != NULL)
+    envp = append_string(r->pool, envp,
+                         apr_pstrcat(r->pool, "GOMODCACHE=", cconfig->go_mod_cache, NULL));
+  return envp;
+}
+
+/* Launch a process and wait for it to complete.  If is_server is TRUE, the
+ * process is a Gosp server and additionally receives the context's Go runtime
+ * settings. */
+static gosp_status_t launch_and_wait(request_rec *r, const char **args, int detach, int is_server)
 {
   apr_proc_t proc;                  /* Launched process */
   const char **envp;                /* Process environment */
@@ -73,16 +95,20 @@ static gosp_status_t launch_and_wait(request_rec *r, const char **args, int deta
 
   /* Establish an environment for the child. */
   cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
-  envp = (const char **) environ;
-  if (cconfig->go_path == NULL)
-    envp = append_string(r->pool, (const char **) envp,
-                         apr_pstrcat(r->pool, "GOPATH=", DEFAULT_GO_PATH, NULL));
-  else
-    envp = append_string(r->pool, (const char **) envp,
-                         apr_pstrcat(r->pool, "GOPATH=", cconfig->go_path, NULL));
-  if (cconfig->go_mod_cache != NULL)
-    envp = append_string(r->pool, (const char **) envp,
-                         apr_pstrcat(r->pool, "GOMODCACHE=", cconfig->go_mod_cache, NULL));
+  envp = append_go_environment(r, (const char **) environ);
+  if (is_server) {
+    /* Keep each Gosp server's Go runtime from sizing itself to the entire
+     * machine. */
+    if (cconfig->go_max_procs != NULL)
+      envp = append_string(r->pool, (const char **) envp,
+                           apr_pstrcat(r->pool, "GOMAXPROCS=", cconfig->go_max_procs, NULL));
+    if (cconfig->go_mem_limit != NULL)
+      envp = append_string(r->pool, (const char **) envp,
+                           apr_pstrcat(r->pool, "GOMEMLIMIT=", cconfig->go_mem_limit, NULL));
+    if (cconfig->go_gc != NULL)
+      envp = append_string(r->pool, (const char **) envp,
+                           apr_pstrcat(r->pool, "GOGC=", cconfig->go_gc, NULL));
+  }
 
   /* Spawn the process and wait for it to complete.  It appears we need to do
    * this even for detached process to avoid leaving defunct processes lying
@@ -97,11 +123,231 @@ static gosp_status_t launch_and_wait(request_rec *r, const char **args, int deta
   return GOSP_STATUS_OK;
 }
 
-/* Use gosp2go to compile a Go Server Page into a plugin. */
-gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name)
+/* Return the name of the file in which a Gosp server records CPU profiles of
+ * the current page for use in profile-guided optimization, or NULL on
+ * error. */
+static const char *pgo_profile_name(request_rec *r)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  return concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "profiles",
+                               apr_pstrcat(r->pool, r->filename, ".pgo", NULL),
+                               NULL);
+}
+
+/* Return the name of the file in which a Gosp server records the times between
+ * requests for the current page so it can adapt its idle timeout, or NULL on
+ * error. */
+static const char *idle_history_name(request_rec *r)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  return concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "history",
+                               apr_pstrcat(r->pool, r->filename, ".idle", NULL),
+                               NULL);
+}
+
+/* Return the name of the cgroup in which to place the Gosp server for the
+ * current page.  This is a directory beneath the context's GospCgroup named
+ * after the page, with "/" mapped to "-", "_" mapped to "__", and "-" and
+ * other unusual characters mapped to "_" followed by two hexadecimal digits.
+ * The mapping is reversible, so distinct pages never share a cgroup. */
+static const char *page_cgroup_name(request_rec *r)
+{
+  static const char hex[] = "0123456789abcdef";  /* Hexadecimal digits */
+  gosp_context_config_t *cconfig;   /* Context configuration */
+  const char *fname;                /* Page filename without its leading "/" */
+  char *leaf;                       /* Name of the page's cgroup within GospCgroup */
+  char *d;                          /* Next character to write to leaf */
+  const unsigned char *c;
+
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  fname = r->filename[0] == '/' ? r->filename + 1 : r->filename;
+  leaf = apr_palloc(r->pool, 3*strlen(fname) + 1);
+  for (c = (const unsigned char *) fname, d = leaf; *c != '\0'; c++)
+    if (*c == '/')
+      *d++ = '-';
+    else if (*c == '_') {
+      *d++ = '_';
+      *d++ = '_';
+    }
+    else if (apr_isalnum(*c) || *c == '.')
+      *d++ = (char) *c;
+    else {
+      *d++ = '_';
+      *d++ = hex[*c >> 4];
+      *d++ = hex[*c & 0xF];
+    }
+  *d = '\0';
+  return apr_pstrcat(r->pool, cconfig->cgroup, "/", leaf, NULL);
+}
+
+/* Return the name of the socket on which the zygote for a given gosp-server
+ * executable listens, or NULL on error.  A supervising zygote uses a
+ * different socket from a plain zygote so the two never answer each other's
+ * requests. */
+const char *zygote_socket_name(server_rec *s, apr_pool_t *pool, const char *gosp_server, int supervise)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+
+  sconfig = ap_get_module_config(s->module_config, &gosp_module);
+  return concatenate_filepaths(s, pool, sconfig->work_dir, "zygotes",
+                               apr_pstrcat(pool, gosp_server,
+                                           supervise ? ".supervisor.sock" : ".sock",
+                                           NULL),
+                               NULL);
+}
+
+/* Launch in the background a zygote that supervises the Gosp servers it
+ * launches.  Unlike launch_and_wait(), this needs no request, so it can be
+ * called when a child process starts.  Redundant launches are harmless; all
+ * but one of the resulting supervisors exit immediately. */
+gosp_status_t launch_supervisor(server_rec *s, apr_pool_t *pool, const char *gosp_server)
+{
+  const char *args[5];              /* Command-line arguments for launching the supervisor */
+  const char *zygote_name;          /* Socket on which the supervisor listens */
+  apr_proc_t proc;                  /* Launched process */
+  apr_procattr_t *attr;             /* Process attributes */
+  int exit_code;                    /* Process return code */
+  apr_exit_why_e exit_why;          /* Condition under which the process exited */
+  apr_status_t status;              /* Status of an APR call */
+
+  /* Ensure we have a place to write the socket. */
+  zygote_name = zygote_socket_name(s, pool, gosp_server, 1);
+  if (zygote_name == NULL)
+    return GOSP_STATUS_FAIL;
+  if (create_directories_for(s, pool, zygote_name, 0) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+  ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, s,
+               "Launching a supervisor for %s", gosp_server);
+
+  /* Spawn the supervisor detached from us and wait for the intermediate
+   * process to exit so it doesn't linger as a zombie. */
+  args[0] = gosp_server;
+  args[1] = "-zygote";
+  args[2] = zygote_name;
+  args[3] = "-supervise";
+  args[4] = NULL;
+  status = apr_procattr_create(&attr, pool);
+  if (status == APR_SUCCESS)
+    status = apr_procattr_cmdtype_set(attr, APR_PROGRAM);
+  if (status == APR_SUCCESS)
+    status = apr_procattr_detach_set(attr, 1);
+  if (status == APR_SUCCESS)
+    status = apr_proc_create(&proc, args[0], args, (const char *const *) environ, attr, pool);
+  if (status != APR_SUCCESS)
+    REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                        "Failed to run %s", args[0]);
+  (void) apr_proc_wait(&proc, &exit_code, &exit_why, APR_WAIT);
+  return GOSP_STATUS_OK;
+}
+
+/* Ask a zygote to launch a Gosp server with the given NULL-terminated
+ * gosp-server command line.  If the zygote is not running, launch it in the
+ * background and return GOSP_STATUS_NEED_ACTION so the caller can launch the
+ * Gosp server directly this time.  If the context calls for supervision, the
+ * zygote additionally supervises the Gosp servers it launches. */
+static gosp_status_t launch_via_zygote(request_rec *r, const char **args)
+{
+  const char *zygote_args[5];       /* Command-line arguments for launching the zygote */
+  const char *zygote_name;          /* Socket on which the zygote listens */
+  gosp_context_config_t *cconfig;   /* Context configuration */
+  int supervise;                    /* 1=the zygote supervises its Gosp servers; 0=it doesn't */
+  gosp_status_t gstatus;            /* Status of an internal Gosp call */
+  int i;
+
+  /* Each gosp-server executable gets its own zygote. */
+  cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
+  supervise = cconfig->supervise == 1;
+  zygote_name = zygote_socket_name(r->server, r->pool, args[0], supervise);
+  if (zygote_name == NULL)
+    return GOSP_STATUS_FAIL;
+
+  /* Ask the zygote to launch the Gosp server. */
+  gstatus = send_spawn_request(r, zygote_name, args + 1);
+  if (gstatus != GOSP_STATUS_NEED_ACTION)
+    return gstatus;
+
+  /* The zygote isn't running.  Launch it for next time. */
+  ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, r,
+                "Launching a zygote for %s", args[0]);
+  if (create_directories_for(r->server, r->pool, zygote_name, 0) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+  i = 0;
+  zygote_args[i++] = args[0];
+  zygote_args[i++] = "-zygote";
+  zygote_args[i++] = zygote_name;
+  if (supervise)
+    zygote_args[i++] = "-supervise";
+  zygote_args[i++] = NULL;
+  if (launch_and_wait(r, zygote_args, TRUE, FALSE) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+  return GOSP_STATUS_NEED_ACTION;
+}
+
+/* Ask the build server to run gosp2go with the given NULL-terminated command
+ * line, which must include the gosp2go executable itself.  The global lock,
+ * which the caller must hold, is released while the build server works so
+ * that requests for other pages can proceed in the meantime.  If the build
+ * server is not running, launch it in the background and return
+ * GOSP_STATUS_NEED_ACTION, still holding the lock, so the caller can run
+ * gosp2go directly this time.  If the lock cannot be reacquired after the
+ * build, return GOSP_STATUS_LOCK_LOST. */
+static gosp_status_t compile_via_builder(request_rec *r, const char **args, const char *go_cache)
+{
+  const char *builder_args[4];      /* Command-line arguments for launching the build server */
+  const char *builder_name;         /* Socket on which the build server listens */
+  const char *empty_env[1] = {NULL};  /* Empty list of environment variables */
+  const char **envp;                /* Environment variables to pass to the build server */
+  apr_socket_t *sock;               /* Socket connected to the build server */
+  gosp_server_config_t *sconfig;    /* Server configuration */
+  gosp_status_t gstatus;            /* Status of an internal Gosp call */
+
+  /* Send the build server our command line and Go environment. */
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  builder_name = concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "builder.sock", NULL);
+  if (builder_name == NULL)
+    return GOSP_STATUS_FAIL;
+  envp = append_go_environment(r, empty_env);
+  envp = append_string(r->pool, envp, apr_pstrcat(r->pool, "GOCACHE=", go_cache, NULL));
+  gstatus = send_build_request(r, builder_name, args + 1, envp, &sock);
+  if (gstatus == GOSP_STATUS_OK) {
+    /* Wait for the build to finish without holding the lock. */
+    if (release_global_lock(r->server) != GOSP_STATUS_OK) {
+      (void) apr_socket_close(sock);
+      return GOSP_STATUS_FAIL;
+    }
+    gstatus = receive_build_response(r, sock);
+    if (acquire_global_lock(r->server) != GOSP_STATUS_OK)
+      return GOSP_STATUS_LOCK_LOST;
+    return gstatus;
+  }
+
+  /* The build server isn't running.  Launch it for next time. */
+  ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, r,
+                "Launching a build server listening on socket %s", builder_name);
+  builder_args[0] = args[0];
+  builder_args[1] = "--build-server";
+  builder_args[2] = builder_name;
+  builder_args[3] = NULL;
+  if (launch_and_wait(r, builder_args, TRUE, FALSE) != GOSP_STATUS_OK)
+    return GOSP_STATUS_FAIL;
+  return GOSP_STATUS_NEED_ACTION;
+}
+
+/* Use gosp2go to compile a Go Server Page into a plugin or, if the page
+ * contains no Go code, to prerender it to a static file.  The caller must hold
+ * the global lock, which is temporarily released if a build server does the
+ * compiling.  If the lock cannot then be reacquired, return
+ * GOSP_STATUS_LOCK_LOST, in which case the caller must not release it. */
+gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name,
+                                  const char *static_name)
 {
   const char **args;                /* Process command-line arguments */
   char *go_cache;                   /* Directory for the Go build cache */
+  char *partials_dir;               /* Directory for separately compiled partials */
   gosp_server_config_t *sconfig;    /* Server configuration */
   gosp_context_config_t *cconfig;   /* Context configuration */
   const char *work_dir;             /* Top-level work directory */
@@ -129,6 +375,12 @@ gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name)
   LAUNCH_CALL(apr_env_set("GOCACHE", go_cache, r->pool),
               "Setting GOCACHE=%s failed", go_cache);
 
+  /* Compile partials into a directory shared by all pages so the Go build
+   * cache can reuse them across pages. */
+  partials_dir = concatenate_filepaths(r->server, r->pool, work_dir, "partials", NULL);
+  if (partials_dir == NULL)
+    return GOSP_STATUS_FAIL;
+
   /* Acquire a list of allowed package imports.  If not specified, don't allow
    * any package to be imported (except gosp, which is always allowed. */
   cconfig = (gosp_context_config_t *) ap_get_module_config(r->per_dir_config, &gosp_module);
@@ -137,7 +389,7 @@ gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name)
     imports++;
 
   /* Construct the argument list. */
-  nargs = 14 + 2*apr_hash_count(cconfig->mod_repls);
+  nargs = 20 + 2*apr_hash_count(cconfig->mod_repls);
   args = (const char **) apr_palloc(r->pool, nargs*sizeof(char *));
   i = 0;
   args[i++] = GOSP2GO;
@@ -150,6 +402,10 @@ gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name)
   args[i++] = imports;
   args[i++] = "--max-top";
   args[i++] = cconfig->max_top == NULL ? "1000000000" : cconfig->max_top;
+  args[i++] = "--static-output";
+  args[i++] = static_name;
+  args[i++] = "--partials-dir";
+  args[i++] = partials_dir;
   args[i++] = "--replace";
   args[i++] = apr_pstrcat(r->pool, "gosp,", GOSP_PKG_DIR, NULL);
   for (hidx = apr_hash_first(r->pool, cconfig->mod_repls);
@@ -161,11 +417,28 @@ gosp_status_t compile_gosp_server(request_rec *r, const char *plugin_name)
     args[i++] = "--replace";
     args[i++] = apr_pstrcat(r->pool, pkgname, ",", pathname, NULL);
   }
+  if (cconfig->profile_guided == 1) {
+    /* gosp2go ignores the profile if it does not yet exist. */
+    const char *pgo_name = pgo_profile_name(r);
+    if (pgo_name == NULL)
+      return GOSP_STATUS_FAIL;
+    args[i++] = "--pgo";
+    args[i++] = pgo_name;
+  }
   args[i++] = r->filename;
   args[i++] = NULL;
 
+  /* If so directed, let the build server run gosp2go. */
+  if (cconfig->build_server == 1) {
+    gosp_status_t gstatus;          /* Status of an internal Gosp call */
+
+    gstatus = compile_via_builder(r, args, go_cache);
+    if (gstatus != GOSP_STATUS_NEED_ACTION)
+      return gstatus;
+  }
+
   /* Spawn gosp2go and wait for it to complete. */
-  return launch_and_wait(r, args, FALSE);
+  return launch_and_wait(r, args, FALSE, FALSE);
 }
 
 /* Launch a Go Server Page process to handle the current page.  Return
@@ -176,6 +449,8 @@ gosp_status_t launch_gosp_server(request_rec *r, const char *plugin_name, const
 {
   const char **args;                /* Process command-line arguments */
   gosp_context_config_t *cconfig;   /* Context configuration */
+  const char *pgo_name = NULL;      /* File to which to write CPU profiles */
+  const char *history_name = NULL;  /* File in which to record times between requests */
   int i;
 
   /* Announce what we're about to do. */
@@ -187,24 +462,95 @@ gosp_status_t launch_gosp_server(request_rec *r, const char *plugin_name, const
   if (create_directories_for(r->server, r->pool, sock_name, 0) != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
 
+  /* Ensure we have a place to write CPU profiles if we intend to collect
+   * any. */
+  if (cconfig->profile_guided == 1) {
+    pgo_name = pgo_profile_name(r);
+    if (pgo_name == NULL)
+      return GOSP_STATUS_FAIL;
+    if (create_directories_for(r->server, r->pool, pgo_name, 0) != GOSP_STATUS_OK)
+      return GOSP_STATUS_FAIL;
+  }
+
+  /* Ensure we have a place to record the page's request history if we intend
+   * to adapt the idle timeout to it. */
+  if (cconfig->adaptive_idle != NULL) {
+    history_name = idle_history_name(r);
+    if (history_name == NULL)
+      return GOSP_STATUS_FAIL;
+    if (create_directories_for(r->server, r->pool, history_name, 0) != GOSP_STATUS_OK)
+      return GOSP_STATUS_FAIL;
+  }
+
   /* Construct the argument list. */
-  args = (const char **) apr_palloc(r->pool, 9*sizeof(char *));
+  args = (const char **) apr_palloc(r->pool, 28*sizeof(char *));
   i = 0;
   args[i++] = cconfig->gosp_server;
   args[i++] = "-plugin";
   args[i++] = plugin_name;
   args[i++] = "-socket";
   args[i++] = sock_name;
+  if (cconfig->shared_memory == 1) {
+    args[i++] = "-ring";
+    args[i++] = ring_file_name(r->pool, sock_name);
+  }
   if (cconfig->max_idle != NULL) {
     args[i++] = "-max-idle";
     args[i++] = cconfig->max_idle;
   }
+  if (cconfig->adaptive_idle != NULL) {
+    args[i++] = "-adaptive-idle";
+    args[i++] = cconfig->adaptive_idle;
+    args[i++] = "-idle-history";
+    args[i++] = history_name;
+  }
+  if (cconfig->coalesce == 1) {
+    args[i++] = "-coalesce";
+    if (cconfig->coalesce_vary != NULL) {
+      args[i++] = "-coalesce-vary";
+      args[i++] = cconfig->coalesce_vary;
+    }
+  }
+  if (cconfig->fragment_cache != NULL) {
+    args[i++] = "-fragment-cache";
+    args[i++] = cconfig->fragment_cache;
+  }
+  if (cconfig->profile_guided == 1) {
+    args[i++] = "-pgo-profile";
+    args[i++] = pgo_name;
+  }
+  if (cconfig->cgroup != NULL) {
+    args[i++] = "-cgroup";
+    args[i++] = page_cgroup_name(r);
+    if (cconfig->cpu_weight != NULL) {
+      args[i++] = "-cpu-weight";
+      args[i++] = cconfig->cpu_weight;
+    }
+    if (cconfig->memory_max != NULL) {
+      args[i++] = "-memory-max";
+      args[i++] = cconfig->memory_max;
+    }
+  }
+
+  /* If so directed, let a zygote launch (and optionally supervise) the Gosp
+   * server.  It reports errors itself, so we don't need a -dry-run launch.  A
+   * spare's Go runtime has already read its environment, so pages with Go
+   * runtime settings are launched directly and go unsupervised. */
+  if ((cconfig->zygote == 1 || cconfig->supervise == 1) && cconfig->go_max_procs == NULL
+      && cconfig->go_mem_limit == NULL && cconfig->go_gc == NULL) {
+    gosp_status_t gstatus;          /* Status of an internal Gosp call */
+
+    args[i] = NULL;
+    gstatus = launch_via_zygote(r, args);
+    if (gstatus != GOSP_STATUS_NEED_ACTION)
+      return gstatus;
+  }
   args[i++] = "-dry-run";  /* This is removed below. */
   args[i++] = NULL;
 
   /* Spawn gosp-server in the foreground with -dry-run.  This is so if it
    * fails we'll log a useful error message. */
-  if (launch_and_wait(r, args, FALSE) != GOSP_STATUS_OK)
+  if (launch_and_wait(r, args, FALSE, TRUE) != GOSP_STATUS_OK)
     return GOSP_STATUS_FAIL;
 
   /* Spawn gosp-server in the background without -dry-run.  If it fails, we'll
@@ -212,7 +558,7 @@ gosp_status_t launch_gosp_server(request_rec *r, const char *plugin_name, const
    * the foreground launch. */
   i -= 2;
   args[i++] = NULL;
-  return launch_and_wait(r, args, TRUE);
+  return launch_and_wait(r, args, TRUE, TRUE);
 }
 
 /* Kill a running Gosp server.  Return GOSP_STATUS_OK if the Gosp server is no
@@ -5,6 +5,7 @@
  *****************************************/
 
 #include "gosp.h"
+#include "apr_atomic.h"
 
 /* Forward-declare our module. */
 module AP_MODULE_DECLARE_DATA gosp_module;
@@ -18,6 +19,33 @@ const char *gosp_set_work_dir(cmd_parms *cmd, void *cfg, const char *arg)
   return NULL;
 }
 
+/* Assign the name of a file to which to append request traces. */
+const char *gosp_set_trace_log(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+  sconfig = ap_get_module_config(cmd->server->module_config, &gosp_module);
+  sconfig->trace_log_name = ap_server_root_relative(cmd->pool, arg);
+  return NULL;
+}
+
+/* Assign the name of a file to which to append sampled page requests and,
+ * optionally, the sampling interval. */
+const char *gosp_set_capture(cmd_parms *cmd, void *cfg, const char *fname, const char *every)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+  apr_int64_t n = 1;                /* Capture one request out of every n */
+
+  sconfig = ap_get_module_config(cmd->server->module_config, &gosp_module);
+  if (every != NULL) {
+    n = apr_atoi64(every);
+    if (n < 1 || n > APR_UINT32_MAX)
+      return "GospCaptureRequests requires a positive sampling interval";
+  }
+  sconfig->capture_name = ap_server_root_relative(cmd->pool, fname);
+  sconfig->capture_every = (apr_uint32_t) n;
+  return NULL;
+}
+
 /* Assign a value to the GOPATH environment variable. */
 const char *gosp_set_go_path(cmd_parms *cmd, void *cfg, const char *arg)
 {
@@ -63,6 +91,16 @@ const char *gosp_set_max_idle(cmd_parms *cmd, void *cfg, const char *arg)
   return NULL;
 }
 
+/* Assign the maximum idle time a Gosp server can adopt after observing how
+ * often its page is requested. */
+const char *gosp_set_adaptive_idle(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->adaptive_idle = arg;
+  return NULL;
+}
+
 /* Assign the maximum number of ?go:top blocks allowed on a single page. */
 const char *gosp_set_max_top(cmd_parms *cmd, void *cfg, const char *arg)
 {
@@ -81,6 +119,191 @@ const char *gosp_set_allowed_imports(cmd_parms *cmd, void *cfg, const char *arg)
   return NULL;
 }
 
+/* Specify whether identical concurrent GET requests should share a single
+ * page execution. */
+const char *gosp_set_coalesce(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->coalesce = flag;
+  return NULL;
+}
+
+/* Assign the set of request headers that distinguish coalesced requests. */
+const char *gosp_set_coalesce_vary(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->coalesce_vary = arg;
+  return NULL;
+}
+
+/* Assign the minimum page size to receive as a file descriptor rather than
+ * through the socket. */
+const char *gosp_set_body_fd_threshold(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->body_fd_threshold = arg;
+  return NULL;
+}
+
+/* Specify whether to exchange small pages with Gosp servers through shared
+ * memory. */
+const char *gosp_set_shared_memory(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->shared_memory = flag;
+  return NULL;
+}
+
+/* Specify whether to release the worker thread while waiting for the Gosp
+ * server to generate a page. */
+const char *gosp_set_async(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->async = flag;
+  return NULL;
+}
+
+/* Specify whether to report phase timings in a Server-Timing header. */
+const char *gosp_set_server_timing(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->server_timing = flag;
+  return NULL;
+}
+
+/* Specify whether to collect CPU profiles of pages in production and use them
+ * for profile-guided optimization when rebuilding the pages' plugins. */
+const char *gosp_set_profile_guided(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->profile_guided = flag;
+  return NULL;
+}
+
+/* Specify whether to launch Gosp servers from a zygote's pre-initialized
+ * processes. */
+const char *gosp_set_zygote(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->zygote = flag;
+  return NULL;
+}
+
+/* Specify whether to let a supervisor restart Gosp servers that crash or stop
+ * responding. */
+const char *gosp_set_supervise(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->supervise = flag;
+  return NULL;
+}
+
+/* Specify whether Gosp servers should compress page bodies for clients that
+ * accept compressed responses. */
+const char *gosp_set_compress(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->compress = flag;
+  return NULL;
+}
+
+/* Specify whether to compile pages using a shared build server. */
+const char *gosp_set_build_server(cmd_parms *cmd, void *cfg, int flag)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->build_server = flag;
+  return NULL;
+}
+
+/* Assign a value to the GOMAXPROCS environment variable. */
+const char *gosp_set_go_max_procs(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  if (apr_atoi64(arg) < 1)
+    return "GospGoMaxProcs requires a positive integer";
+  cconfig->go_max_procs = arg;
+  return NULL;
+}
+
+/* Assign a value to the GOMEMLIMIT environment variable. */
+const char *gosp_set_go_mem_limit(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->go_mem_limit = arg;
+  return NULL;
+}
+
+/* Assign a value to the GOGC environment variable. */
+const char *gosp_set_go_gc(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->go_gc = arg;
+  return NULL;
+}
+
+/* Assign the cgroup beneath which to place Gosp servers. */
+const char *gosp_set_cgroup(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  if (arg[0] != '/')
+    return "GospCgroup requires an absolute directory name";
+  cconfig->cgroup = arg;
+  return NULL;
+}
+
+/* Assign the capacity of each Gosp server's cache of go:cache fragments. */
+const char *gosp_set_fragment_cache(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  apr_int64_t size;                 /* Capacity as an integer */
+  char *end;                        /* First character following the integer */
+
+  cconfig = (gosp_context_config_t *) cfg;
+  size = apr_strtoi64(arg, &end, 10);
+  if (end == arg || *end != '\0' || size < 0)
+    return "GospFragmentCacheSize requires a nonnegative number of bytes";
+  cconfig->fragment_cache = arg;
+  return NULL;
+}
+
+/* Assign the CPU weight of each page's cgroup. */
+const char *gosp_set_cpu_weight(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  apr_int64_t weight;               /* Weight as an integer */
+
+  cconfig = (gosp_context_config_t *) cfg;
+  weight = apr_atoi64(arg);
+  if (weight < 1 || weight > 10000)
+    return "GospCgroupCPUWeight requires an integer from 1 to 10000";
+  cconfig->cpu_weight = arg;
+  return NULL;
+}
+
+/* Assign the memory limit of each page's cgroup. */
+const char *gosp_set_memory_max(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_context_config_t *cconfig;   /* Per-context configuration */
+  cconfig = (gosp_context_config_t *) cfg;
+  cconfig->memory_max = arg;
+  return NULL;
+}
+
 /* Append a Go module replacement rule to the existing set. */
 const char *gosp_add_mod_repl(cmd_parms *cmd, void *cfg, const char *pkgname, const char *pathname)
 {
@@ -95,6 +318,21 @@ const char *gosp_add_mod_repl(cmd_parms *cmd, void *cfg, const char *pkgname, co
   return NULL;
 }
 
+/* Append a URL path to the list of pages whose Gosp servers should be kept
+ * running. */
+const char *gosp_add_prewarm(cmd_parms *cmd, void *cfg, const char *arg)
+{
+  gosp_server_config_t *sconfig;    /* Server configuration */
+
+  sconfig = ap_get_module_config(cmd->server->module_config, &gosp_module);
+  if (arg[0] != '/')
+    return "GospPrewarm requires URL paths beginning with \"/\"";
+  if (sconfig->prewarm == NULL)
+    sconfig->prewarm = apr_array_make(cmd->pool, 4, sizeof(const char *));  /* Create on first use. */
+  APR_ARRAY_PUSH(sconfig->prewarm, const char *) = apr_pstrdup(cmd->pool, arg);
+  return NULL;
+}
+
 /* Map a user name to a user ID. */
 const char *gosp_set_user_id(cmd_parms *cmd, void *cfg, const char *arg)
 {
@@ -157,12 +395,56 @@ static const command_rec gosp_directives[] =
                  "gosp-server executable"),
    AP_INIT_TAKE1("GospMaxIdleTime", gosp_set_max_idle, NULL, RSRC_CONF|ACCESS_CONF,
                  "Maximum idle time before a Gosp server automatically exits"),
+   AP_INIT_TAKE1("GospAdaptiveIdleTime", gosp_set_adaptive_idle, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Maximum idle time a Gosp server can adopt based on how often its page is requested"),
    AP_INIT_TAKE1("GospMaxTop", gosp_set_max_top, NULL, RSRC_CONF|ACCESS_CONF,
                  "Maximum number of top-level blocks allowed per page"),
    AP_INIT_TAKE1("GospAllowedImports", gosp_set_allowed_imports, NULL, RSRC_CONF|ACCESS_CONF,
                  "Comma-separated list of packages that can be imported or \"ALL\" or \"NONE\""),
    AP_INIT_TAKE12("GospModReplace", gosp_add_mod_repl, NULL, RSRC_CONF|ACCESS_CONF,
                   "Module replacement to apply, which should be <module> <path> to add a replacement or just <module> to delete an existing replacement"),
+   AP_INIT_FLAG("GospCoalesceRequests", gosp_set_coalesce, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to let identical concurrent GET requests share a single page execution"),
+   AP_INIT_TAKE1("GospCoalesceVary", gosp_set_coalesce_vary, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Comma-separated list of request headers that distinguish coalesced requests"),
+   AP_INIT_TAKE1("GospBodyFDThreshold", gosp_set_body_fd_threshold, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Minimum page size in bytes to receive from the Gosp server as a file descriptor or 0 for never"),
+   AP_INIT_FLAG("GospSharedMemory", gosp_set_shared_memory, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to exchange page requests and responses with Gosp servers through shared memory"),
+   AP_INIT_FLAG("GospAsync", gosp_set_async, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to release the worker thread while waiting for a page under an asynchronous MPM"),
+   AP_INIT_FLAG("GospServerTiming", gosp_set_server_timing, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to report the time spent in each phase of a request in a Server-Timing header"),
+   AP_INIT_FLAG("GospProfileGuided", gosp_set_profile_guided, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to profile Gosp pages in production and apply profile-guided optimization when rebuilding them"),
+   AP_INIT_FLAG("GospZygote", gosp_set_zygote, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to launch Gosp servers from pre-initialized processes kept ready by a zygote"),
+   AP_INIT_FLAG("GospSupervise", gosp_set_supervise, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to let a supervisor restart Gosp servers that crash or stop responding"),
+   AP_INIT_FLAG("GospBuildServer", gosp_set_build_server, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to compile pages using a shared build server that limits and deduplicates concurrent compilations"),
+   AP_INIT_FLAG("GospCompress", gosp_set_compress, NULL, RSRC_CONF|ACCESS_CONF,
+                "On to have Gosp servers gzip-compress page bodies for clients that accept it"),
+   AP_INIT_TAKE1("GospFragmentCacheSize", gosp_set_fragment_cache, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Capacity in bytes of each Gosp server's cache of go:cache fragments, 0 to disable caching"),
+   AP_INIT_TAKE1("GospGoMaxProcs", gosp_set_go_max_procs, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Value of the GOMAXPROCS environment variable to use when running Gosp servers"),
+   AP_INIT_TAKE1("GospGoMemLimit", gosp_set_go_mem_limit, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Value of the GOMEMLIMIT environment variable to use when running Gosp servers"),
+   AP_INIT_TAKE1("GospGoGC", gosp_set_go_gc, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Value of the GOGC environment variable to use when running Gosp servers"),
+   AP_INIT_TAKE1("GospCgroup", gosp_set_cgroup, NULL, RSRC_CONF|ACCESS_CONF,
+                 "cgroup (v2) directory beneath which to give each Gosp server its own cgroup"),
+   AP_INIT_TAKE1("GospCgroupCPUWeight", gosp_set_cpu_weight, NULL, RSRC_CONF|ACCESS_CONF,
+                 "CPU weight (1-10000) to assign to each Gosp server's cgroup"),
+   AP_INIT_TAKE1("GospCgroupMemoryMax", gosp_set_memory_max, NULL, RSRC_CONF|ACCESS_CONF,
+                 "Memory limit in bytes, optionally with a K, M, or G suffix, to assign to each Gosp server's cgroup"),
+   AP_INIT_TAKE1("GospTraceLog", gosp_set_trace_log, NULL, RSRC_CONF,
+                 "File to which to append per-request traces in Trace Event Format"),
+   AP_INIT_TAKE12("GospCaptureRequests", gosp_set_capture, NULL, RSRC_CONF,
+                  "File to which to append page requests for replay by gosp-bench, optionally followed by N to capture only one request in N"),
+   AP_INIT_ITERATE("GospPrewarm", gosp_add_prewarm, NULL, RSRC_CONF,
+                   "URL paths of Gosp pages whose servers should be kept running"),
    AP_INIT_TAKE1("User", gosp_set_user_id, NULL, RSRC_CONF|ACCESS_CONF,
                  "The user under which the server will answer requests"),
    AP_INIT_TAKE1("Group", gosp_set_group_id, NULL, RSRC_CONF|ACCESS_CONF,
@@ -189,6 +471,15 @@ static void *gosp_allocate_context_config(apr_pool_t *p, char *ctx)
   cconfig->context = apr_pstrdup(p, ctx ? ctx : "[undefined context]");
   cconfig->go_cmd = DEFAULT_GO_COMMAND;
   cconfig->gosp_server = GOSP_SERVER;
+  cconfig->coalesce = -1;
+  cconfig->async = -1;
+  cconfig->server_timing = -1;
+  cconfig->profile_guided = -1;
+  cconfig->zygote = -1;
+  cconfig->supervise = -1;
+  cconfig->build_server = -1;
+  cconfig->compress = -1;
+  cconfig->shared_memory = -1;
   return (void *) cconfig;
 }
 
@@ -197,6 +488,11 @@ static void *gosp_allocate_context_config(apr_pool_t *p, char *ctx)
 #define MERGE_CHILD_OVER_PARENT(FIELD) \
   merged->FIELD = child->FIELD == NULL ? parent->FIELD : child->FIELD
 
+/* For use in gosp_merge_context_config(), assign a flag to the merged context
+ * from the child if specified, otherwise from the parent. */
+#define MERGE_CHILD_FLAG_OVER_PARENT(FIELD) \
+  merged->FIELD = child->FIELD == -1 ? parent->FIELD : child->FIELD
+
 /* Merge two per-context configurations into a new configuration. */
 static void *gosp_merge_context_config(apr_pool_t *p, void *base, void *delta) {
   gosp_context_config_t *parent = (gosp_context_config_t *)base;
@@ -210,8 +506,27 @@ static void *gosp_merge_context_config(apr_pool_t *p, void *base, void *delta) {
   MERGE_CHILD_OVER_PARENT(go_cmd);
   MERGE_CHILD_OVER_PARENT(gosp_server);
   MERGE_CHILD_OVER_PARENT(max_idle);
+  MERGE_CHILD_OVER_PARENT(adaptive_idle);
   MERGE_CHILD_OVER_PARENT(max_top);
   MERGE_CHILD_OVER_PARENT(go_mod_cache);
+  MERGE_CHILD_FLAG_OVER_PARENT(coalesce);
+  MERGE_CHILD_OVER_PARENT(coalesce_vary);
+  MERGE_CHILD_OVER_PARENT(body_fd_threshold);
+  MERGE_CHILD_FLAG_OVER_PARENT(async);
+  MERGE_CHILD_FLAG_OVER_PARENT(server_timing);
+  MERGE_CHILD_FLAG_OVER_PARENT(profile_guided);
+  MERGE_CHILD_FLAG_OVER_PARENT(zygote);
+  MERGE_CHILD_FLAG_OVER_PARENT(supervise);
+  MERGE_CHILD_OVER_PARENT(go_max_procs);
+  MERGE_CHILD_OVER_PARENT(go_mem_limit);
+  MERGE_CHILD_OVER_PARENT(go_gc);
+  MERGE_CHILD_OVER_PARENT(cgroup);
+  MERGE_CHILD_OVER_PARENT(cpu_weight);
+  MERGE_CHILD_OVER_PARENT(memory_max);
+  MERGE_CHILD_FLAG_OVER_PARENT(build_server);
+  MERGE_CHILD_FLAG_OVER_PARENT(compress);
+  MERGE_CHILD_OVER_PARENT(fragment_cache);
+  MERGE_CHILD_FLAG_OVER_PARENT(shared_memory);
 
   /* Merge module replacements by overwriting parent values with child
    * values. */
@@ -258,6 +573,79 @@ static void *gosp_merge_context_config(apr_pool_t *p, void *base, void *delta) {
   return merged;
 }
 
+/* Open each server's request-capture file, if any.  Because captured requests
+ * can include cookies, credentials, and form data, the file is made readable
+ * and writable only by its owner. */
+static gosp_status_t open_capture_files(server_rec *s, apr_pool_t *pconf)
+{
+  gosp_server_config_t *sconfig;      /* Server configuration */
+  apr_status_t status;                /* Status of an APR call */
+
+  for (; s != NULL; s = s->next) {
+    sconfig = ap_get_module_config(s->module_config, &gosp_module);
+    if (sconfig->capture_name == NULL)
+      continue;
+    status = apr_file_open(&sconfig->capture_file, sconfig->capture_name,
+                           APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_APPEND,
+                           GOSP_PRIVATE_FILE_PERMS, pconf);
+    if (status != APR_SUCCESS)
+      REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                          "Failed to open request-capture file %s", sconfig->capture_name);
+
+    /* Tighten the permissions of a capture file that already existed. */
+    status = apr_file_perms_set(sconfig->capture_name, GOSP_PRIVATE_FILE_PERMS);
+    if (status != APR_SUCCESS && !APR_STATUS_IS_ENOTIMPL(status))
+      REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                          "Failed to restrict access to request-capture file %s",
+                          sconfig->capture_name);
+  }
+  return GOSP_STATUS_OK;
+}
+
+/* Process ID of the Apache parent process */
+static pid_t gosp_parent_pid = 0;
+
+/* Return the gosp-server executable that a server's supervisor should run, or
+ * NULL if the server's default context doesn't call for a supervisor. */
+static const char *supervised_gosp_server(server_rec *s)
+{
+  gosp_context_config_t *cconfig;   /* Server's default context configuration */
+
+  cconfig = (gosp_context_config_t *) ap_get_module_config(s->lookup_defaults, &gosp_module);
+  if (cconfig == NULL || cconfig->supervise != 1)
+    return NULL;
+  return cconfig->gosp_server;
+}
+
+/* Ask every server's supervisor to stop all of its Gosp servers and exit.
+ * This runs in the Apache parent process when the configuration pool is
+ * cleared, i.e., on a restart or shutdown. */
+static apr_status_t stop_supervisors(void *data)
+{
+  server_rec *s;              /* Server whose supervisor to stop */
+  apr_pool_t *pool;           /* Pool from which to allocate temporary storage */
+  const char *gosp_server;    /* gosp-server executable the supervisor runs */
+  const char *zygote_name;    /* Socket on which the supervisor listens */
+
+  if (getpid() != gosp_parent_pid)
+    return APR_SUCCESS;
+  if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+    return APR_SUCCESS;
+  for (s = (server_rec *) data; s != NULL; s = s->next) {
+    gosp_server = supervised_gosp_server(s);
+    if (gosp_server == NULL)
+      continue;
+    zygote_name = zygote_socket_name(s, pool, gosp_server, 1);
+    if (zygote_name == NULL)
+      continue;
+    if (notify_zygote(s, pool, zygote_name, "{\"Shutdown\": true}\n") == GOSP_STATUS_OK)
+      ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, s,
+                   "Stopped the supervisor listening on socket %s", zygote_name);
+  }
+  apr_pool_destroy(pool);
+  return APR_SUCCESS;
+}
+
 /* Run after the configuration file has been processed but before lowering
  * privileges. */
 static int gosp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
@@ -273,6 +661,11 @@ static int gosp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
   if (create_directories_for(s, ptemp, sconfig->work_dir, 1) != GOSP_STATUS_OK)
     return HTTP_INTERNAL_SERVER_ERROR;
 
+  /* Stop all supervised Gosp servers when Apache restarts or shuts down.  New
+   * supervisors are launched as child processes start. */
+  gosp_parent_pid = getpid();
+  apr_pool_cleanup_register(pconf, s, stop_supervisors, apr_pool_cleanup_null);
+
   /* Create a global lock.  Store the mutex structure and name of the
    * underlying file in our configuration structure. */
   sconfig->lock_name = concatenate_filepaths(s, pconf, sconfig->work_dir,
@@ -295,6 +688,33 @@ static int gosp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     REPORT_SERVER_ERROR(HTTP_INTERNAL_SERVER_ERROR, APLOG_ERR, status,
                         "Failed to set permissions on lock file %s", sconfig->lock_name);
 #endif
+
+  /* Create a scoreboard in which to record statistics. */
+  if (scoreboard_create(s, pconf) != GOSP_STATUS_OK)
+    return HTTP_INTERNAL_SERVER_ERROR;
+
+  /* Open each server's request-capture file, if any. */
+  if (open_capture_files(s, pconf) != GOSP_STATUS_OK)
+    return HTTP_INTERNAL_SERVER_ERROR;
+
+  /* Open each server's trace log, if any.  Start a new log with "[" so it
+   * can be loaded by trace viewers. */
+  for (; s != NULL; s = s->next) {
+    apr_finfo_t finfo;                /* Information about the trace log */
+
+    sconfig = ap_get_module_config(s->module_config, &gosp_module);
+    if (sconfig->trace_log_name == NULL)
+      continue;
+    status = apr_file_open(&sconfig->trace_log, sconfig->trace_log_name,
+                           APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_APPEND,
+                           GOSP_FILE_PERMS, pconf);
+    if (status != APR_SUCCESS)
+      REPORT_SERVER_ERROR(HTTP_INTERNAL_SERVER_ERROR, APLOG_ERR, status,
+                          "Failed to open trace log %s", sconfig->trace_log_name);
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, sconfig->trace_log);
+    if (status == APR_SUCCESS && finfo.size == 0)
+      (void) apr_file_puts("[\n", sconfig->trace_log);
+  }
   return OK;
 }
 
@@ -310,17 +730,107 @@ static void gosp_child_init(apr_pool_t *pool, server_rec *s)
   if (status != APR_SUCCESS)
     ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
                  "Failed to reconnect to lock file %s", sconfig->lock_name);
+
+  /* Prepare to map Gosp servers' shared-memory rings. */
+  ring_child_init(pool);
+
+  /* Ensure that each server that calls for one has a running supervisor so
+   * Gosp servers are supervised from the first request onward. */
+  for (; s != NULL; s = s->next) {
+    const char *gosp_server;        /* gosp-server executable the supervisor runs */
+    const char *zygote_name;        /* Socket on which the supervisor listens */
+
+    gosp_server = supervised_gosp_server(s);
+    if (gosp_server == NULL)
+      continue;
+    zygote_name = zygote_socket_name(s, pool, gosp_server, 1);
+    if (zygote_name == NULL)
+      continue;
+    if (notify_zygote(s, pool, zygote_name, NULL) == GOSP_STATUS_NEED_ACTION)
+      (void) launch_supervisor(s, pool, gosp_server);
+  }
+}
+
+/* Return the name of the socket on which the Gosp server for the requested
+ * page listens, or NULL on error. */
+static char *page_socket_name(request_rec *r)
+{
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  char *sock_name;                 /* Name of the socket */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  sock_name = concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "sockets", r->filename, NULL);
+  if (sock_name == NULL)
+    return NULL;
+  return apr_pstrcat(r->pool, sock_name, ".sock", NULL);
+}
+
+/* Return the name of the plugin compiled from the requested page, or NULL on
+ * error. */
+static char *page_plugin_name(request_rec *r)
+{
+  gosp_server_config_t *sconfig;   /* Server configuration */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  return concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "pages",
+                               apr_pstrcat(r->pool, r->filename, ".so", NULL),
+                               NULL);
+}
+
+/* Return the name of the static file to which gosp2go prerenders the
+ * requested page if the page contains no Go code, or NULL on error. */
+static char *page_static_name(request_rec *r)
+{
+  gosp_server_config_t *sconfig;   /* Server configuration */
+
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  return concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "pages",
+                               apr_pstrcat(r->pool, r->filename, ".static", NULL),
+                               NULL);
+}
+
+/* Return 1 if the requested page was prerendered to a static file that is at
+ * least as new as the page, 0 if not, or -1 on error. */
+static int have_static_page(request_rec *r, const char *static_name)
+{
+  apr_finfo_t finfo;       /* File information for the static file */
+  apr_status_t status;     /* Status of an APR call */
+
+  status = apr_stat(&finfo, static_name, APR_FINFO_MTIME, r->pool);
+  if (APR_STATUS_IS_ENOENT(status))
+    return 0;
+  if (status != APR_SUCCESS)
+    return -1;
+  switch (is_newer_than(r, r->filename, static_name)) {
+    case 0:
+      return 1;
+    case 1:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/* Serve a prerendered page directly, without involving a Gosp server.  The
+ * page retains the MIME type Apache assigned to the Gosp file, just as a page
+ * served by a Gosp server does when it doesn't specify one. */
+static int serve_static_page(request_rec *r, const char *static_name)
+{
+  if (send_static_file(r, static_name) != GOSP_STATUS_OK)
+    return HTTP_INTERNAL_SERVER_ERROR;
+  return r->status == HTTP_OK ? OK : r->status;
 }
 
 /* This function is called if the Gosp file is newer than the Gosp plugin.  It
  * kills the Gosp server, compiles the plugin if necessary, launches the Gosp
  * server, and retries serving the requested page. */
 static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
-                                 const char *plugin_name)
+                                 const char *plugin_name, const char *static_name)
 {
-  apr_time_t begin_time;   /* Time at which we began waiting for the server to launch */
+  apr_time_t begin_time;   /* Time at which we began waiting for the server to launch or compile */
   apr_finfo_t finfo;       /* File information for the plugin */
   int plugin_exists;       /* Boolean indicating if the plugin exists */
+  int launched = FALSE;    /* Boolean indicating if we launched the server */
   gosp_status_t gstatus;   /* Status of an internal Gosp call */
   apr_status_t status;     /* Status of an APR call */
 
@@ -329,6 +839,14 @@ static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
   if (acquire_global_lock(r->server) != GOSP_STATUS_OK)
     return HTTP_INTERNAL_SERVER_ERROR;
 
+  /* Another process may have prerendered the page while we were waiting for
+   * the lock. */
+  if (have_static_page(r, static_name) == 1) {
+    if (release_global_lock(r->server) != GOSP_STATUS_OK)
+      return HTTP_INTERNAL_SERVER_ERROR;
+    return serve_static_page(r, static_name);
+  }
+
   /* Determine if the plugin exists. */
   status = apr_stat(&finfo, plugin_name, 0, r->pool);
   if (APR_STATUS_IS_ENOENT(status))
@@ -351,13 +869,25 @@ static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
       (void) release_global_lock(r->server);
       return HTTP_INTERNAL_SERVER_ERROR;
     }
+    scoreboard_note_kill(r);
 
     /* Compile the Gosp plugin. */
-    gstatus = compile_gosp_server(r, plugin_name);
+    begin_time = apr_time_now();
+    gstatus = compile_gosp_server(r, plugin_name, static_name);
+    scoreboard_note_compile(r, apr_time_now() - begin_time, gstatus == GOSP_STATUS_OK);
     if (gstatus != GOSP_STATUS_OK) {
-      (void) release_global_lock(r->server);
+      if (gstatus != GOSP_STATUS_LOCK_LOST)
+        (void) release_global_lock(r->server);
       return HTTP_INTERNAL_SERVER_ERROR;
     }
+
+    /* If the page contains no Go code, gosp2go prerendered it instead of
+     * building a plugin.  Serve it without launching a Gosp server. */
+    if (have_static_page(r, static_name) == 1) {
+      if (release_global_lock(r->server) != GOSP_STATUS_OK)
+        return HTTP_INTERNAL_SERVER_ERROR;
+      return serve_static_page(r, static_name);
+    }
   }
 
   /* At this point, the Gosp plugin exists.  The server may or may not be
@@ -372,6 +902,8 @@ static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
       (void) release_global_lock(r->server);
       return HTTP_INTERNAL_SERVER_ERROR;
     }
+    scoreboard_note_launch(r);
+    launched = TRUE;
   }
 
   /* The plugin exists and is being run by a live gosp-server process.  Try
@@ -393,6 +925,10 @@ static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
     apr_sleep(100000);
   }
 
+  /* If we launched the server, record its process ID for gosp-status. */
+  if (launched)
+    (void) server_is_responsive(r, sock_name);
+
   /* Release the lock and return. */
   gstatus = release_global_lock(r->server);
   if (gstatus != GOSP_STATUS_OK)
@@ -400,22 +936,20 @@ static int rebuild_relaunch_retry(request_rec *r, const char *sock_name,
   return r->status == HTTP_OK ? OK : r->status;
 }
 
-/* Handle requests of type "gosp" by passing them to the gosp2go tool. */
-static int gosp_handler(request_rec *r)
+/* Serve a Gosp page by passing the request to its Gosp server, compiling the
+ * page and launching the server as necessary. */
+static int serve_gosp_page(request_rec *r)
 {
   apr_finfo_t finfo;               /* File information for the requested file */
   char *sock_name;                 /* Name of the socket on which the Gosp server is listening */
   char *plugin_name;               /* Name of the plugin for the requested file */
-  gosp_server_config_t *sconfig;   /* Server configuration */
+  char *static_name;               /* Name of the prerendered form of the requested file */
+  gosp_context_config_t *cconfig;  /* Context configuration */
   apr_status_t status;             /* Status of an APR call */
   gosp_status_t gstatus;           /* Status of an internal Gosp call */
-
-  /* We care only about "gosp" requests, and we don't care about HEAD
-   * requests. */
-  if (strcmp(r->handler, "gosp"))
-    return DECLINED;
-  if (r->header_only)
-    return DECLINED;
+  int is_async = 0;                /* 1=MPM can resume suspended requests; 0=it can't */
+  int is_newer;                    /* Result of checking if the page is newer than its plugin */
+  int is_static;                   /* Result of checking if the page was prerendered */
 
   /* Issue an HTTP File Not Found (404) error if the requested Gosp file
    * doesn't exist. */
@@ -425,46 +959,380 @@ static int gosp_handler(request_rec *r)
                          "Failed to query Gosp page %s", r->filename);
 
   /* Gain access to our configuration information. */
-  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  cconfig = ap_get_module_config(r->per_dir_config, &gosp_module);
 
   /* Identify the name of the socket to use to communicate with the Gosp
    * server. */
-  sock_name = concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "sockets", r->filename, NULL);
+  sock_name = page_socket_name(r);
   if (sock_name == NULL)
     REPORT_REQUEST_ERROR(HTTP_INTERNAL_SERVER_ERROR, APLOG_ERR, APR_SUCCESS,
                          "Failed to construct a socket name");
-  sock_name = apr_pstrcat(r->pool, sock_name, ".sock", NULL);
 
   /* Identify the name of the Gosp plugin. */
-  plugin_name = concatenate_filepaths(r->server, r->pool, sconfig->work_dir, "pages",
-                                      apr_pstrcat(r->pool, r->filename, ".so", NULL),
-                                      NULL);
+  plugin_name = page_plugin_name(r);
   if (plugin_name == NULL)
     REPORT_REQUEST_ERROR(HTTP_INTERNAL_SERVER_ERROR, APLOG_ERR, APR_SUCCESS,
                          "Failed to construct the name of the Gosp plugin");
+  static_name = page_static_name(r);
+  if (static_name == NULL)
+    REPORT_REQUEST_ERROR(HTTP_INTERNAL_SERVER_ERROR, APLOG_ERR, APR_SUCCESS,
+                         "Failed to construct the name of the prerendered page");
 
-  /* If the Gosp plugin is newer than the Gosp file (the common case) we simply
-   * handle the request and return. */
-  if (is_newer_than(r, r->filename, plugin_name) == 0) {
-    gstatus = simple_request_response(r, sock_name);
-    if (gstatus == GOSP_STATUS_OK)
-      return r->status == HTTP_OK ? OK : r->status;
-    if (gstatus == GOSP_STATUS_FAIL)
-      return HTTP_INTERNAL_SERVER_ERROR;
+  /* If the page contains no Go code and was prerendered, serve the result
+   * directly.  Otherwise, if the Gosp plugin is newer than the Gosp file (the
+   * common case) we simply handle the request and return. */
+  scoreboard_phase_begin(r);
+  is_static = have_static_page(r, static_name);
+  is_newer = is_static == 1 ? 0 : is_newer_than(r, r->filename, plugin_name);
+  scoreboard_phase_end(r, GOSP_PHASE_CHECK);
+  if (is_static == 1)
+    return serve_static_page(r, static_name);
+  if (is_newer == 0) {
+    /* If requested and supported, release the worker thread while the Gosp
+     * server generates the page. */
+    if (cconfig->async == 1)
+      if (ap_mpm_query(AP_MPMQ_IS_ASYNC, &is_async) != APR_SUCCESS)
+        is_async = 0;
+    if (is_async) {
+      gstatus = async_request_response(r, sock_name);
+      if (gstatus == GOSP_STATUS_OK)
+        return SUSPENDED;
+      if (gstatus == GOSP_STATUS_FAIL)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else {
+      gstatus = simple_request_response(r, sock_name);
+      if (gstatus == GOSP_STATUS_OK)
+        return r->status == HTTP_OK ? OK : r->status;
+      if (gstatus == GOSP_STATUS_FAIL)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
   }
 
   /* The Gosp file is newer than the Gosp plugin *or* the request failed for
    * some other reason.  Recompile the plugin if necessary, kill the old
    * server, relaunch it, and retry the request. */
-  return rebuild_relaunch_retry(r, sock_name, plugin_name);
+  return rebuild_relaunch_retry(r, sock_name, plugin_name, static_name);
+}
+
+/* Handle requests of type "gosp" by passing them to a Gosp server. */
+static int gosp_handler(request_rec *r)
+{
+  int http_status;                 /* Status to return to Apache */
+
+  /* We care only about "gosp" requests, and we don't care about HEAD
+   * requests. */
+  if (strcmp(r->handler, "gosp"))
+    return DECLINED;
+  if (r->header_only)
+    return DECLINED;
+
+  /* Serve the page, recording statistics in the scoreboard.  Suspended
+   * requests are recorded when they complete. */
+  scoreboard_begin_request(r);
+  http_status = serve_gosp_page(r);
+  if (http_status != SUSPENDED)
+    scoreboard_end_request(r, http_status);
+  return http_status;
+}
+
+/* Ensure the Gosp server for a pre-warmed page is running, compiling the page
+ * first if necessary. */
+static void prewarm_page(request_rec *r)
+{
+  char *sock_name;                 /* Name of the socket on which the Gosp server is listening */
+  char *plugin_name;               /* Name of the plugin for the requested file */
+  char *static_name;               /* Name of the prerendered form of the requested file */
+  apr_finfo_t finfo;               /* File information for the page or its plugin */
+  apr_time_t begin_time;           /* Time at which we began compiling */
+  gosp_status_t gstatus;           /* Status of an internal Gosp call */
+
+  /* Do nothing if the page's Gosp server is already running or the page was
+   * prerendered and therefore needs no Gosp server. */
+  sock_name = page_socket_name(r);
+  plugin_name = page_plugin_name(r);
+  static_name = page_static_name(r);
+  if (sock_name == NULL || plugin_name == NULL || static_name == NULL)
+    return;
+  if (server_is_responsive(r, sock_name) == GOSP_STATUS_OK)
+    return;
+  if (apr_stat(&finfo, r->filename, 0, r->pool) != APR_SUCCESS)
+    return;
+  if (have_static_page(r, static_name) != 0)
+    return;
+
+  /* Compile the page if necessary then launch its Gosp server.  Check again
+   * once we hold the lock in case another process got there first. */
+  if (acquire_global_lock(r->server) != GOSP_STATUS_OK)
+    return;
+  if (server_is_responsive(r, sock_name) != GOSP_STATUS_OK) {
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_INFO, APR_SUCCESS, r,
+                  "Pre-warming %s", r->filename);
+    gstatus = GOSP_STATUS_OK;
+    if (apr_stat(&finfo, plugin_name, 0, r->pool) != APR_SUCCESS
+        || is_newer_than(r, r->filename, plugin_name) == 1) {
+      begin_time = apr_time_now();
+      gstatus = compile_gosp_server(r, plugin_name, static_name);
+      scoreboard_note_compile(r, apr_time_now() - begin_time, gstatus == GOSP_STATUS_OK);
+    }
+    if (gstatus == GOSP_STATUS_OK
+        && have_static_page(r, static_name) == 0
+        && launch_gosp_server(r, plugin_name, sock_name) == GOSP_STATUS_OK)
+      scoreboard_note_launch(r);
+    if (gstatus == GOSP_STATUS_LOCK_LOST)
+      return;
+  }
+  (void) release_global_lock(r->server);
+}
+
+/* Define a page for the pre-warming thread to pre-warm. */
+typedef struct {
+  server_rec *server;              /* Server to which the page belongs */
+  const char *uri;                 /* URL path that maps to the page */
+  const char *filename;            /* Local filename of the Gosp page */
+  gosp_context_config_t *cconfig;  /* Copy of the page's context configuration */
+} prewarm_job_t;
+
+#if APR_HAS_THREADS
+/* Define the state shared by request threads and a process's pre-warming
+ * thread. */
+static struct {
+  apr_thread_t *thread;            /* Thread that pre-warms pages or NULL if none */
+  apr_thread_mutex_t *mutex;       /* Lock protecting all of the following */
+  apr_thread_cond_t *cond;         /* Condition signaled when jobs arrive or the thread should stop */
+  apr_pool_t *pool;                /* Pool from which the pending jobs were allocated */
+  apr_array_header_t *jobs;        /* Pages awaiting pre-warming or NULL if none */
+  int busy;                        /* 1=the thread is pre-warming pages; 0=it's idle */
+  volatile int stopping;           /* 1=the thread should exit; 0=it shouldn't */
+} prewarmer;
+#endif
+
+/* Copy a page's context configuration into a pool that outlives the request.
+ * Fields computed when merging configurations were allocated from the request
+ * pool, so those are copied, too.  The rest point into the configuration
+ * pool. */
+static gosp_context_config_t *copy_context_config(apr_pool_t *pool,
+                                                  const gosp_context_config_t *cconfig)
+{
+  gosp_context_config_t *copy;     /* Copy of cconfig */
+
+  copy = apr_pmemdup(pool, cconfig, sizeof(gosp_context_config_t));
+  copy->context = apr_pstrdup(pool, cconfig->context);
+  copy->allowed_imports = apr_pstrdup(pool, cconfig->allowed_imports);
+  copy->go_path = apr_pstrdup(pool, cconfig->go_path);
+  if (cconfig->mod_repls != NULL)
+    copy->mod_repls = apr_hash_copy(pool, cconfig->mod_repls);
+  return copy;
+}
+
+/* Construct a minimal request for pre-warming a page outside of any client
+ * request.  It carries only what compiling a page and launching its Gosp
+ * server require. */
+static request_rec *make_prewarm_request(apr_pool_t *pool, const prewarm_job_t *job)
+{
+  conn_rec *c;                     /* Stand-in connection */
+  request_rec *r;                  /* Stand-in request */
+
+  c = apr_pcalloc(pool, sizeof(conn_rec));
+  c->pool = pool;
+  c->base_server = job->server;
+  c->client_ip = "127.0.0.1";
+  c->local_ip = "127.0.0.1";
+  c->notes = apr_table_make(pool, 1);
+  c->conn_config = ap_create_conn_config(pool);
+  r = apr_pcalloc(pool, sizeof(request_rec));
+  r->pool = pool;
+  r->connection = c;
+  r->server = job->server;
+  r->uri = apr_pstrdup(pool, job->uri);
+  r->filename = apr_pstrdup(pool, job->filename);
+  r->status = HTTP_OK;
+  r->useragent_ip = c->client_ip;
+  r->headers_in = apr_table_make(pool, 1);
+  r->headers_out = apr_table_make(pool, 1);
+  r->err_headers_out = apr_table_make(pool, 1);
+  r->subprocess_env = apr_table_make(pool, 1);
+  r->notes = apr_table_make(pool, 1);
+  r->request_config = ap_create_request_config(pool);
+  r->per_dir_config = ap_create_per_dir_config(pool);
+  ap_set_module_config(r->per_dir_config, &gosp_module, job->cconfig);
+  return r;
+}
+
+#if APR_HAS_THREADS
+/* Pre-warm pages handed over by gosp_prewarm until told to stop. */
+static void * APR_THREAD_FUNC prewarm_thread(apr_thread_t *thread, void *data)
+{
+  apr_pool_t *pool;                /* Pool holding the jobs being processed */
+  apr_array_header_t *jobs;        /* Jobs being processed */
+  int i;
+
+  apr_thread_mutex_lock(prewarmer.mutex);
+  while (!prewarmer.stopping) {
+    /* Wait for work. */
+    if (prewarmer.jobs == NULL) {
+      apr_thread_cond_wait(prewarmer.cond, prewarmer.mutex);
+      continue;
+    }
+    pool = prewarmer.pool;
+    jobs = prewarmer.jobs;
+    prewarmer.pool = NULL;
+    prewarmer.jobs = NULL;
+    prewarmer.busy = 1;
+    apr_thread_mutex_unlock(prewarmer.mutex);
+
+    /* Pre-warm each page in turn, stopping early if the process is
+     * exiting. */
+    for (i = 0; i < jobs->nelts && !prewarmer.stopping; i++)
+      prewarm_page(make_prewarm_request(pool, &APR_ARRAY_IDX(jobs, i, prewarm_job_t)));
+    apr_pool_destroy(pool);
+
+    apr_thread_mutex_lock(prewarmer.mutex);
+    prewarmer.busy = 0;
+  }
+  apr_thread_mutex_unlock(prewarmer.mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+/* Stop the pre-warming thread when the process exits. */
+static apr_status_t stop_prewarmer(void *data)
+{
+  apr_status_t thread_status;      /* Exit status of the pre-warming thread */
+
+  apr_thread_mutex_lock(prewarmer.mutex);
+  prewarmer.stopping = 1;
+  apr_thread_cond_signal(prewarmer.cond);
+  apr_thread_mutex_unlock(prewarmer.mutex);
+  (void) apr_thread_join(&thread_status, prewarmer.thread);
+  if (prewarmer.pool != NULL)
+    apr_pool_destroy(prewarmer.pool);
+  prewarmer.thread = NULL;
+  return APR_SUCCESS;
+}
+
+/* Hand a set of pages to the pre-warming thread.  Return GOSP_STATUS_OK if the
+ * thread took ownership of the pool holding them or GOSP_STATUS_NEED_ACTION
+ * if the thread is still busy with earlier pages. */
+static gosp_status_t queue_prewarm_jobs(apr_pool_t *pool, apr_array_header_t *jobs)
+{
+  gosp_status_t gstatus = GOSP_STATUS_NEED_ACTION;  /* Status to return */
+
+  apr_thread_mutex_lock(prewarmer.mutex);
+  if (prewarmer.jobs == NULL && !prewarmer.busy && !prewarmer.stopping) {
+    prewarmer.pool = pool;
+    prewarmer.jobs = jobs;
+    apr_thread_cond_signal(prewarmer.cond);
+    gstatus = GOSP_STATUS_OK;
+  }
+  apr_thread_mutex_unlock(prewarmer.mutex);
+  return gstatus;
+}
+#endif
+
+/* If any server lists pages to pre-warm, start a thread in each child process
+ * that compiles those pages and launches their Gosp servers so that this work
+ * never delays a client request. */
+static void gosp_start_prewarmer(apr_pool_t *pool, server_rec *s)
+{
+#if APR_HAS_THREADS
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  apr_status_t status;             /* Status of an APR call */
+
+  for (; s != NULL; s = s->next) {
+    sconfig = ap_get_module_config(s->module_config, &gosp_module);
+    if (sconfig->prewarm != NULL)
+      break;
+  }
+  if (s == NULL)
+    return;
+  status = apr_thread_mutex_create(&prewarmer.mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+  if (status == APR_SUCCESS)
+    status = apr_thread_cond_create(&prewarmer.cond, pool);
+  if (status == APR_SUCCESS)
+    status = apr_thread_create(&prewarmer.thread, NULL, prewarm_thread, NULL, pool);
+  if (status != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                 "Failed to start a thread for pre-warming Gosp pages");
+    prewarmer.thread = NULL;
+    return;
+  }
+  apr_pool_cleanup_register(pool, NULL, stop_prewarmer, apr_pool_cleanup_null);
+#endif
+}
+
+/* After a request has been logged, occasionally ensure that the Gosp servers
+ * for every page listed by GospPrewarm are running so requests for those
+ * pages never wait for a compilation or launch.  Only the mapping of URL
+ * paths to pages happens here.  The pre-warming thread does the rest. */
+static int gosp_prewarm(request_rec *r)
+{
+  static volatile apr_uint32_t next_check = 0;  /* Time in seconds at which this process should next check */
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  apr_uint32_t now;                /* Current time in seconds */
+  apr_uint32_t next;               /* Value of next_check we observed */
+  request_rec *sub;                /* Subrequest mapping a URL path to a Gosp page */
+  apr_pool_t *pool;                /* Pool that outlives the request, for the jobs */
+  apr_array_header_t *jobs;        /* Pages to pre-warm */
+  prewarm_job_t *job;              /* A single page to pre-warm */
+  int i;
+
+  /* Return quickly if there's nothing to do. */
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  if (sconfig->prewarm == NULL)
+    return DECLINED;
+  now = (apr_uint32_t) apr_time_sec(apr_time_now());
+  next = apr_atomic_read32(&next_check);
+  if (now < next)
+    return DECLINED;
+  if (apr_atomic_cas32(&next_check, now + apr_time_sec(GOSP_PREWARM_INTERVAL), next) != next)
+    return DECLINED;  /* Another thread is checking. */
+  /* Map each URL path to a file and note those that are Gosp pages. */
+  if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+    return DECLINED;
+  jobs = apr_array_make(pool, sconfig->prewarm->nelts, sizeof(prewarm_job_t));
+  for (i = 0; i < sconfig->prewarm->nelts; i++) {
+    const char *uri = APR_ARRAY_IDX(sconfig->prewarm, i, const char *);
+
+    sub = ap_sub_req_lookup_uri(uri, r, NULL);
+    if (sub->status == HTTP_OK && sub->handler != NULL
+        && strcmp(sub->handler, "gosp") == 0 && sub->filename != NULL) {
+      job = (prewarm_job_t *) apr_array_push(jobs);
+      job->server = sub->server;
+      job->uri = apr_pstrdup(pool, uri);
+      job->filename = apr_pstrdup(pool, sub->filename);
+      job->cconfig = copy_context_config(pool, ap_get_module_config(sub->per_dir_config, &gosp_module));
+    }
+    ap_destroy_sub_req(sub);
+  }
+
+  /* Let the pre-warming thread compile pages and launch servers.  If it's
+   * still busy, skip this round.  Lacking a thread, do the work here, after
+   * the response has been sent. */
+#if APR_HAS_THREADS
+  if (prewarmer.thread != NULL) {
+    if (jobs->nelts == 0 || queue_prewarm_jobs(pool, jobs) != GOSP_STATUS_OK)
+      apr_pool_destroy(pool);
+    return DECLINED;
+  }
+#endif
+  for (i = 0; i < jobs->nelts; i++)
+    prewarm_page(make_prewarm_request(pool, &APR_ARRAY_IDX(jobs, i, prewarm_job_t)));
+  apr_pool_destroy(pool);
+  return DECLINED;
 }
 
-/* Invoke gosp_handler at the end of every request. */
+/* Register our hooks: gosp_handler at the end of every request,
+ * gosp_status_handler for status reports, gosp_prewarm after each request is
+ * logged, and gosp_start_prewarmer as each child process starts. */
 static void gosp_register_hooks(apr_pool_t *p)
 {
   ap_hook_post_config(gosp_post_config, NULL, NULL, APR_HOOK_LAST);
   ap_hook_child_init(gosp_child_init, NULL, NULL, APR_HOOK_LAST);
+  ap_hook_child_init(gosp_start_prewarmer, NULL, NULL, APR_HOOK_LAST);
   ap_hook_handler(gosp_handler, NULL, NULL, APR_HOOK_LAST);
+  ap_hook_handler(gosp_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+  ap_hook_log_transaction(gosp_prewarm, NULL, NULL, APR_HOOK_LAST);
 }
 
 /* Dispatch list for API hooks */
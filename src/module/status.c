@@ -0,0 +1,590 @@
+/*****************************************
+ * Maintain and report Gosp statistics   *
+ *                                       *
+ * By Scott Pakin <scott+gosp@pakin.org> *
+ *****************************************/
+
+#include "gosp.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+
+/* Define the number of pages for which we can maintain statistics. */
+#ifndef GOSP_STATUS_MAX_PAGES
+# define GOSP_STATUS_MAX_PAGES 256
+#endif
+
+/* Define the maximum number of bytes of a page's filename we store. */
+#define GOSP_STATUS_NAME_LEN 512
+
+/* Define the upper bound (in microseconds) of each latency-histogram bucket.
+ * The final bucket is unbounded. */
+static const apr_interval_time_t bucket_bounds[] = {
+  100, 250, 500,
+  1000, 2500, 5000,
+  10000, 25000, 50000,
+  100000, 250000, 500000,
+  1000000, 2500000, 5000000,
+  10000000
+};
+#define GOSP_STATUS_BUCKETS (sizeof(bucket_bounds)/sizeof(bucket_bounds[0]) + 1)
+
+/* Name each phase of a request. */
+static const char *phase_names[GOSP_PHASE_COUNT] = {
+  "check", "connect", "send", "generate", "receive", "write", "total"
+};
+
+/* Define the states an entry in the scoreboard can be in. */
+#define SLOT_FREE     0    /* Slot has never been used */
+#define SLOT_CLAIMING 1    /* Slot is being initialized */
+#define SLOT_IN_USE   2    /* Slot contains statistics for a page */
+
+/* Define the statistics we maintain for each page.  All counters are updated
+ * atomically. */
+typedef struct {
+  volatile apr_uint32_t state;             /* One of the SLOT_* values */
+  char filename[GOSP_STATUS_NAME_LEN];     /* Name of the Gosp page */
+  volatile apr_uint32_t requests;          /* Number of requests served */
+  volatile apr_uint32_t errors;            /* Number of requests that failed with a 5xx status */
+  volatile apr_uint32_t compiles;          /* Number of times the page was compiled */
+  volatile apr_uint32_t compile_failures;  /* Number of failed compilations */
+  volatile apr_uint32_t compile_msecs;     /* Total compilation time in milliseconds */
+  volatile apr_uint32_t launches;          /* Number of times a Gosp server was launched */
+  volatile apr_uint32_t kills;             /* Number of times a Gosp server was killed */
+  volatile apr_uint32_t server_pid;        /* Process ID of the current Gosp server, or 0 if unknown */
+  volatile apr_uint32_t server_start;      /* Time in seconds since the epoch at which the server was launched */
+  volatile apr_uint32_t latency[GOSP_PHASE_COUNT][GOSP_STATUS_BUCKETS];  /* Latency histograms */
+} page_stats_t;
+
+/* Define the shared-memory scoreboard as a whole. */
+typedef struct {
+  apr_time_t created;                      /* Time at which the scoreboard was created */
+  volatile apr_uint32_t overflows;         /* Number of requests to pages that didn't fit */
+  page_stats_t pages[GOSP_STATUS_MAX_PAGES];  /* Per-page statistics */
+} scoreboard_t;
+
+/* Point to the scoreboard in shared memory.  This is inherited by all child
+ * processes. */
+static scoreboard_t *scoreboard = NULL;
+
+/* Enumerate the phases of a request that the Gosp server times. */
+typedef enum {
+  SERVER_PHASE_DECODE,         /* Receiving and decoding the request */
+  SERVER_PHASE_PAGE,           /* Generating the page */
+  SERVER_PHASE_COMPRESS,       /* Compressing the page body */
+  SERVER_PHASE_METADATA,       /* Writing metadata */
+  SERVER_PHASE_COUNT           /* Number of phases; not itself a phase */
+} server_phase_t;
+
+/* Name each phase of a request as reported by the Gosp server. */
+static const char *server_phase_names[SERVER_PHASE_COUNT] = {
+  "decode", "page", "compress", "metadata"
+};
+
+/* Define the timing information we maintain for each request. */
+typedef struct {
+  apr_time_t start;                        /* Time at which the request began */
+  apr_time_t mark;                         /* Time at which the current phase began */
+  apr_interval_time_t phase[GOSP_PHASE_COUNT];   /* Time spent in each phase */
+  apr_time_t phase_start[GOSP_PHASE_COUNT];      /* Time at which each phase first began, or 0 if it didn't */
+  apr_interval_time_t server[SERVER_PHASE_COUNT];  /* Time the Gosp server spent in each phase, or -1 if not reported */
+  int awaiting_first_byte;                 /* 1=request sent but no response yet; 0=otherwise */
+} request_timing_t;
+
+/* Create the scoreboard in shared memory.  This should be called from the
+ * post-configuration hook so all child processes inherit the scoreboard. */
+gosp_status_t scoreboard_create(server_rec *s, apr_pool_t *pconf)
+{
+  apr_shm_t *shm;                     /* Shared-memory segment */
+  gosp_server_config_t *sconfig;      /* Server configuration */
+  const char *shm_name;               /* Name of a file to back the shared memory, if needed */
+  apr_status_t status;                /* Status of an APR call */
+
+  /* Prefer anonymous shared memory but fall back to file-backed shared
+   * memory if necessary. */
+  status = apr_shm_create(&shm, sizeof(scoreboard_t), NULL, pconf);
+  if (status == APR_ENOTIMPL) {
+    sconfig = ap_get_module_config(s->module_config, &gosp_module);
+    shm_name = concatenate_filepaths(s, pconf, sconfig->work_dir, "status.shm", NULL);
+    if (shm_name == NULL)
+      return GOSP_STATUS_FAIL;
+    (void) apr_shm_remove(shm_name, pconf);
+    status = apr_shm_create(&shm, sizeof(scoreboard_t), shm_name, pconf);
+  }
+  if (status != APR_SUCCESS)
+    REPORT_SERVER_ERROR(GOSP_STATUS_FAIL, APLOG_ERR, status,
+                        "Failed to create the Gosp status scoreboard");
+  scoreboard = (scoreboard_t *) apr_shm_baseaddr_get(shm);
+  memset(scoreboard, 0, sizeof(scoreboard_t));
+  scoreboard->created = apr_time_now();
+  return GOSP_STATUS_OK;
+}
+
+/* Return the scoreboard entry for a given page, allocating one if
+ * necessary.  Return NULL if the scoreboard is full or doesn't exist. */
+static page_stats_t *find_page(const char *filename)
+{
+  apr_uint32_t hash = 5381;     /* Hash of the filename (djb2) */
+  const char *c;                /* Pointer into filename */
+  int i;
+
+  if (scoreboard == NULL || filename == NULL)
+    return NULL;
+  for (c = filename; *c != '\0'; c++)
+    hash = hash*33 + (unsigned char)*c;
+
+  /* Probe linearly from the hashed slot. */
+  for (i = 0; i < GOSP_STATUS_MAX_PAGES; i++) {
+    page_stats_t *page = &scoreboard->pages[(hash + i)%GOSP_STATUS_MAX_PAGES];
+    apr_uint32_t state;         /* Slot's current state */
+
+    /* Claim the slot if it's free. */
+    state = apr_atomic_cas32(&page->state, SLOT_CLAIMING, SLOT_FREE);
+    if (state == SLOT_FREE) {
+      apr_cpystrn(page->filename, filename, GOSP_STATUS_NAME_LEN);
+      apr_atomic_set32(&page->state, SLOT_IN_USE);
+      return page;
+    }
+
+    /* Wait for another process to finish claiming the slot then see if it's
+     * ours. */
+    while (apr_atomic_read32(&page->state) == SLOT_CLAIMING)
+      ;
+    if (strncmp(page->filename, filename, GOSP_STATUS_NAME_LEN - 1) == 0)
+      return page;
+  }
+  apr_atomic_inc32(&scoreboard->overflows);
+  return NULL;
+}
+
+/* Return the timing information associated with a request or NULL if the
+ * request is not being timed. */
+static request_timing_t *timing_for(request_rec *r)
+{
+  return (request_timing_t *) ap_get_module_config(r->request_config, &gosp_module);
+}
+
+/* Begin timing a request. */
+void scoreboard_begin_request(request_rec *r)
+{
+  request_timing_t *timing;     /* Timing information for r */
+  int p;
+
+  timing = (request_timing_t *) apr_pcalloc(r->pool, sizeof(request_timing_t));
+  timing->start = apr_time_now();
+  timing->mark = timing->start;
+  for (p = 0; p < SERVER_PHASE_COUNT; p++)
+    timing->server[p] = -1;
+  ap_set_module_config(r->request_config, &gosp_module, timing);
+}
+
+/* Note that a new phase of a request is beginning. */
+void scoreboard_phase_begin(request_rec *r)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+
+  if (timing != NULL)
+    timing->mark = apr_time_now();
+}
+
+/* Charge the time since the previous mark to a given phase of a request. */
+void scoreboard_phase_end(request_rec *r, gosp_phase_t phase)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+  apr_time_t now;               /* Current time */
+
+  if (timing == NULL)
+    return;
+  now = apr_time_now();
+  if (timing->phase_start[phase] == 0)
+    timing->phase_start[phase] = timing->mark;
+  timing->phase[phase] += now - timing->mark;
+  timing->mark = now;
+  timing->awaiting_first_byte = phase == GOSP_PHASE_SEND;
+}
+
+/* Note that the first byte of a response has arrived from the Gosp server.
+ * This ends the generate phase if a page request is outstanding. */
+void scoreboard_first_byte(request_rec *r)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+
+  if (timing != NULL && timing->awaiting_first_byte)
+    scoreboard_phase_end(r, GOSP_PHASE_GENERATE);
+}
+
+/* Return 1 if the Gosp server should report how long it spent in each phase
+ * of the current request, 0 otherwise. */
+int timing_wanted(request_rec *r)
+{
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  gosp_context_config_t *cconfig;  /* Context configuration */
+
+  if (timing_for(r) == NULL)
+    return 0;
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  cconfig = ap_get_module_config(r->per_dir_config, &gosp_module);
+  return cconfig->server_timing == 1 || sconfig->trace_log != NULL;
+}
+
+/* Record a "server-timing" metadata value, which has the form "<phase>
+ * <microseconds>", from the Gosp server. */
+void timing_note_server(request_rec *r, const char *value)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+  const char *usecs;            /* Textual number of microseconds */
+  int p;
+
+  if (timing == NULL)
+    return;
+  usecs = strchr(value, ' ');
+  if (usecs == NULL)
+    return;
+  for (p = 0; p < SERVER_PHASE_COUNT; p++)
+    if (strncmp(value, server_phase_names[p], usecs - value) == 0 &&
+        server_phase_names[p][usecs - value] == '\0') {
+      timing->server[p] = (apr_interval_time_t) apr_atoi64(usecs + 1);
+      break;
+    }
+}
+
+/* If so configured, report the time spent so far in each phase of the
+ * current request in a Server-Timing header. */
+void timing_set_header(request_rec *r)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+  gosp_context_config_t *cconfig;  /* Context configuration */
+  const char *header = NULL;    /* Value of the Server-Timing header */
+  int p;
+
+  /* Do nothing unless a Server-Timing header was requested. */
+  if (timing == NULL)
+    return;
+  cconfig = ap_get_module_config(r->per_dir_config, &gosp_module);
+  if (cconfig->server_timing != 1)
+    return;
+
+  /* Report each phase the module has timed. */
+  for (p = 0; p < GOSP_PHASE_WRITE; p++) {
+    if (timing->phase_start[p] == 0)
+      continue;
+    header = apr_psprintf(r->pool, "%s%sgosp-%s;dur=%.3f",
+                          header == NULL ? "" : header, header == NULL ? "" : ", ",
+                          phase_names[p], (double)timing->phase[p]/1000.0);
+  }
+
+  /* Report each phase the Gosp server has timed. */
+  for (p = 0; p < SERVER_PHASE_COUNT; p++) {
+    if (timing->server[p] < 0)
+      continue;
+    header = apr_psprintf(r->pool, "%s%sgosp-server-%s;dur=%.3f",
+                          header == NULL ? "" : header, header == NULL ? "" : ", ",
+                          server_phase_names[p], (double)timing->server[p]/1000.0);
+  }
+  if (header != NULL)
+    apr_table_add(r->headers_out, "Server-Timing", header);
+}
+
+/* Append a trace event to a buffer in the Trace Event Format understood by
+ * Chrome's and Perfetto's trace viewers.  The event's name and the request's
+ * URI are JSON-escaped; the category must not need escaping. */
+static void append_trace_event(request_rec *r, gosp_buffer_t *buf, const char *category,
+                               const char *name, apr_time_t ts, apr_interval_time_t dur)
+{
+  buffer_printf(buf, "{\"name\": \"");
+  buffer_append_json(buf, name, strlen(name));
+  buffer_printf(buf,
+                "\", \"cat\": \"%s\", \"ph\": \"X\", "
+                "\"ts\": %" APR_TIME_T_FMT ", \"dur\": %" APR_TIME_T_FMT ", "
+                "\"pid\": %ld, \"tid\": %ld, "
+                "\"args\": {\"uri\": \"",
+                category, ts, dur,
+                (long) getpid(), (long) r->connection->id);
+  buffer_append_json(buf, r->uri, strlen(r->uri));
+  buffer_printf(buf, "\", \"status\": %d}},\n", r->status);
+}
+
+/* Append a request's timing information to the trace log.  Module phases
+ * appear in the order they occurred.  Gosp-server phases are positioned
+ * relative to the time the request was sent to the Gosp server. */
+static void write_trace(request_rec *r, request_timing_t *timing)
+{
+  gosp_server_config_t *sconfig;   /* Server configuration */
+  gosp_buffer_t *buf;           /* Trace events */
+  apr_time_t ts;                /* Start time of a server phase */
+  apr_size_t len;               /* Number of bytes to write */
+  int p;
+
+  /* Do nothing if we have nowhere to write the trace. */
+  sconfig = ap_get_module_config(r->server->module_config, &gosp_module);
+  if (sconfig->trace_log == NULL)
+    return;
+
+  /* Construct a trace event for the request as a whole and for each
+   * module-side phase. */
+  buf = buffer_create(r->pool, 2048);
+  append_trace_event(r, buf, "gosp", r->filename,
+                     timing->start, timing->phase[GOSP_PHASE_TOTAL]);
+  for (p = 0; p < GOSP_PHASE_TOTAL; p++)
+    if (timing->phase_start[p] != 0)
+      append_trace_event(r, buf, "gosp", phase_names[p],
+                         timing->phase_start[p], timing->phase[p]);
+
+  /* Construct a trace event for each server-side phase. */
+  ts = timing->phase_start[GOSP_PHASE_SEND];
+  if (ts != 0) {
+    if (timing->server[SERVER_PHASE_DECODE] >= 0) {
+      append_trace_event(r, buf, "gosp-server", server_phase_names[SERVER_PHASE_DECODE],
+                         ts, timing->server[SERVER_PHASE_DECODE]);
+      ts += timing->server[SERVER_PHASE_DECODE];
+    }
+    for (p = SERVER_PHASE_PAGE; p < SERVER_PHASE_COUNT; p++)
+      if (timing->server[p] >= 0)
+        append_trace_event(r, buf, "gosp-server", server_phase_names[p],
+                           ts, timing->server[p]);
+  }
+
+  /* Write all of the events with a single call so they appear together. */
+  len = buf->len;
+  (void) apr_file_write_full(sconfig->trace_log, buf->data, len, NULL);
+}
+
+/* Return a latency histogram bucket number for a given duration. */
+static int bucket_for(apr_interval_time_t duration)
+{
+  int i;
+
+  for (i = 0; i < GOSP_STATUS_BUCKETS - 1; i++)
+    if (duration <= bucket_bounds[i])
+      break;
+  return i;
+}
+
+/* Record a completed request in the scoreboard. */
+void scoreboard_end_request(request_rec *r, int http_status)
+{
+  request_timing_t *timing = timing_for(r);   /* Timing information for r */
+  page_stats_t *page;           /* Statistics for the requested page */
+  int p;
+
+  if (timing == NULL)
+    return;
+  timing->phase[GOSP_PHASE_TOTAL] = apr_time_now() - timing->start;
+  write_trace(r, timing);
+  page = find_page(r->filename);
+  if (page == NULL)
+    return;
+  for (p = 0; p < GOSP_PHASE_COUNT; p++)
+    apr_atomic_inc32(&page->latency[p][bucket_for(timing->phase[p])]);
+  apr_atomic_inc32(&page->requests);
+  if (http_status >= 500 || r->status >= 500)
+    apr_atomic_inc32(&page->errors);
+}
+
+/* Record a compilation of the requested page. */
+void scoreboard_note_compile(request_rec *r, apr_interval_time_t duration, int success)
+{
+  page_stats_t *page = find_page(r->filename);   /* Statistics for the requested page */
+
+  if (page == NULL)
+    return;
+  apr_atomic_inc32(&page->compiles);
+  apr_atomic_add32(&page->compile_msecs, (apr_uint32_t) apr_time_as_msec(duration));
+  if (!success)
+    apr_atomic_inc32(&page->compile_failures);
+}
+
+/* Record the launch of a Gosp server for the requested page. */
+void scoreboard_note_launch(request_rec *r)
+{
+  page_stats_t *page = find_page(r->filename);   /* Statistics for the requested page */
+
+  if (page == NULL)
+    return;
+  apr_atomic_inc32(&page->launches);
+  apr_atomic_set32(&page->server_pid, 0);
+  apr_atomic_set32(&page->server_start, (apr_uint32_t) apr_time_sec(apr_time_now()));
+}
+
+/* Record that the Gosp server for the requested page was killed. */
+void scoreboard_note_kill(request_rec *r)
+{
+  page_stats_t *page = find_page(r->filename);   /* Statistics for the requested page */
+
+  if (page == NULL)
+    return;
+  apr_atomic_inc32(&page->kills);
+  apr_atomic_set32(&page->server_pid, 0);
+}
+
+/* Record the process ID of the Gosp server for the requested page. */
+void scoreboard_note_server(request_rec *r, int pid)
+{
+  page_stats_t *page = find_page(r->filename);   /* Statistics for the requested page */
+
+  if (page != NULL)
+    apr_atomic_set32(&page->server_pid, (apr_uint32_t) pid);
+}
+
+/* Estimate a quantile of a latency histogram as the upper bound of the bucket
+ * containing it.  Return -1 for the unbounded bucket and 0 for an empty
+ * histogram. */
+static apr_interval_time_t estimate_quantile(const volatile apr_uint32_t *hist, double q)
+{
+  apr_uint64_t total = 0;       /* Total number of samples */
+  apr_uint64_t sum = 0;         /* Running sum of samples */
+  int i;
+
+  for (i = 0; i < GOSP_STATUS_BUCKETS; i++)
+    total += hist[i];
+  if (total == 0)
+    return 0;
+  for (i = 0; i < GOSP_STATUS_BUCKETS - 1; i++) {
+    sum += hist[i];
+    if ((double)sum >= q*(double)total)
+      return bucket_bounds[i];
+  }
+  return -1;
+}
+
+/* Format a quantile estimate in milliseconds for HTML output. */
+static const char *format_quantile(request_rec *r, apr_interval_time_t usecs)
+{
+  if (usecs < 0)
+    return apr_psprintf(r->pool, "&gt;%.1f", (double)bucket_bounds[GOSP_STATUS_BUCKETS - 2]/1000.0);
+  return apr_psprintf(r->pool, "&le;%.1f", (double)usecs/1000.0);
+}
+
+/* Return the PID of a page's Gosp server if it's still running or 0 if
+ * not. */
+static int live_server_pid(page_stats_t *page)
+{
+  apr_proc_t proc;              /* Gosp server process */
+
+  proc.pid = (pid_t) apr_atomic_read32(&page->server_pid);
+  if (proc.pid <= 0)
+    return 0;
+  if (APR_TO_OS_ERROR(apr_proc_kill(&proc, 0)) == ESRCH)
+    return 0;
+  return proc.pid;
+}
+
+/* Output the scoreboard in a machine-readable format. */
+static void report_text(request_rec *r)
+{
+  apr_time_t now = apr_time_now();   /* Current time */
+  int i, p, b;
+
+  ap_set_content_type(r, "text/plain; charset=utf-8");
+  ap_rprintf(r, "Uptime: %" APR_TIME_T_FMT "\n", apr_time_sec(now - scoreboard->created));
+  ap_rprintf(r, "Overflows: %u\n", apr_atomic_read32(&scoreboard->overflows));
+  ap_rputs("BucketBoundsUSec:", r);
+  for (b = 0; b < GOSP_STATUS_BUCKETS - 1; b++)
+    ap_rprintf(r, " %" APR_TIME_T_FMT, bucket_bounds[b]);
+  ap_rputs(" +Inf\n", r);
+  for (i = 0; i < GOSP_STATUS_MAX_PAGES; i++) {
+    page_stats_t *page = &scoreboard->pages[i];
+    apr_uint32_t start;         /* Time at which the page's server was launched */
+    int pid;                    /* Process ID of the page's server */
+
+    if (apr_atomic_read32(&page->state) != SLOT_IN_USE)
+      continue;
+    pid = live_server_pid(page);
+    start = apr_atomic_read32(&page->server_start);
+    ap_rprintf(r, "\nPage: %s\n", page->filename);
+    ap_rprintf(r, "Requests: %u\n", apr_atomic_read32(&page->requests));
+    ap_rprintf(r, "Errors: %u\n", apr_atomic_read32(&page->errors));
+    ap_rprintf(r, "Compiles: %u\n", apr_atomic_read32(&page->compiles));
+    ap_rprintf(r, "CompileFailures: %u\n", apr_atomic_read32(&page->compile_failures));
+    ap_rprintf(r, "CompileMSec: %u\n", apr_atomic_read32(&page->compile_msecs));
+    ap_rprintf(r, "Launches: %u\n", apr_atomic_read32(&page->launches));
+    ap_rprintf(r, "Kills: %u\n", apr_atomic_read32(&page->kills));
+    ap_rprintf(r, "ServerPID: %d\n", pid);
+    ap_rprintf(r, "ServerUptime: %ld\n",
+               pid == 0 || start == 0 ? 0L : (long)(apr_time_sec(now) - start));
+    for (p = 0; p < GOSP_PHASE_COUNT; p++) {
+      ap_rprintf(r, "Latency-%s:", phase_names[p]);
+      for (b = 0; b < GOSP_STATUS_BUCKETS; b++)
+        ap_rprintf(r, " %u", apr_atomic_read32(&page->latency[p][b]));
+      ap_rputs("\n", r);
+    }
+  }
+}
+
+/* Output the scoreboard as an HTML page. */
+static void report_html(request_rec *r)
+{
+  apr_time_t now = apr_time_now();   /* Current time */
+  int i, p;
+
+  ap_set_content_type(r, "text/html; charset=utf-8");
+  ap_rputs("<!DOCTYPE html>\n<html>\n<head>\n<title>Gosp Status</title>\n</head>\n<body>\n", r);
+  ap_rputs("<h1>Gosp Status</h1>\n", r);
+  ap_rprintf(r, "<p>Statistics collected over the past %" APR_TIME_T_FMT " seconds.",
+             apr_time_sec(now - scoreboard->created));
+  if (apr_atomic_read32(&scoreboard->overflows) > 0)
+    ap_rprintf(r, "  %u requests were not recorded because the scoreboard is full.",
+               apr_atomic_read32(&scoreboard->overflows));
+  ap_rputs("  Latencies are upper bounds in milliseconds.</p>\n", r);
+  for (i = 0; i < GOSP_STATUS_MAX_PAGES; i++) {
+    page_stats_t *page = &scoreboard->pages[i];
+    apr_uint32_t compiles;      /* Number of compilations */
+    apr_uint32_t start;         /* Time at which the page's server was launched */
+    int pid;                    /* Process ID of the page's server */
+
+    if (apr_atomic_read32(&page->state) != SLOT_IN_USE)
+      continue;
+    pid = live_server_pid(page);
+    start = apr_atomic_read32(&page->server_start);
+    compiles = apr_atomic_read32(&page->compiles);
+    ap_rprintf(r, "<h2>%s</h2>\n", ap_escape_html(r->pool, page->filename));
+    ap_rputs("<table border=\"1\">\n", r);
+    ap_rputs("<tr><th>Requests</th><th>Errors</th><th>Compiles</th><th>Failed compiles</th>"
+             "<th>Mean compile time (ms)</th><th>Launches</th><th>Kills</th>"
+             "<th>Server PID</th><th>Server uptime (s)</th></tr>\n", r);
+    ap_rprintf(r, "<tr><td>%u</td><td>%u</td><td>%u</td><td>%u</td><td>%u</td>"
+               "<td>%u</td><td>%u</td>",
+               apr_atomic_read32(&page->requests),
+               apr_atomic_read32(&page->errors),
+               compiles,
+               apr_atomic_read32(&page->compile_failures),
+               compiles == 0 ? 0 : apr_atomic_read32(&page->compile_msecs)/compiles,
+               apr_atomic_read32(&page->launches),
+               apr_atomic_read32(&page->kills));
+    if (pid == 0)
+      ap_rputs("<td>&mdash;</td><td>&mdash;</td></tr>\n", r);
+    else
+      ap_rprintf(r, "<td>%d</td><td>%ld</td></tr>\n",
+                 pid, start == 0 ? 0L : (long)(apr_time_sec(now) - start));
+    ap_rputs("</table>\n<table border=\"1\">\n", r);
+    ap_rputs("<tr><th>Phase</th><th>p50</th><th>p90</th><th>p99</th></tr>\n", r);
+    for (p = 0; p < GOSP_PHASE_COUNT; p++)
+      ap_rprintf(r, "<tr><td>%s</td><td>%s</td><td>%s</td><td>%s</td></tr>\n",
+                 phase_names[p],
+                 format_quantile(r, estimate_quantile(page->latency[p], 0.50)),
+                 format_quantile(r, estimate_quantile(page->latency[p], 0.90)),
+                 format_quantile(r, estimate_quantile(page->latency[p], 0.99)));
+    ap_rputs("</table>\n", r);
+  }
+  ap_rputs("</body>\n</html>\n", r);
+}
+
+/* Handle requests of type "gosp-status" by reporting the contents of the
+ * scoreboard.  A query string of "auto" produces machine-readable output. */
+int gosp_status_handler(request_rec *r)
+{
+  if (strcmp(r->handler, "gosp-status"))
+    return DECLINED;
+  if (scoreboard == NULL)
+    REPORT_REQUEST_ERROR(HTTP_SERVICE_UNAVAILABLE, APLOG_ERR, APR_SUCCESS,
+                         "The Gosp status scoreboard is not available");
+  r->allowed = (AP_METHOD_BIT << M_GET);
+  if (r->method_number != M_GET)
+    return DECLINED;
+  if (r->header_only)
+    return OK;
+  if (r->args != NULL && strcmp(r->args, "auto") == 0)
+    report_text(r);
+  else
+    report_html(r);
+  return OK;
+}
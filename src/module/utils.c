@@ -7,6 +7,12 @@
 
 #include "gosp.h"
 
+/* Use SSE2 and AVX2 kernels when compiling for x86 with GCC or Clang. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define GOSP_X86_SIMD
+# include <immintrin.h>
+#endif
+
 /* Create a directory hierarchy in which to store the given file.  If is_dir =
  * 1, the last component of the file path is itself a directory. */
 gosp_status_t create_directories_for(server_rec *s, apr_pool_t *pool, const char *fname, int is_dir)
@@ -113,6 +119,37 @@ int is_newer_than(request_rec *r, const char *first, const char *second)
   return finfo1.mtime > finfo2.mtime;
 }
 
+/* Return 1 if a file lies within or below a given directory, 0 if not, or -1
+ * on error.  Symbolic links in both names are resolved first. */
+int lies_in_or_below(request_rec *r, const char *child, const char *parent)
+{
+  char *real_child;     /* Canonicalized version of child */
+  char *real_parent;    /* Canonicalized version of parent */
+  size_t plen;          /* Length of real_parent */
+  int result;           /* Function return value */
+
+  /* Canonicalize both filenames. */
+  real_child = realpath(child, NULL);
+  if (real_child == NULL)
+    return -1;
+  real_parent = realpath(parent, NULL);
+  if (real_parent == NULL) {
+    free(real_child);
+    return -1;
+  }
+
+  /* Check if the parent is a prefix of the child. */
+  plen = strlen(real_parent);
+  if (strcmp(real_parent, "/") == 0)
+    result = 1;
+  else
+    result = strncmp(real_child, real_parent, plen) == 0
+      && (real_child[plen] == '/' || real_child[plen] == '\0');
+  free(real_child);
+  free(real_parent);
+  return result;
+}
+
 /* Acquire the global lock.  Return GOSP_STATUS_OK on success or
  * GOSP_STATUS_FAIL on failure. */
 gosp_status_t acquire_global_lock(server_rec *s)
@@ -178,3 +215,223 @@ const char **append_string(apr_pool_t *p, const char *const *list, const char *s
   *elt1 = NULL;
   return new_list;
 }
+
+/* Allocate a new buffer with room for at least cap bytes of data. */
+gosp_buffer_t *buffer_create(apr_pool_t *pool, apr_size_t cap)
+{
+  gosp_buffer_t *buf;            /* Buffer to return */
+
+  buf = (gosp_buffer_t *) apr_palloc(pool, sizeof(gosp_buffer_t));
+  buf->pool = pool;
+  buf->cap = cap + 1;
+  buf->data = apr_palloc(pool, buf->cap);
+  buf->data[0] = '\0';
+  buf->len = 0;
+  return buf;
+}
+
+/* Ensure a buffer has room for at least extra more bytes of data. */
+void buffer_reserve(gosp_buffer_t *buf, apr_size_t extra)
+{
+  apr_size_t new_cap;            /* New buffer capacity */
+  char *new_data;                /* New buffer contents */
+
+  if (buf->len + extra + 1 <= buf->cap)
+    return;
+  new_cap = buf->cap*2;
+  if (new_cap < buf->len + extra + 1)
+    new_cap = buf->len + extra + 1;
+  new_data = apr_palloc(buf->pool, new_cap);
+  memcpy(new_data, buf->data, buf->len + 1);
+  buf->data = new_data;
+  buf->cap = new_cap;
+}
+
+/* Append len bytes of data to a buffer. */
+void buffer_append(gosp_buffer_t *buf, const char *data, apr_size_t len)
+{
+  buffer_reserve(buf, len);
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+/* Append printf-formatted text to a buffer. */
+void buffer_printf(gosp_buffer_t *buf, const char *fmt, ...)
+{
+  va_list ap;                    /* Argument pointer */
+  int n;                         /* Number of bytes that were or would be written */
+
+  /* Try formatting into the existing space.  If it doesn't fit, grow the
+   * buffer and try again. */
+  va_start(ap, fmt);
+  n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+  va_end(ap);
+  if (n < 0) {
+    buf->data[buf->len] = '\0';
+    return;
+  }
+  if ((apr_size_t) n >= buf->cap - buf->len) {
+    buffer_reserve(buf, (apr_size_t) n);
+    va_start(ap, fmt);
+    (void) vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+  }
+  buf->len += (apr_size_t) n;
+}
+
+/* Return the length of the longest prefix of len bytes of data that can
+ * appear in a JSON string without escaping.  This is the portable version. */
+static apr_size_t json_safe_prefix_scalar(const char *data, apr_size_t len)
+{
+  apr_size_t i;                  /* Index into data */
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) data[i];
+    if (c < 0x20 || c == '"' || c == '\\')
+      break;
+  }
+  return i;
+}
+
+#ifdef GOSP_X86_SIMD
+
+/* Return the length of the longest prefix of len bytes of data that can
+ * appear in a JSON string without escaping.  This version examines 16 bytes
+ * at a time. */
+__attribute__((target("sse2")))
+static apr_size_t json_safe_prefix_sse2(const char *data, apr_size_t len)
+{
+  const __m128i quote = _mm_set1_epi8('"');     /* Vector of double quotes */
+  const __m128i bslash = _mm_set1_epi8('\\');  /* Vector of backslashes */
+  const __m128i ctrl = _mm_set1_epi8(0x1F);     /* Vector of the largest control character */
+  apr_size_t i;                  /* Index into data */
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                          _mm_cmpeq_epi8(v, bslash)),
+                             _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+    unsigned int bits = (unsigned int) _mm_movemask_epi8(m);
+    if (bits != 0)
+      return i + __builtin_ctz(bits);
+  }
+  return i + json_safe_prefix_scalar(data + i, len - i);
+}
+
+/* Return the length of the longest prefix of len bytes of data that can
+ * appear in a JSON string without escaping.  This version examines 32 bytes
+ * at a time. */
+__attribute__((target("avx2")))
+static apr_size_t json_safe_prefix_avx2(const char *data, apr_size_t len)
+{
+  const __m256i quote = _mm256_set1_epi8('"');     /* Vector of double quotes */
+  const __m256i bslash = _mm256_set1_epi8('\\');  /* Vector of backslashes */
+  const __m256i ctrl = _mm256_set1_epi8(0x1F);     /* Vector of the largest control character */
+  apr_size_t i;                  /* Index into data */
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                _mm256_cmpeq_epi8(v, bslash)),
+                                _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+    unsigned int bits = (unsigned int) _mm256_movemask_epi8(m);
+    if (bits != 0)
+      return i + __builtin_ctz(bits);
+  }
+  return i + json_safe_prefix_scalar(data + i, len - i);
+}
+
+#endif
+
+/* Select the fastest json_safe_prefix_*() function the CPU supports. */
+static apr_size_t json_safe_prefix_select(const char *data, apr_size_t len);
+
+/* Function to use to find the next character that needs escaping.  This is
+ * resolved on first use.  Threads that race to resolve it store the same
+ * value. */
+static apr_size_t (*json_safe_prefix)(const char *, apr_size_t) = json_safe_prefix_select;
+
+static apr_size_t json_safe_prefix_select(const char *data, apr_size_t len)
+{
+#ifdef GOSP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    json_safe_prefix = json_safe_prefix_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    json_safe_prefix = json_safe_prefix_sse2;
+  else
+    json_safe_prefix = json_safe_prefix_scalar;
+#else
+  json_safe_prefix = json_safe_prefix_scalar;
+#endif
+  return json_safe_prefix(data, len);
+}
+
+/* Append len bytes of data to a buffer, escaped for inclusion in a JSON
+ * string.  The enclosing double quotes are not appended. */
+void buffer_append_json(gosp_buffer_t *buf, const char *data, apr_size_t len)
+{
+  static const char hex[] = "0123456789abcdef";  /* Hexadecimal digits */
+  char esc[6];                   /* A single escaped character */
+  apr_size_t run;                /* Number of bytes that need no escaping */
+
+  /* Most strings need little or no escaping, so reserve space for the
+   * unescaped string up front. */
+  buffer_reserve(buf, len);
+  while (len > 0) {
+    /* Copy a run of characters verbatim. */
+    run = json_safe_prefix(data, len);
+    buffer_append(buf, data, run);
+    data += run;
+    len -= run;
+    if (len == 0)
+      break;
+
+    /* Escape the character that ended the run. */
+    esc[0] = '\\';
+    switch (*data) {
+    case '"':
+    case '\\':
+      esc[1] = *data;
+      buffer_append(buf, esc, 2);
+      break;
+
+    case '\b':
+      esc[1] = 'b';
+      buffer_append(buf, esc, 2);
+      break;
+
+    case '\f':
+      esc[1] = 'f';
+      buffer_append(buf, esc, 2);
+      break;
+
+    case '\n':
+      esc[1] = 'n';
+      buffer_append(buf, esc, 2);
+      break;
+
+    case '\r':
+      esc[1] = 'r';
+      buffer_append(buf, esc, 2);
+      break;
+
+    case '\t':
+      esc[1] = 't';
+      buffer_append(buf, esc, 2);
+      break;
+
+    default:
+      esc[1] = 'u';
+      esc[2] = '0';
+      esc[3] = '0';
+      esc[4] = hex[((unsigned char) *data) >> 4];
+      esc[5] = hex[((unsigned char) *data) & 0xF];
+      buffer_append(buf, esc, 6);
+      break;
+    }
+    data++;
+    len--;
+  }
+}